@@ -1,12 +1,24 @@
-#include <memory.h>
-#include <printf.h>
+#include <string.h>
+#include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <strings.h>
 #include "ChipCPU.h"
+#include "log.h"
+#include "native.h"
+#include "profile.h"
 //
 // Created by Tristan Possessky on 10/24/25.
 //
 
+// Colors of the XO-CHIP plane combinations, bit n of the index is plane n. Plane 0
+// alone keeps the classic white on black.
+const uint32_t cpuPalette[1 << DISPLAY_PLANES] = {
+    0xFF000000, 0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555,
+    0xFFFF4040, 0xFF40FF40, 0xFF4040FF, 0xFFFFFF40,
+    0xFF802020, 0xFF208020, 0xFF202080, 0xFF808020,
+    0xFFFF40FF, 0xFF40FFFF, 0xFF802080, 0xFF208080,
+};
+
 uint8_t font_sprites[FONT_ARRAY_SIZE] = {
         0xF0,0x90,0x90,0x90,0xF0, // 0
         0x20,0x60,0x20,0x20,0x70, // 1
@@ -26,299 +38,1561 @@ uint8_t font_sprites[FONT_ARRAY_SIZE] = {
         0xF0,0x80,0xF0,0x80,0x80  // F
 };
 
+// SUPER-CHIP 8x10 digits, XO-CHIP adds A-F
+uint8_t big_font_sprites[BIG_FONT_ARRAY_SIZE] = {
+        0xFF,0xFF,0xC3,0xC3,0xC3,0xC3,0xC3,0xC3,0xFF,0xFF, // 0
+        0x18,0x78,0x78,0x18,0x18,0x18,0x18,0x18,0xFF,0xFF, // 1
+        0xFF,0xFF,0x03,0x03,0xFF,0xFF,0xC0,0xC0,0xFF,0xFF, // 2
+        0xFF,0xFF,0x03,0x03,0xFF,0xFF,0x03,0x03,0xFF,0xFF, // 3
+        0xC3,0xC3,0xC3,0xC3,0xFF,0xFF,0x03,0x03,0x03,0x03, // 4
+        0xFF,0xFF,0xC0,0xC0,0xFF,0xFF,0x03,0x03,0xFF,0xFF, // 5
+        0xFF,0xFF,0xC0,0xC0,0xFF,0xFF,0xC3,0xC3,0xFF,0xFF, // 6
+        0xFF,0xFF,0x03,0x03,0x06,0x0C,0x18,0x18,0x18,0x18, // 7
+        0xFF,0xFF,0xC3,0xC3,0xFF,0xFF,0xC3,0xC3,0xFF,0xFF, // 8
+        0xFF,0xFF,0xC3,0xC3,0xFF,0xFF,0x03,0x03,0xFF,0xFF, // 9
+        0x7E,0xFF,0xC3,0xC3,0xC3,0xFF,0xFF,0xC3,0xC3,0xC3, // A
+        0xFC,0xFC,0xC3,0xC3,0xFC,0xFC,0xC3,0xC3,0xFC,0xFC, // B
+        0x3C,0xFF,0xC3,0xC0,0xC0,0xC0,0xC0,0xC3,0xFF,0x3C, // C
+        0xFC,0xFE,0xC3,0xC3,0xC3,0xC3,0xC3,0xC3,0xFE,0xFC, // D
+        0xFF,0xFF,0xC0,0xC0,0xFF,0xFF,0xC0,0xC0,0xFF,0xFF, // E
+        0xFF,0xFF,0xC0,0xC0,0xFF,0xFF,0xC0,0xC0,0xC0,0xC0  // F
+};
+
 
 void skipInstruction(ChipCPU* cpu){
+    // F000 NNNN is four bytes long, skipping it skips both words
+    const uint8_t* memory = cpuMemory(cpu);
+    uint16_t next = cpu->PC & cpu->memoryMask;
+    if (memory[next] == 0xF0 && memory[(next + 1) & cpu->memoryMask] == 0x00) {
+        cpu->PC += 2;
+    }
     cpu->PC += 2;
 }
 void repeatInstruction(ChipCPU* cpu){
     cpu->PC -= 2;
 }
 
- void decodeOperation(uint16_t opcode, ChipCPU* cpu){
-     uint8_t indexX;
-     uint8_t indexY;
-     uint16_t val;
-     //2 byte opcode, take first 4 bits to find operation
-     switch (opcode & 0xF000) {
-         case 0x0000:
-             switch (opcode & 0x00FF) {
-                 case 0x00E0:
-                     cpu->drawFlag = 1;
-                     printf("Clear Screen\n");
-                     break;
-                 case 0x00EE:
-                     //Return from Subroutine
-                     cpu->stackPointer--;
-                     cpu->PC = cpu->stack[cpu->stackPointer];
-                     break;
-                 default:
-                     printf("Invalid opcode!");
-                     break;
-             }
-             break;
-         case 0x1000:
-             //1NNN Jump to address NNN
-             cpu->PC = opcode & 0x0FFF;
-             break;
-         case 0x2000:
-             // 2NNN: Call subroutine at NNN
-             cpu->stack[cpu->stackPointer] = cpu->PC;
-             cpu->stackPointer++;
-             cpu->PC = opcode & 0x0FFF;
-             break;
-         case 0x3000:
-             //3XNN Skip the following instruction if the value of register VX equals NN
-             val = (opcode & 0x00FF);
-             indexX = (opcode & 0x0F00) >> 8;
-             if(cpu->V[indexX] == val){
-                 skipInstruction(cpu);
-             }
-             break;
-         case 0x4000:
-             //4XNN Skip the following instruction if the value of register VX is not equal to NN
-             val = (opcode & 0x00FF);
-             indexX = (opcode & 0x0F00) >> 8;
-             if(cpu->V[indexX] != val){
-                 skipInstruction(cpu);
-             }
-             break;
-         case 0x5000:
-             //5XY0 Skip the following instruction if the value of register VX = VY
-             indexX = (opcode & 0x0F00) >> 8;
-             indexY = (opcode & 0x00F0) >> 4;
-             if(cpu->V[indexX] == cpu->V[indexY]){
-                 skipInstruction(cpu);
-             }
-             break;
-         case 0x6000:
-             //6XNN Store number NN in register VX
-             val = (opcode & 0x00FF);
-             indexX = (opcode & 0x0F00) >> 8;
-             cpu->V[indexX] = val;
-             break;
-         case 0x7000:
-             //7XNN Add the value NN to register VX
-             val = (opcode & 0x00FF);
-             indexX = (opcode & 0x0F00) >> 8;
-             cpu->V[indexX] = cpu->V[indexX] + val;
-             break;
-         case 0x8000:
-             indexX = (opcode & 0x0F00) >> 8;
-             indexY = (opcode & 0x00F0) >> 4;
-             switch (opcode & 0x000F) {
-                 //8XY0 Store the value of register VY in register VX
-                 case 0x0: cpu->V[indexX] = cpu->V[indexY]; break;
-                     //8XY1	Set VX to VX OR VY
-                 case 0x1: cpu->V[indexX] |= cpu->V[indexY]; break;
-                     //8XY2 Set VX to VX AND VY
-                 case 0x2: cpu->V[indexX] &= cpu->V[indexY]; break;
-                     //8XY3 Set VX to VX XOR VY
-                 case 0x3: cpu->V[indexX] ^= cpu->V[indexY]; break;
-                     //8XY4 Add the value of register VY to register VX
-                     //         Set VF to 01 if a carry occurs
-                     //         Set VF to 00 if a carry does not occur
-                 case 0x4: {
-                     uint16_t sum = cpu->V[indexX] + cpu->V[indexY];
-                     cpu->V[0xF] = (sum > 255);
-                     cpu->V[indexX] = sum & 0xFF;
-                     break;
-                 }
-                     //8XY5 Subtract the value of register VY from register VX
-                     //         Set VF to 00 if a borrow occurs
-                     //         Set VF to 01 if a borrow does not occur
-                 case 0x5: {
-                     cpu->V[0xF] = (cpu->V[indexX] >= cpu->V[indexY]) ? 1 : 0;
-                     cpu->V[indexX] = (cpu->V[indexX] - cpu->V[indexY]) & 0xFF;
-                     break;
-                 }
-                     //8XY6 Store the value of register VY shifted right one bit in register VX
-                     //         Set register VF to the least significant bit prior to the shift
-                     //         VY is unchanged
-                 case 0x6:
-                     cpu->V[0xF] = cpu->V[indexX] & 0x1;
-                     cpu->V[indexX] >>= 1;
-                     break;
-                     //8XY7 Set register VX to the value of VY minus VX
-                     //         Set VF to 00 if a borrow occurs
-                     //         Set VF to 01 if a borrow does not occur
-                 case 0x7: {
-                     indexX = (opcode & 0x0F00) >> 8;
-                     indexY = (opcode & 0x00F0) >> 4;
-
-                     cpu->V[0xF] = (cpu->V[indexY] >= cpu->V[indexX]) ? 1 : 0;
-                     cpu->V[indexX] = cpu->V[indexY] - cpu->V[indexX];
-                     break;
-                 }
-                     //8XYE Store the value of register VY shifted left one bit in register VX
-                     //         Set register VF to the most significant bit prior to the shift
-                     //         VY is unchanged
-                 case 0xE:
-                     cpu->V[0xF] = (cpu->V[indexX] & 0x80) >> 7;
-                     cpu->V[indexX] <<= 1;
-                     break;
-             }
-             break;
-         case 0x9000:
-             // 9XY0 Skip next instruction if VX != VY
-             indexX = (opcode & 0x0F00) >> 8;
-             indexY = (opcode & 0x00F0) >> 4;
-             if (cpu->V[indexX] != cpu->V[indexY]) {
-                 skipInstruction(cpu);
-             }
-             break;
-         case 0xA000:
-             //ANNN Store memory address NNN in register I
-             cpu->I = (opcode & 0x0FFF);
-             break;
-         case 0xB000:
-             //BNNN	Jump to address NNN + V0
-             cpu->PC = cpu->V[0] + (opcode & 0x0FFF);
-             break;
-         case 0xC000:
-             // CXNN: Set VX = random byte AND NN
-             indexX = (opcode & 0x0F00) >> 8;
-             uint8_t mask  = opcode & 0x00FF;
-             uint8_t randNum = rand() % 256;
-             cpu->V[indexX] = randNum & mask;
-             break;
-         case 0xD000:
-             cpu->drawFlag = 1;
-             indexX = (opcode & 0x0F00) >> 8;
-             indexY = (opcode & 0x00F0) >> 4;
-             val = (opcode & 0x000F);  // N = height of sprite in pixels
-
-             uint8_t x_pos = cpu->V[indexX] % DISPLAY_WIDTH;   // Wrap x position
-             uint8_t y_pos = cpu->V[indexY] % DISPLAY_HEIGHT;  // Wrap y position
-
-             cpu->V[0xF] = 0;  // Reset collision flag
-
-             // Loop through each row of the sprite (N rows)
-             for (int row = 0; row < val; row++) {
-                 uint8_t sprite_byte = cpu->memory[cpu->I + row];
-
-                 // Loop through each bit/pixel in this row (8 pixels per byte)
-                 for (int col = 0; col < 8; col++) {
-                     // Check if this bit is set in the sprite
-                     if ((sprite_byte & (0x80 >> col)) != 0) {
-                         // Calculate screen position
-                         int screen_x = (x_pos + col) % DISPLAY_WIDTH;
-                         int screen_y = (y_pos + row) % DISPLAY_HEIGHT;
-
-                         // Calculate index in display array (assuming 1D array)
-                         int pixel_index = screen_y * DISPLAY_WIDTH + screen_x;
-
-                         // Check if pixel is already on (collision detection)
-                         if (cpu->display[pixel_index] == 1) {
-                             cpu->V[0xF] = 1;  // Set collision flag
-                         }
-
-                         // XOR the pixel
-                         cpu->display[pixel_index] ^= 1;
-                     }
-                 }
-             }
-             break;
-         case 0xE000:
-             //EX9E Skip the following instruction if the key corresponding to the hex value
-             //         currently stored in register VX is pressed
-             //EXA1 Skip the following instruction if the key corresponding to the hex value
-             //         currently stored in register VX is not pressed
-             indexX = (opcode & 0x0F00) >> 8;
-             switch (opcode & 0x00FF) {
-                 case 0x9E:
-                     if (cpu->keys[cpu->V[indexX]]) {
-                         skipInstruction(cpu);
-                     }
-                     break;
-                 case 0xA1:
-                     if (!cpu->keys[cpu->V[indexX]]) {
-                         skipInstruction(cpu);
-                     }
-                     break;
-             }
-             break;
-         case 0xF000:
-             indexX = (opcode & 0x0F00) >> 8;
-             val = (opcode & 0x00FF);
-
-             switch (val) {
-                 //FX07 Store the current value of the delay timer in register VX
-                 case 0x07:
-                     cpu->V[indexX] = cpu->delayTimer;
-                     break;
-                 //FX0A	Wait for a keypress and store the result in register VX
-                 case 0x0A:
-                     // Wait for keypress — block until one is pressed
-                     for (int i = 0; i < 16; i++) {
-                         if (cpu->keys[i]) {
-                             cpu->V[indexX] = i;
-                             return;
-                         }
-                     }
-                     repeatInstruction(cpu);
-                     break;
-                 //FX15	Set the delay timer to the value of register VX
-                 case 0x15:
-                     cpu->delayTimer = cpu->V[indexX];
-                     break;
-                 //FX1E Add the value stored in register VX to register I
-                 case 0x1E:
-                     cpu->I += cpu->V[indexX];
-                     break;
-                 //FX29 Set I to the memory address of the sprite data corresponding to the hexadecimal digit
-                 //         stored in register VX
-                 case 0x29:
-                     cpu->I = cpu->V[indexX] * 5;
-
-                     break;
-                 //FX33 Store the binary-coded decimal equivalent of the value stored in register VX at
-                 //         addresses I, I + 1, and I + 2
-                 case 0x33:
-                     cpu->memory[cpu->I]     = cpu->V[indexX] / 100;
-                     cpu->memory[cpu->I + 1] = (cpu->V[indexX] / 10) % 10;
-                     cpu->memory[cpu->I + 2] = cpu->V[indexX] % 10;
-                     break;
-                 //FX55 Store the values of registers V0 to VX inclusive in memory starting at address I
-                 //         I = I + X + 1 after operation
-                 case 0x55:
-                     for (int i = 0; i <= indexX; i++)
-                         cpu->memory[cpu->I + i] = cpu->V[i];
-                     cpu->I += indexX + 1;
-                     break;
-                 //FX65 Fill registers V0 to VX inclusive with the values stored in memory starting at address I
-                 //         I is set to I + X + 1 after operation
-                 case 0x65:
-                     for (int i = 0; i <= indexX; i++)
-                         cpu->V[i] = cpu->memory[cpu->I + i];
-                     cpu->I += indexX + 1;
-                     break;
-                 default:
-                     printf("Unsupported opco");
-                     break;
-             }
-             break;
-     }
- }
+// Stack errors leave the CPU stuck on the faulting instruction, nothing after it
+// would run as the program meant anyway
+static void parkOnFault(ChipCPU* cpu, ChipFault fault){
+    cpu->faults |= fault;
+    repeatInstruction(cpu);
+    cpu->idle = CHIP_IDLE_HALT;
+}
+
+// Flag an access of count bytes from I that runs past the end of memory
+static inline void checkIndexRange(ChipCPU* cpu, unsigned count){
+    if (count && cpu->I + count - 1 > cpu->memoryMask) {
+        cpu->faults |= CHIP_FAULT_MEMORY_WRAP;
+    }
+}
+
+// Drop every translated block that contains the instruction at entry
+static void invalidateBlocks(ChipCPU* cpu, uint16_t entry){
+    uint8_t* blockLength = cpuBlockLength(cpu);
+    int first = entry >= BLOCK_MAX_LENGTH - 1 ? entry - (BLOCK_MAX_LENGTH - 1) : 0;
+
+    for (int start = first; start <= entry; start++) {
+        if (start + blockLength[start] > entry) {
+            blockLength[start] = 0;
+        }
+    }
+}
+
+// Every memory write goes through here so a pre-decoded instruction covering
+// the address gets decoded again the next time it is executed, and so forks know
+// which pages are no longer shared
+static inline void writeMemory(ChipCPU* cpu, uint16_t address, uint8_t value){
+    address &= cpu->memoryMask;
+    cpuMemory(cpu)[address] = value;
+    cpu->dirtyPages[address / MEMORY_PAGE_SIZE / 64] |= 1ULL << (address / MEMORY_PAGE_SIZE % 64);
+    cpuDecodeCache(cpu)[address >> 1].handler = 0;
+    if (cpu->engine != CHIP_ENGINE_INTERPRETER
+        && (cpu->blockPages[address / MEMORY_PAGE_SIZE / 64] >> (address / MEMORY_PAGE_SIZE % 64)) & 1) {
+        invalidateBlocks(cpu, address >> 1);
+    }
+}
+
+/**
+ * True if the two instructions at address are FX07 followed by a 3XNN/4XNN on the
+ * same register, and VX already holds the delay timer. Jumped back to from right
+ * after, that loop can't change anything until the delay timer does.
+ */
+static bool isTimerPoll(const ChipCPU* cpu, uint16_t address){
+    const uint8_t* code = &cpuMemory(cpu)[address & cpu->memoryMask];
+    if (address > cpu->memoryMask - 3 || (code[0] & 0xF0) != 0xF0 || code[1] != 0x07) {
+        return false;
+    }
+    uint8_t skip = code[2] >> 4;
+    uint8_t x = code[0] & 0x0F;
+    return (skip == 0x3 || skip == 0x4) && (code[2] & 0x0F) == x && cpu->V[x] == cpu->delayTimer;
+}
+
+typedef void (*OpHandler)(ChipCPU* cpu, const DecodedOp* op);
+
+enum {
+    OP_UNDECODED = 0,
+    OP_NOP,
+    OP_CLS,
+    OP_RET,
+    OP_SCD,
+    OP_SCU,
+    OP_SCR,
+    OP_SCL,
+    OP_EXIT,
+    OP_LOW,
+    OP_HIGH,
+    OP_INVALID,
+    OP_JP,
+    OP_CALL,
+    OP_SE_VX_NN,
+    OP_SNE_VX_NN,
+    OP_SE_VX_VY,
+    OP_SAVE_RANGE,
+    OP_LOAD_RANGE,
+    OP_LD_VX_NN,
+    OP_ADD_VX_NN,
+    OP_LD_VX_VY,
+    OP_OR,
+    OP_AND,
+    OP_XOR,
+    OP_ADD_VX_VY,
+    OP_SUB,
+    OP_SHR,
+    OP_SUBN,
+    OP_SHL,
+    OP_SNE_VX_VY,
+    OP_LD_I,
+    OP_JP_V0,
+    OP_RND,
+    OP_DRW,
+    OP_SKP,
+    OP_SKNP,
+    OP_LD_I_LONG,
+    OP_PLANE,
+    OP_LD_VX_DT,
+    OP_LD_VX_K,
+    OP_LD_DT_VX,
+    OP_LD_ST_VX,
+    OP_ADD_I_VX,
+    OP_LD_F_VX,
+    OP_LD_HF_VX,
+    OP_BCD,
+    OP_STORE,
+    OP_LOAD,
+    OP_SAVE_FLAGS,
+    OP_LOAD_FLAGS,
+    OP_UNSUPPORTED,
+    OP_COUNT
+};
+
+/**
+ * Split an opcode into its handler and operand fields.
+ * This is the only place that looks at the raw instruction bits.
+ */
+static void decodeInstruction(uint16_t opcode, DecodedOp* op){
+    op->x = (opcode & 0x0F00) >> 8;
+    op->y = (opcode & 0x00F0) >> 4;
+    op->n = (opcode & 0x000F);
+    op->nn = (opcode & 0x00FF);
+    op->nnn = (opcode & 0x0FFF);
+    op->reserved = 0;
+
+    //2 byte opcode, take first 4 bits to find operation
+    switch (opcode & 0xF000) {
+        case 0x0000:
+            switch (opcode & 0x00FF) {
+                case 0x00E0: op->handler = OP_CLS; break;
+                case 0x00EE: op->handler = OP_RET; break;
+                case 0x00FB: op->handler = OP_SCR; break;
+                case 0x00FC: op->handler = OP_SCL; break;
+                case 0x00FD: op->handler = OP_EXIT; break;
+                case 0x00FE: op->handler = OP_LOW; break;
+                case 0x00FF: op->handler = OP_HIGH; break;
+                default:
+                    switch (opcode & 0x00F0) {
+                        case 0x00C0: op->handler = OP_SCD; break;
+                        case 0x00D0: op->handler = OP_SCU; break;
+                        default:     op->handler = OP_INVALID; break;
+                    }
+                    break;
+            }
+            break;
+        case 0x1000: op->handler = OP_JP; break;
+        case 0x2000: op->handler = OP_CALL; break;
+        case 0x3000: op->handler = OP_SE_VX_NN; break;
+        case 0x4000: op->handler = OP_SNE_VX_NN; break;
+        case 0x5000:
+            switch (opcode & 0x000F) {
+                case 0x2: op->handler = OP_SAVE_RANGE; break;
+                case 0x3: op->handler = OP_LOAD_RANGE; break;
+                default:  op->handler = OP_SE_VX_VY; break;
+            }
+            break;
+        case 0x6000: op->handler = OP_LD_VX_NN; break;
+        case 0x7000: op->handler = OP_ADD_VX_NN; break;
+        case 0x8000:
+            switch (opcode & 0x000F) {
+                case 0x0: op->handler = OP_LD_VX_VY; break;
+                case 0x1: op->handler = OP_OR; break;
+                case 0x2: op->handler = OP_AND; break;
+                case 0x3: op->handler = OP_XOR; break;
+                case 0x4: op->handler = OP_ADD_VX_VY; break;
+                case 0x5: op->handler = OP_SUB; break;
+                case 0x6: op->handler = OP_SHR; break;
+                case 0x7: op->handler = OP_SUBN; break;
+                case 0xE: op->handler = OP_SHL; break;
+                default:  op->handler = OP_NOP; break;
+            }
+            break;
+        case 0x9000: op->handler = OP_SNE_VX_VY; break;
+        case 0xA000: op->handler = OP_LD_I; break;
+        case 0xB000: op->handler = OP_JP_V0; break;
+        case 0xC000: op->handler = OP_RND; break;
+        case 0xD000: op->handler = OP_DRW; break;
+        case 0xE000:
+            switch (opcode & 0x00FF) {
+                case 0x9E: op->handler = OP_SKP; break;
+                case 0xA1: op->handler = OP_SKNP; break;
+                default:   op->handler = OP_NOP; break;
+            }
+            break;
+        default:  // 0xF000, the last one left
+            switch (opcode & 0x00FF) {
+                case 0x00: op->handler = op->x == 0 ? OP_LD_I_LONG : OP_UNSUPPORTED; break;
+                case 0x01: op->handler = OP_PLANE; break;
+                case 0x07: op->handler = OP_LD_VX_DT; break;
+                case 0x0A: op->handler = OP_LD_VX_K; break;
+                case 0x15: op->handler = OP_LD_DT_VX; break;
+                case 0x18: op->handler = OP_LD_ST_VX; break;
+                case 0x1E: op->handler = OP_ADD_I_VX; break;
+                case 0x29: op->handler = OP_LD_F_VX; break;
+                case 0x30: op->handler = OP_LD_HF_VX; break;
+                case 0x33: op->handler = OP_BCD; break;
+                case 0x55: op->handler = OP_STORE; break;
+                case 0x65: op->handler = OP_LOAD; break;
+                case 0x75: op->handler = OP_SAVE_FLAGS; break;
+                case 0x85: op->handler = OP_LOAD_FLAGS; break;
+                default:   op->handler = OP_UNSUPPORTED; break;
+            }
+            break;
+    }
+}
+
+static void op_decode(ChipCPU* cpu, const DecodedOp* op);
+
+static void op_nop(ChipCPU* cpu, const DecodedOp* op){
+    (void)cpu;
+    (void)op;
+}
+
+//00E0 Clear the selected planes
+static void op_cls(ChipCPU* cpu, const DecodedOp* op){
+    (void)op;
+    for (int plane = 0; plane < DISPLAY_PLANES; plane++) {
+        if (cpu->planeMask & (1 << plane)) {
+            memset(cpu->display.planes[plane], 0, sizeof(cpu->display.planes[plane]));
+        }
+    }
+    cpu->drawFlag = 1;
+    cpu->dirtyRows = DISPLAY_ALL_ROWS;
+    LOG_TRACE("Clear Screen");
+}
+
+//00EE Return from subroutine
+static void op_ret(ChipCPU* cpu, const DecodedOp* op){
+    (void)op;
+    if (cpu->stackPointer == 0 || cpu->stackPointer > STACK_DEPTH) {
+        parkOnFault(cpu, CHIP_FAULT_STACK_UNDERFLOW);
+        return;
+    }
+    cpu->stackPointer--;
+    cpu->PC = cpu->stack[cpu->stackPointer];
+}
+
+// Scrolls move whole rows with memmove and whole rows of words with shifts, they
+// never touch single pixels. Amounts are in pixels of the current resolution.
+
+//00CN Scroll the selected planes down N rows
+static void op_scd(ChipCPU* cpu, const DecodedOp* op){
+    int height = cpuDisplayHeight(cpu);
+    int rows = op->n < height ? op->n : height;
+    for (int plane = 0; plane < DISPLAY_PLANES; plane++) {
+        if (cpu->planeMask & (1 << plane)) {
+            uint64_t (*lines)[DISPLAY_ROW_WORDS] = cpu->display.planes[plane];
+            memmove(lines[rows], lines[0], sizeof(lines[0]) * (height - rows));
+            memset(lines[0], 0, sizeof(lines[0]) * rows);
+        }
+    }
+    cpu->drawFlag = 1;
+    cpu->dirtyRows = DISPLAY_ALL_ROWS;
+}
+
+//00DN Scroll the selected planes up N rows
+static void op_scu(ChipCPU* cpu, const DecodedOp* op){
+    int height = cpuDisplayHeight(cpu);
+    int rows = op->n < height ? op->n : height;
+    for (int plane = 0; plane < DISPLAY_PLANES; plane++) {
+        if (cpu->planeMask & (1 << plane)) {
+            uint64_t (*lines)[DISPLAY_ROW_WORDS] = cpu->display.planes[plane];
+            memmove(lines[0], lines[rows], sizeof(lines[0]) * (height - rows));
+            memset(lines[height - rows], 0, sizeof(lines[0]) * rows);
+        }
+    }
+    cpu->drawFlag = 1;
+    cpu->dirtyRows = DISPLAY_ALL_ROWS;
+}
+
+//00FB Scroll the selected planes right 4 pixels
+static void op_scr(ChipCPU* cpu, const DecodedOp* op){
+    (void)op;
+    int height = cpuDisplayHeight(cpu);
+    for (int plane = 0; plane < DISPLAY_PLANES; plane++) {
+        if (!(cpu->planeMask & (1 << plane))) {
+            continue;
+        }
+        uint64_t (*lines)[DISPLAY_ROW_WORDS] = cpu->display.planes[plane];
+        for (int y = 0; y < height; y++) {
+            if (cpu->hires) {
+                lines[y][1] = (lines[y][1] >> 4) | (lines[y][0] << 60);
+            }
+            lines[y][0] >>= 4;
+        }
+    }
+    cpu->drawFlag = 1;
+    cpu->dirtyRows = DISPLAY_ALL_ROWS;
+}
+
+//00FC Scroll the selected planes left 4 pixels
+static void op_scl(ChipCPU* cpu, const DecodedOp* op){
+    (void)op;
+    int height = cpuDisplayHeight(cpu);
+    for (int plane = 0; plane < DISPLAY_PLANES; plane++) {
+        if (!(cpu->planeMask & (1 << plane))) {
+            continue;
+        }
+        uint64_t (*lines)[DISPLAY_ROW_WORDS] = cpu->display.planes[plane];
+        for (int y = 0; y < height; y++) {
+            lines[y][0] <<= 4;
+            if (cpu->hires) {
+                lines[y][0] |= lines[y][1] >> 60;
+                lines[y][1] <<= 4;
+            }
+        }
+    }
+    cpu->drawFlag = 1;
+    cpu->dirtyRows = DISPLAY_ALL_ROWS;
+}
+
+//00FD Exit the interpreter, the program stays parked on this instruction
+static void op_exit(ChipCPU* cpu, const DecodedOp* op){
+    (void)op;
+    repeatInstruction(cpu);
+    cpu->idle = CHIP_IDLE_HALT;
+}
+
+//00FE Switch to 64x32 lores, clears the display
+static void op_low(ChipCPU* cpu, const DecodedOp* op){
+    (void)op;
+    cpu->hires = 0;
+    memset(&cpu->display, 0, sizeof(cpu->display));
+    cpu->drawFlag = 1;
+    cpu->dirtyRows = DISPLAY_ALL_ROWS;
+}
+
+//00FF Switch to 128x64 hires, clears the display
+static void op_high(ChipCPU* cpu, const DecodedOp* op){
+    (void)op;
+    cpu->hires = 1;
+    memset(&cpu->display, 0, sizeof(cpu->display));
+    cpu->drawFlag = 1;
+    cpu->dirtyRows = DISPLAY_ALL_ROWS;
+}
+
+static void op_invalid(ChipCPU* cpu, const DecodedOp* op){
+    (void)cpu;
+    LOG_WARN("Invalid opcode 0x%04X", op->nnn);
+}
+
+//1NNN Jump to address NNN
+static void op_jp(ChipCPU* cpu, const DecodedOp* op){
+    uint16_t from = cpu->PC - 2;
+    cpu->PC = op->nnn;
+
+    // Only backward jumps of 0 or 2 instructions can be idle loops, keep the rest cheap
+    if (op->nnn == from) {
+        cpu->idle = CHIP_IDLE_HALT;
+    } else if (op->nnn == (uint16_t)(from - 4) && isTimerPoll(cpu, op->nnn)) {
+        cpu->idle = CHIP_IDLE_TIMER;
+    }
+}
+
+//2NNN Call subroutine at NNN
+static void op_call(ChipCPU* cpu, const DecodedOp* op){
+    if (cpu->stackPointer >= STACK_DEPTH) {
+        parkOnFault(cpu, CHIP_FAULT_STACK_OVERFLOW);
+        return;
+    }
+    cpu->stack[cpu->stackPointer] = cpu->PC;
+    cpu->stackPointer++;
+    cpu->PC = op->nnn;
+}
+
+//3XNN Skip the following instruction if the value of register VX equals NN
+static void op_se_vx_nn(ChipCPU* cpu, const DecodedOp* op){
+    if (cpu->V[op->x] == op->nn) {
+        skipInstruction(cpu);
+    }
+}
+
+//4XNN Skip the following instruction if the value of register VX is not equal to NN
+static void op_sne_vx_nn(ChipCPU* cpu, const DecodedOp* op){
+    if (cpu->V[op->x] != op->nn) {
+        skipInstruction(cpu);
+    }
+}
+
+//5XY0 Skip the following instruction if the value of register VX = VY
+static void op_se_vx_vy(ChipCPU* cpu, const DecodedOp* op){
+    if (cpu->V[op->x] == cpu->V[op->y]) {
+        skipInstruction(cpu);
+    }
+}
+
+//5XY2 Store VX to VY inclusive in memory starting at address I, in that order
+//         (descending when X > Y). I is unchanged
+static void op_save_range(ChipCPU* cpu, const DecodedOp* op){
+    int step = op->x <= op->y ? 1 : -1;
+    int count = (op->x <= op->y ? op->y - op->x : op->x - op->y) + 1;
+    checkIndexRange(cpu, count);
+    for (int i = 0; i < count; i++)
+        writeMemory(cpu, cpu->I + i, cpu->V[op->x + i * step]);
+}
+
+//5XY3 Load VX to VY inclusive from memory starting at address I, in that order
+//         (descending when X > Y). I is unchanged
+static void op_load_range(ChipCPU* cpu, const DecodedOp* op){
+    int step = op->x <= op->y ? 1 : -1;
+    int count = (op->x <= op->y ? op->y - op->x : op->x - op->y) + 1;
+    const uint8_t* memory = cpuMemory(cpu);
+    checkIndexRange(cpu, count);
+    for (int i = 0; i < count; i++)
+        cpu->V[op->x + i * step] = memory[(cpu->I + i) & cpu->memoryMask];
+}
+
+//6XNN Store number NN in register VX
+static void op_ld_vx_nn(ChipCPU* cpu, const DecodedOp* op){
+    cpu->V[op->x] = op->nn;
+}
+
+//7XNN Add the value NN to register VX
+static void op_add_vx_nn(ChipCPU* cpu, const DecodedOp* op){
+    cpu->V[op->x] = cpu->V[op->x] + op->nn;
+}
+
+//8XY0 Store the value of register VY in register VX
+static void op_ld_vx_vy(ChipCPU* cpu, const DecodedOp* op){
+    cpu->V[op->x] = cpu->V[op->y];
+}
+
+/*
+ * Opcodes whose behaviour depends on the quirks profile are written once as inline
+ * functions taking the quirk as a parameter. Each profile's handlers call them with
+ * constants (see DEFINE_QUIRK_HANDLERS), so the quirk checks fold away at compile time.
+ */
+
+//8XY1 Set VX to VX OR VY
+//         VIP: VF is reset
+static inline void orRegisters(ChipCPU* cpu, const DecodedOp* op, bool vfReset){
+    cpu->V[op->x] |= cpu->V[op->y];
+    if (vfReset) {
+        cpu->V[0xF] = 0;
+    }
+}
+
+//8XY2 Set VX to VX AND VY
+//         VIP: VF is reset
+static inline void andRegisters(ChipCPU* cpu, const DecodedOp* op, bool vfReset){
+    cpu->V[op->x] &= cpu->V[op->y];
+    if (vfReset) {
+        cpu->V[0xF] = 0;
+    }
+}
+
+//8XY3 Set VX to VX XOR VY
+//         VIP: VF is reset
+static inline void xorRegisters(ChipCPU* cpu, const DecodedOp* op, bool vfReset){
+    cpu->V[op->x] ^= cpu->V[op->y];
+    if (vfReset) {
+        cpu->V[0xF] = 0;
+    }
+}
+
+//8XY4 Add the value of register VY to register VX
+//         Set VF to 01 if a carry occurs
+//         Set VF to 00 if a carry does not occur
+static void op_add_vx_vy(ChipCPU* cpu, const DecodedOp* op){
+    uint16_t sum = cpu->V[op->x] + cpu->V[op->y];
+    cpu->V[0xF] = (sum > 255);
+    cpu->V[op->x] = sum & 0xFF;
+}
+
+//8XY5 Subtract the value of register VY from register VX
+//         Set VF to 00 if a borrow occurs
+//         Set VF to 01 if a borrow does not occur
+static void op_sub(ChipCPU* cpu, const DecodedOp* op){
+    cpu->V[0xF] = (cpu->V[op->x] >= cpu->V[op->y]) ? 1 : 0;
+    cpu->V[op->x] = (cpu->V[op->x] - cpu->V[op->y]) & 0xFF;
+}
+
+//8XY6 Store the value of register VX (VIP: VY) shifted right one bit in register VX
+//         Set register VF to the least significant bit prior to the shift
+//         VY is unchanged
+static inline void shiftRight(ChipCPU* cpu, const DecodedOp* op, bool fromVY){
+    const uint8_t* source = &cpu->V[fromVY ? op->y : op->x];
+    cpu->V[0xF] = *source & 0x1;
+    cpu->V[op->x] = *source >> 1;
+}
+
+//8XY7 Set register VX to the value of VY minus VX
+//         Set VF to 00 if a borrow occurs
+//         Set VF to 01 if a borrow does not occur
+static void op_subn(ChipCPU* cpu, const DecodedOp* op){
+    cpu->V[0xF] = (cpu->V[op->y] >= cpu->V[op->x]) ? 1 : 0;
+    cpu->V[op->x] = cpu->V[op->y] - cpu->V[op->x];
+}
+
+//8XYE Store the value of register VX (VIP: VY) shifted left one bit in register VX
+//         Set register VF to the most significant bit prior to the shift
+//         VY is unchanged
+static inline void shiftLeft(ChipCPU* cpu, const DecodedOp* op, bool fromVY){
+    const uint8_t* source = &cpu->V[fromVY ? op->y : op->x];
+    cpu->V[0xF] = (*source & 0x80) >> 7;
+    cpu->V[op->x] = *source << 1;
+}
+
+//9XY0 Skip next instruction if VX != VY
+static void op_sne_vx_vy(ChipCPU* cpu, const DecodedOp* op){
+    if (cpu->V[op->x] != cpu->V[op->y]) {
+        skipInstruction(cpu);
+    }
+}
+
+//ANNN Store memory address NNN in register I
+static void op_ld_i(ChipCPU* cpu, const DecodedOp* op){
+    cpu->I = op->nnn;
+}
+
+//BNNN Jump to address NNN + V0
+//         CHIP-48 / SCHIP read it as BXNN: jump to XNN + VX
+static inline void jumpOffset(ChipCPU* cpu, const DecodedOp* op, bool offsetVX){
+    cpu->PC = cpu->V[offsetVX ? op->x : 0] + op->nnn;
+}
+
+// xorshift64*, the state lives in the CPU so instances never share a generator
+static inline uint64_t nextRandom(ChipCPU* cpu){
+    uint64_t x = cpu->rngState;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    cpu->rngState = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+//CXNN Set VX = random byte AND NN
+static void op_rnd(ChipCPU* cpu, const DecodedOp* op){
+    uint8_t randNum = (uint8_t)(nextRandom(cpu) >> 56);
+    cpu->V[op->x] = randNum & op->nn;
+}
+
+// Move the 128-bit row hi:lo right by shift. Pixels past the right edge wrap around,
+// or fall off when clipping.
+static inline void placeRow(uint64_t* hi, uint64_t* lo, unsigned shift, bool clip){
+    if (shift & 64) {
+        uint64_t swap = *hi;
+        *hi = clip ? 0 : *lo;
+        *lo = swap;
+    }
+    shift &= 63;
+    if (shift) {
+        uint64_t h = *hi;
+        uint64_t l = *lo;
+        *hi = (h >> shift) | (clip ? 0 : l << (64 - shift));
+        *lo = (l >> shift) | (h << (64 - shift));
+    }
+}
+
+// Rows first .. first + count - 1 of a display height rows tall, wrapping at the bottom
+static inline uint64_t rowSpan(unsigned first, unsigned count, unsigned height){
+    uint64_t span = (1ULL << count) - 1;
+    uint64_t rows = span << first | (first ? span >> (height - first) : 0);
+    return height < 64 ? rows & ((1ULL << height) - 1) : rows;
+}
+
+/**
+ * Any sprite in any mode: 8xN or 16x16 (N = 0), lores or hires, on every selected
+ * plane. Each plane takes its own run of sprite data from I onwards.
+ */
+static inline void drawSpriteGeneral(ChipCPU* cpu, const DecodedOp* op, bool clip){
+    int width = cpuDisplayWidth(cpu);
+    int height = cpuDisplayHeight(cpu);
+    int rows = op->n ? op->n : 16;
+    int spriteWidth = op->n ? 8 : 16;
+    unsigned x_pos = cpu->V[op->x] & (width - 1);
+    unsigned y_pos = cpu->V[op->y] & (height - 1);
+    // Rows below the bottom edge are skipped when clipping, but still use up sprite data
+    int visible = (clip && y_pos + rows > (unsigned)height) ? height - (int)y_pos : rows;
+    uint16_t skipped = (uint16_t)((rows - visible) * (spriteWidth / 8));
+    uint16_t address = cpu->I;
+    const uint8_t* memory = cpuMemory(cpu);
+    uint8_t collision = 0;
+
+    checkIndexRange(cpu, __builtin_popcount(cpu->planeMask & 0xF) * rows * (spriteWidth / 8));
+    cpu->dirtyRows |= rowSpan(y_pos, visible, height);
+
+    for (int plane = 0; plane < DISPLAY_PLANES; plane++) {
+        if (!(cpu->planeMask & (1 << plane))) {
+            continue;
+        }
+        for (int row = 0; row < visible; row++) {
+            uint64_t sprite = memory[address++ & cpu->memoryMask];
+            if (spriteWidth == 16) {
+                sprite = (sprite << 8) | memory[address++ & cpu->memoryMask];
+            }
+            uint64_t* line = cpu->display.planes[plane][(y_pos + row) & (height - 1)];
+            uint64_t hi = sprite << (64 - spriteWidth);
+
+            if (cpu->hires) {
+                uint64_t lo = 0;
+                placeRow(&hi, &lo, x_pos, clip);
+                collision |= ((line[0] & hi) | (line[1] & lo)) != 0;
+                line[0] ^= hi;
+                line[1] ^= lo;
+            } else {
+                uint64_t bits = (hi >> x_pos) | (clip ? 0 : hi << ((DISPLAY_WIDTH - x_pos) & 63));
+                collision |= (line[0] & bits) != 0;
+                line[0] ^= bits;
+            }
+        }
+        address += skipped;
+    }
+    cpu->V[0xF] = collision;
+}
+
+//DXYN Draw an 8xN sprite from memory[I] at (VX, VY), VF = collision
+//DXY0 Draw a 16x16 sprite
+//         The start position always wraps. Pixels past the edges wrap too, or are
+//         clipped on the VIP / CHIP-48 / SCHIP.
+static inline void drawSprite(ChipCPU* cpu, const DecodedOp* op, bool clip){
+    cpu->drawFlag = 1;
+
+    if (cpu->hires || cpu->planeMask != 1 || op->n == 0) {
+        drawSpriteGeneral(cpu, op, clip);
+        return;
+    }
+
+    // Classic CHIP-8 draw, one plane of one word per row
+    uint8_t x_pos = cpu->V[op->x] % DISPLAY_WIDTH;   // Wrap x position
+    uint8_t y_pos = cpu->V[op->y] % DISPLAY_HEIGHT;  // Wrap y position
+    int rows = (clip && y_pos + op->n > DISPLAY_HEIGHT) ? DISPLAY_HEIGHT - y_pos : op->n;
+    const uint8_t* memory = cpuMemory(cpu);
+
+    checkIndexRange(cpu, op->n);
+    cpu->dirtyRows |= rowSpan(y_pos, rows, DISPLAY_HEIGHT);
+    cpu->V[0xF] = 0;  // Reset collision flag
+
+    // Each sprite row becomes a 64-bit mask: place the byte at the left edge,
+    // then rotate right so pixels past the right edge wrap around (or shift, to clip)
+    for (int row = 0; row < rows; row++) {
+        uint64_t sprite = (uint64_t)memory[(cpu->I + row) & cpu->memoryMask] << 56;
+        uint64_t bits = (sprite >> x_pos) | (clip ? 0 : sprite << ((DISPLAY_WIDTH - x_pos) & 63));
+        uint64_t* line = &cpu->display.planes[0][(y_pos + row) % DISPLAY_HEIGHT][0];
+
+        if (*line & bits) {
+            cpu->V[0xF] = 1;  // Set collision flag
+        }
+        *line ^= bits;
+    }
+}
+
+// Key named by VX, which only has 16 of them
+static inline uint8_t keyIndex(ChipCPU* cpu, uint8_t x){
+    if (cpu->V[x] >= KEY_COUNT) {
+        cpu->faults |= CHIP_FAULT_KEY_RANGE;
+    }
+    return cpu->V[x] & (KEY_COUNT - 1);
+}
+
+//EX9E Skip the following instruction if the key corresponding to the hex value
+//         currently stored in register VX is pressed
+static void op_skp(ChipCPU* cpu, const DecodedOp* op){
+    if (cpu->keys[keyIndex(cpu, op->x)]) {
+        skipInstruction(cpu);
+    }
+}
+
+//EXA1 Skip the following instruction if the key corresponding to the hex value
+//         currently stored in register VX is not pressed
+static void op_sknp(ChipCPU* cpu, const DecodedOp* op){
+    if (!cpu->keys[keyIndex(cpu, op->x)]) {
+        skipInstruction(cpu);
+    }
+}
+
+//F000 NNNN Store the 16-bit address in the next word in I, XO-CHIP
+static void op_ld_i_long(ChipCPU* cpu, const DecodedOp* op){
+    (void)op;
+    // PC already points at NNNN
+    cpu->I = cpuFetch(cpu);
+    cpu->PC += 2;
+    // Only XO-CHIP programs address past 4 KiB. Without the memory for it, I keeps
+    // wrapping at 4 KiB.
+    if (!cpu->wide && !cpuSetMemoryMask(cpu, MEMORY_SIZE - 1)) {
+        cpu->faults |= CHIP_FAULT_MEMORY_WRAP;
+    }
+}
+
+//FN01 Select the planes N that drawing, clearing and scrolling act on, XO-CHIP
+static void op_plane(ChipCPU* cpu, const DecodedOp* op){
+    cpu->planeMask = op->x;
+}
+
+//FX07 Store the current value of the delay timer in register VX
+static void op_ld_vx_dt(ChipCPU* cpu, const DecodedOp* op){
+    cpu->V[op->x] = cpu->delayTimer;
+}
+
+//FX0A Wait for a keypress and store the result in register VX
+static void op_ld_vx_k(ChipCPU* cpu, const DecodedOp* op){
+    // Wait for keypress — block until one is pressed
+    for (int i = 0; i < 16; i++) {
+        if (cpu->keys[i]) {
+            cpu->V[op->x] = i;
+            return;
+        }
+    }
+    repeatInstruction(cpu);
+    cpu->idle = CHIP_IDLE_KEY;
+}
+
+//FX15 Set the delay timer to the value of register VX
+static void op_ld_dt_vx(ChipCPU* cpu, const DecodedOp* op){
+    cpu->delayTimer = cpu->V[op->x];
+}
+
+//FX18 Set the sound timer to the value of register VX
+static void op_ld_st_vx(ChipCPU* cpu, const DecodedOp* op){
+    cpu->soundTimer = cpu->V[op->x];
+}
+
+//FX1E Add the value stored in register VX to register I
+static void op_add_i_vx(ChipCPU* cpu, const DecodedOp* op){
+    cpu->I += cpu->V[op->x];
+}
+
+//FX29 Set I to the memory address of the sprite data corresponding to the hexadecimal digit
+//         stored in register VX
+static void op_ld_f_vx(ChipCPU* cpu, const DecodedOp* op){
+    cpu->I = FONT_OFFSET + (cpu->V[op->x] & 0xF) * 5;
+}
+
+//FX30 Set I to the address of the 8x10 big font sprite for the digit in VX
+static void op_ld_hf_vx(ChipCPU* cpu, const DecodedOp* op){
+    cpu->I = BIG_FONT_OFFSET + (cpu->V[op->x] & 0xF) * 10;
+}
+
+//FX33 Store the binary-coded decimal equivalent of the value stored in register VX at
+//         addresses I, I + 1, and I + 2
+static void op_bcd(ChipCPU* cpu, const DecodedOp* op){
+    uint8_t value = cpu->V[op->x];
+    checkIndexRange(cpu, 3);
+    writeMemory(cpu, cpu->I,     value / 100);
+    writeMemory(cpu, cpu->I + 1, (value / 10) % 10);
+    writeMemory(cpu, cpu->I + 2, value % 10);
+}
+
+// Where FX55 / FX65 leave I
+enum {
+    I_UNCHANGED,      // SCHIP
+    I_PLUS_X,         // CHIP-48
+    I_PLUS_X_PLUS_1,  // VIP, modern
+};
+
+static inline void advanceIndex(ChipCPU* cpu, const DecodedOp* op, int indexStep){
+    if (indexStep == I_PLUS_X_PLUS_1) {
+        cpu->I += op->x + 1;
+    } else if (indexStep == I_PLUS_X) {
+        cpu->I += op->x;
+    }
+}
+
+//FX55 Store the values of registers V0 to VX inclusive in memory starting at address I
+//         I = I + X + 1 after operation (CHIP-48: I + X, SCHIP: unchanged)
+static inline void storeRegisters(ChipCPU* cpu, const DecodedOp* op, int indexStep){
+    checkIndexRange(cpu, op->x + 1);
+    for (int i = 0; i <= op->x; i++)
+        writeMemory(cpu, cpu->I + i, cpu->V[i]);
+    advanceIndex(cpu, op, indexStep);
+}
+
+//FX65 Fill registers V0 to VX inclusive with the values stored in memory starting at address I
+//         I is set to I + X + 1 after operation (CHIP-48: I + X, SCHIP: unchanged)
+static inline void loadRegisters(ChipCPU* cpu, const DecodedOp* op, int indexStep){
+    const uint8_t* memory = cpuMemory(cpu);
+    checkIndexRange(cpu, op->x + 1);
+    for (int i = 0; i <= op->x; i++)
+        cpu->V[i] = memory[(cpu->I + i) & cpu->memoryMask];
+    advanceIndex(cpu, op, indexStep);
+}
+
+//FX75 Store V0 to VX inclusive in the user flags
+static void op_save_flags(ChipCPU* cpu, const DecodedOp* op){
+    memcpy(cpu->rpl, cpu->V, op->x + 1);
+}
+
+//FX85 Fill V0 to VX inclusive from the user flags
+static void op_load_flags(ChipCPU* cpu, const DecodedOp* op){
+    memcpy(cpu->V, cpu->rpl, op->x + 1);
+}
+
+static void op_unsupported(ChipCPU* cpu, const DecodedOp* op){
+    (void)cpu;
+    LOG_WARN("Unsupported opcode 0xF%X%02X", op->x, op->nn);
+}
+
+/*
+ * The quirks profiles. Columns: profile, handler suffix, 8XY6/8XYE shift VY, FX55/FX65
+ * I step, BNNN as BXNN, DXYN clips, 8XY1-3 reset VF. Must match ChipQuirks.
+ */
+#define CHIP_QUIRK_PROFILES(X) \
+    X(CHIP_QUIRKS_MODERN, modern, false, I_PLUS_X_PLUS_1, false, false, false) \
+    X(CHIP_QUIRKS_VIP,    vip,    true,  I_PLUS_X_PLUS_1, false, true,  true)  \
+    X(CHIP_QUIRKS_CHIP48, chip48, false, I_PLUS_X,        true,  true,  false) \
+    X(CHIP_QUIRKS_SCHIP,  schip,  false, I_UNCHANGED,     true,  true,  false)
+
+// One handler per quirk-dependent opcode and profile, with the quirks baked in
+#define DEFINE_QUIRK_HANDLERS(QUIRKS, P, SHIFT_VY, INDEX_STEP, JUMP_VX, CLIP, VF_RESET) \
+    static void op_or_##P(ChipCPU* cpu, const DecodedOp* op){ orRegisters(cpu, op, VF_RESET); } \
+    static void op_and_##P(ChipCPU* cpu, const DecodedOp* op){ andRegisters(cpu, op, VF_RESET); } \
+    static void op_xor_##P(ChipCPU* cpu, const DecodedOp* op){ xorRegisters(cpu, op, VF_RESET); } \
+    static void op_shr_##P(ChipCPU* cpu, const DecodedOp* op){ shiftRight(cpu, op, SHIFT_VY); } \
+    static void op_shl_##P(ChipCPU* cpu, const DecodedOp* op){ shiftLeft(cpu, op, SHIFT_VY); } \
+    static void op_jp_v0_##P(ChipCPU* cpu, const DecodedOp* op){ jumpOffset(cpu, op, JUMP_VX); } \
+    static void op_drw_##P(ChipCPU* cpu, const DecodedOp* op){ drawSprite(cpu, op, CLIP); } \
+    static void op_store_##P(ChipCPU* cpu, const DecodedOp* op){ storeRegisters(cpu, op, INDEX_STEP); } \
+    static void op_load_##P(ChipCPU* cpu, const DecodedOp* op){ loadRegisters(cpu, op, INDEX_STEP); }
+
+CHIP_QUIRK_PROFILES(DEFINE_QUIRK_HANDLERS)
+
+#define HANDLER_TABLE(QUIRKS, P, ...) [QUIRKS] = { \
+    [OP_UNDECODED]   = op_decode,       \
+    [OP_NOP]         = op_nop,          \
+    [OP_CLS]         = op_cls,          \
+    [OP_RET]         = op_ret,          \
+    [OP_SCD]         = op_scd,          \
+    [OP_SCU]         = op_scu,          \
+    [OP_SCR]         = op_scr,          \
+    [OP_SCL]         = op_scl,          \
+    [OP_EXIT]        = op_exit,         \
+    [OP_LOW]         = op_low,          \
+    [OP_HIGH]        = op_high,         \
+    [OP_INVALID]     = op_invalid,      \
+    [OP_JP]          = op_jp,           \
+    [OP_CALL]        = op_call,         \
+    [OP_SE_VX_NN]    = op_se_vx_nn,     \
+    [OP_SNE_VX_NN]   = op_sne_vx_nn,    \
+    [OP_SE_VX_VY]    = op_se_vx_vy,     \
+    [OP_SAVE_RANGE]  = op_save_range,   \
+    [OP_LOAD_RANGE]  = op_load_range,   \
+    [OP_LD_VX_NN]    = op_ld_vx_nn,     \
+    [OP_ADD_VX_NN]   = op_add_vx_nn,    \
+    [OP_LD_VX_VY]    = op_ld_vx_vy,     \
+    [OP_OR]          = op_or_##P,       \
+    [OP_AND]         = op_and_##P,      \
+    [OP_XOR]         = op_xor_##P,      \
+    [OP_ADD_VX_VY]   = op_add_vx_vy,    \
+    [OP_SUB]         = op_sub,          \
+    [OP_SHR]         = op_shr_##P,      \
+    [OP_SUBN]        = op_subn,         \
+    [OP_SHL]         = op_shl_##P,      \
+    [OP_SNE_VX_VY]   = op_sne_vx_vy,    \
+    [OP_LD_I]        = op_ld_i,         \
+    [OP_JP_V0]       = op_jp_v0_##P,    \
+    [OP_RND]         = op_rnd,          \
+    [OP_DRW]         = op_drw_##P,      \
+    [OP_SKP]         = op_skp,          \
+    [OP_SKNP]        = op_sknp,         \
+    [OP_LD_I_LONG]   = op_ld_i_long,    \
+    [OP_PLANE]       = op_plane,        \
+    [OP_LD_VX_DT]    = op_ld_vx_dt,     \
+    [OP_LD_VX_K]     = op_ld_vx_k,      \
+    [OP_LD_DT_VX]    = op_ld_dt_vx,     \
+    [OP_LD_ST_VX]    = op_ld_st_vx,     \
+    [OP_ADD_I_VX]    = op_add_i_vx,     \
+    [OP_LD_F_VX]     = op_ld_f_vx,      \
+    [OP_LD_HF_VX]    = op_ld_hf_vx,     \
+    [OP_BCD]         = op_bcd,          \
+    [OP_STORE]       = op_store_##P,    \
+    [OP_LOAD]        = op_load_##P,     \
+    [OP_SAVE_FLAGS]  = op_save_flags,   \
+    [OP_LOAD_FLAGS]  = op_load_flags,   \
+    [OP_UNSUPPORTED] = op_unsupported,  \
+},
+
+// One complete table per profile, cpu->quirks picks the row
+static const OpHandler opHandlers[CHIP_QUIRKS_COUNT][OP_COUNT] = {
+    CHIP_QUIRK_PROFILES(HANDLER_TABLE)
+};
+
+#define QUIRKS_NAME(QUIRKS, P, ...) [QUIRKS] = #P,
+
+static const char* const quirksNames[CHIP_QUIRKS_COUNT] = {
+    CHIP_QUIRK_PROFILES(QUIRKS_NAME)
+};
+
+_Static_assert(OP_COUNT <= PROFILE_OPCODE_SLOTS, "profile opcode slots too small");
+
+static const char* const handlerNames[OP_COUNT] = {
+    [OP_UNDECODED]   = "decode_miss",
+    [OP_NOP]         = "0NNN",
+    [OP_CLS]         = "00E0",
+    [OP_RET]         = "00EE",
+    [OP_SCD]         = "00CN",
+    [OP_SCU]         = "00DN",
+    [OP_SCR]         = "00FB",
+    [OP_SCL]         = "00FC",
+    [OP_EXIT]        = "00FD",
+    [OP_LOW]         = "00FE",
+    [OP_HIGH]        = "00FF",
+    [OP_INVALID]     = "invalid",
+    [OP_JP]          = "1NNN",
+    [OP_CALL]        = "2NNN",
+    [OP_SE_VX_NN]    = "3XNN",
+    [OP_SNE_VX_NN]   = "4XNN",
+    [OP_SE_VX_VY]    = "5XY0",
+    [OP_SAVE_RANGE]  = "5XY2",
+    [OP_LOAD_RANGE]  = "5XY3",
+    [OP_LD_VX_NN]    = "6XNN",
+    [OP_ADD_VX_NN]   = "7XNN",
+    [OP_LD_VX_VY]    = "8XY0",
+    [OP_OR]          = "8XY1",
+    [OP_AND]         = "8XY2",
+    [OP_XOR]         = "8XY3",
+    [OP_ADD_VX_VY]   = "8XY4",
+    [OP_SUB]         = "8XY5",
+    [OP_SHR]         = "8XY6",
+    [OP_SUBN]        = "8XY7",
+    [OP_SHL]         = "8XYE",
+    [OP_SNE_VX_VY]   = "9XY0",
+    [OP_LD_I]        = "ANNN",
+    [OP_JP_V0]       = "BNNN",
+    [OP_RND]         = "CXNN",
+    [OP_DRW]         = "DXYN",
+    [OP_SKP]         = "EX9E",
+    [OP_SKNP]        = "EXA1",
+    [OP_LD_I_LONG]   = "F000",
+    [OP_PLANE]       = "FN01",
+    [OP_LD_VX_DT]    = "FX07",
+    [OP_LD_VX_K]     = "FX0A",
+    [OP_LD_DT_VX]    = "FX15",
+    [OP_LD_ST_VX]    = "FX18",
+    [OP_ADD_I_VX]    = "FX1E",
+    [OP_LD_F_VX]     = "FX29",
+    [OP_LD_HF_VX]    = "FX30",
+    [OP_BCD]         = "FX33",
+    [OP_STORE]       = "FX55",
+    [OP_LOAD]        = "FX65",
+    [OP_SAVE_FLAGS]  = "FX75",
+    [OP_LOAD_FLAGS]  = "FX85",
+    [OP_UNSUPPORTED] = "unsupported",
+};
+
+/**
+ * Opcode pattern a handler index implements, used to label profile output
+ */
+const char* cpuHandlerName(unsigned handler)
+{
+    return handler < OP_COUNT ? handlerNames[handler] : "unknown";
+}
+
+/**
+ * Handler for cache entries that have not been decoded yet: decode the instruction
+ * in place, then run it. Only ever reached through the decode cache.
+ */
+static void op_decode(ChipCPU* cpu, const DecodedOp* op){
+    DecodedOp* decodeCache = cpuDecodeCache(cpu);
+    DecodedOp* entry = &decodeCache[op - decodeCache];
+    uint16_t address = (uint16_t)((entry - decodeCache) * 2);
+    const uint8_t* memory = cpuMemory(cpu);
+
+    decodeInstruction((memory[address] << 8) | memory[address + 1], entry);
+    PROFILE_OP(cpu, entry->handler);
+    opHandlers[cpu->quirks][entry->handler](cpu, entry);
+}
+
+/**
+ * Decode and execute a single opcode without touching the decode cache
+ */
+void decodeOperation(uint16_t opcode, ChipCPU* cpu){
+    DecodedOp op;
+    decodeInstruction(opcode, &op);
+    PROFILE_OP(cpu, op.handler);
+    PROFILE_PC(cpu, cpu->PC - 2);
+    COVERAGE_PC(cpu, cpu->PC - 2);
+    opHandlers[cpu->quirks][op.handler](cpu, &op);
+}
+
+/**
+ * Run the instruction at address from the decode cache, for native blocks. They
+ * only run while memory holds the code they were compiled from, so the cached
+ * instruction is the one they expect.
+ */
+static void executeCached(ChipCPU* cpu, uint16_t address){
+    const DecodedOp* op = &cpuDecodeCache(cpu)[address >> 1];
+    PROFILE_OP(cpu, op->handler);
+    PROFILE_PC(cpu, address);
+    COVERAGE_PC(cpu, address);
+    opHandlers[cpu->quirks][op->handler](cpu, op);
+}
+
+// Native blocks fall back on the interpreter for everything they don't translate
+static const ChipNativeHost nativeHost = { executeCached };
+
+/**
+ * Forget everything derived from memory, for when it was replaced wholesale
+ */
+void cpuInvalidateDecodeCache(ChipCPU* cpu)
+{
+    size_t entries = ((size_t)cpu->memoryMask + 1) / 2;
+    memset(cpu->dirtyPages, 0xFF, sizeof(cpu->dirtyPages));
+    memset(cpuDecodeCache(cpu), 0, sizeof(DecodedOp) * entries);
+    memset(cpuBlockLength(cpu), 0, entries);
+    memset(cpu->blockPages, 0, sizeof(cpu->blockPages));
+    if (cpu->engine == CHIP_ENGINE_NATIVE) {
+        nativeAttach(cpu);
+    }
+}
+
+/**
+ * Decode all of memory up front. Meant for templates that many instances are copied
+ * from, so none of them pays for decoding on first execution.
+ */
+void cpuPredecode(ChipCPU* cpu)
+{
+    DecodedOp* decodeCache = cpuDecodeCache(cpu);
+    const uint8_t* memory = cpuMemory(cpu);
+
+    for (int entry = 0; entry <= cpu->memoryMask >> 1; entry++) {
+        if (decodeCache[entry].handler == OP_UNDECODED) {
+            uint16_t address = (uint16_t)(entry * 2);
+            decodeInstruction((memory[address] << 8) | memory[address + 1], &decodeCache[entry]);
+        }
+    }
+}
+
+void cpuSetEngine(ChipCPU* cpu, ChipEngine engine)
+{
+    // Blocks aren't kept up to date by writes while the interpreter runs
+    memset(cpuBlockLength(cpu), 0, ((size_t)cpu->memoryMask + 1) / 2);
+    memset(cpu->blockPages, 0, sizeof(cpu->blockPages));
+    cpu->engine = engine;
+    if (engine == CHIP_ENGINE_NATIVE) {
+        nativeAttach(cpu);
+    }
+}
+
+void cpuSetQuirks(ChipCPU* cpu, ChipQuirks quirks)
+{
+    // Decoded instructions hold handler indices, which mean the same in every table
+    cpu->quirks = quirks < CHIP_QUIRKS_COUNT ? quirks : CHIP_QUIRKS_MODERN;
+    // Native blocks have them compiled in, only the matching module's apply
+    if (cpu->engine == CHIP_ENGINE_NATIVE) {
+        cpuSetEngine(cpu, CHIP_ENGINE_NATIVE);
+    }
+}
+
+/**
+ * Look up a quirks profile by name (modern, vip, chip48, schip), case-insensitive
+ *
+ * @return The ChipQuirks value, -1 if the name is unknown
+ */
+int cpuParseQuirks(const char* name)
+{
+    for (int quirks = 0; quirks < CHIP_QUIRKS_COUNT; quirks++) {
+        if (strcasecmp(name, quirksNames[quirks]) == 0) {
+            return quirks;
+        }
+    }
+    return -1;
+}
+
+const char* cpuQuirksName(ChipQuirks quirks)
+{
+    return quirks < CHIP_QUIRKS_COUNT ? quirksNames[quirks] : "unknown";
+}
+
+// Instructions that read or change PC, or may write into code, end a block
+static int endsBlock(uint8_t handler){
+    switch (handler) {
+        case OP_RET:
+        case OP_EXIT:
+        case OP_JP:
+        case OP_CALL:
+        case OP_SE_VX_NN:
+        case OP_SNE_VX_NN:
+        case OP_SE_VX_VY:
+        case OP_SAVE_RANGE:
+        case OP_SNE_VX_VY:
+        case OP_JP_V0:
+        case OP_SKP:
+        case OP_SKNP:
+        case OP_LD_I_LONG:
+        case OP_LD_VX_K:
+        case OP_BCD:
+        case OP_STORE:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Whether the interpreter ends a block on this opcode, for translators that have
+ * to split their code in the same places
+ */
+bool cpuOpcodeEndsBlock(uint16_t opcode){
+    DecodedOp op;
+    decodeInstruction(opcode, &op);
+    return endsBlock(op.handler);
+}
+
+/**
+ * Decode the straight-line run of instructions starting at entry and record its length.
+ * The block ends after the first control-flow or memory-writing instruction.
+ */
+static uint8_t buildBlock(ChipCPU* cpu, uint16_t entry){
+    DecodedOp* decodeCache = cpuDecodeCache(cpu);
+    const uint8_t* memory = cpuMemory(cpu);
+    uint8_t length = 0;
+
+    while (length < BLOCK_MAX_LENGTH && entry + length <= (cpu->memoryMask >> 1)) {
+        DecodedOp* op = &decodeCache[entry + length];
+        if (op->handler == OP_UNDECODED) {
+            uint16_t address = (entry + length) * 2;
+            decodeInstruction((memory[address] << 8) | memory[address + 1], op);
+        }
+        length++;
+        if (endsBlock(op->handler)) {
+            break;
+        }
+    }
+    cpuBlockLength(cpu)[entry] = length;
+    cpuMarkBlockPages(cpu, entry, length);
+    return length;
+}
+
+/**
+ * Run a whole block. Only the last instruction can observe PC, so it is set once
+ * before that instruction instead of after every one.
+ */
+static void runBlock(ChipCPU* cpu, const OpHandler* handlers, uint16_t entry, uint8_t length){
+    // Only the last instruction can widen memory and move the decode cache
+    const DecodedOp* decodeCache = cpuDecodeCache(cpu);
+    const DecodedOp* op = &decodeCache[entry];
+    const DecodedOp* last = op + length - 1;
+
+    for (; op < last; op++) {
+        PROFILE_OP(cpu, op->handler);
+        PROFILE_PC(cpu, (op - decodeCache) * 2);
+        COVERAGE_PC(cpu, (op - decodeCache) * 2);
+        handlers[op->handler](cpu, op);
+    }
+    cpu->PC = (uint16_t)((entry + length) * 2);
+    PROFILE_OP(cpu, last->handler);
+    PROFILE_PC(cpu, (last - decodeCache) * 2);
+    COVERAGE_PC(cpu, (last - decodeCache) * 2);
+    handlers[last->handler](cpu, last);
+}
 
 
 
 void load_font(ChipCPU* cpu)
 {
-    printf("Loading Integrated Fonts...\n");
+    LOG_DEBUG("Loading Integrated Fonts...");
 
+    uint8_t* memory = cpuMemory(cpu);
     for(int i = 0; i < FONT_ARRAY_SIZE; i++){
-        cpu->memory[FONT_OFFSET + i] = font_sprites[i];
+        memory[FONT_OFFSET + i] = font_sprites[i];
     }
-    printf("Loaded Fonts");
+    for(int i = 0; i < BIG_FONT_ARRAY_SIZE; i++){
+        memory[BIG_FONT_OFFSET + i] = big_font_sprites[i];
+    }
+    LOG_DEBUG("Loaded Fonts");
 }
 
 
-void cpuInit(ChipCPU* cpu)
+/**
+ * Reset the random generator. The same seed always yields the same CXNN sequence.
+ */
+void cpuSeed(ChipCPU* cpu, uint64_t seed)
+{
+    // splitmix64 spreads small seeds over the whole state and never yields 0
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    cpu->rngState = z ? z : 0x9E3779B97F4A7C15ULL;
+}
+
+/**
+ * Reset cpu to power-on state with 4 KiB of memory. A CPU that may hold XO-CHIP
+ * memory has to be cpuFree'd first.
+ */
+void cpuInit(ChipCPU* cpu, uint64_t seed)
 {
     memset(cpu, 0, sizeof(ChipCPU));
+    memset(cpu->dirtyPages, 0xFF, sizeof(cpu->dirtyPages));
     cpu->PC = PROGRAM_OFFSET;
-    printf("Initialize CPU\n");
-    srand(time(NULL));
+    cpu->planeMask = 1;
+    cpu->dirtyRows = DISPLAY_ALL_ROWS;
+    cpu->memoryMask = CHIP8_MEMORY_SIZE - 1;
+    LOG_DEBUG("Initialize CPU");
+    cpuSeed(cpu, seed);
 
     load_font(cpu);
-}
\ No newline at end of file
+}
+
+/**
+ * Release the XO-CHIP memory cpu may hold. It is left a working 4 KiB CPU, with
+ * everything past 4 KiB gone.
+ */
+void cpuFree(ChipCPU* cpu)
+{
+    cpuSetMemoryMask(cpu, CHIP8_MEMORY_SIZE - 1);
+}
+
+/**
+ * Make dst an exact copy of src. dst must have been initialized or copied into
+ * before, or be all zeroes; its XO-CHIP memory is reused or freed as needed.
+ *
+ * @return false if out of memory, dst is then unchanged
+ */
+bool cpuCopy(ChipCPU* dst, const ChipCPU* src)
+{
+    ChipWideMemory* wide = dst->wide;
+
+    if (src->wide && !wide && !(wide = malloc(sizeof(ChipWideMemory)))) {
+        return false;
+    }
+    if (!src->wide) {
+        free(wide);
+        wide = NULL;
+    }
+    memcpy(dst, src, sizeof(ChipCPU));
+    dst->wide = wide;
+    if (wide) {
+        memcpy(wide, src->wide, sizeof(ChipWideMemory));
+    }
+    return true;
+}
+
+/**
+ * Switch between the CHIP-8 address space (mask 0x0FFF) and XO-CHIP's 64 KiB
+ * (0xFFFF). Widening allocates the 64 KiB, which start as a copy of the 4 KiB
+ * followed by zeroes. Narrowing copies the first 4 KiB back and frees the rest.
+ *
+ * @return false for any other mask or if out of memory, cpu is then unchanged
+ */
+bool cpuSetMemoryMask(ChipCPU* cpu, uint16_t mask)
+{
+    if (mask == MEMORY_SIZE - 1 && !cpu->wide) {
+        ChipWideMemory* wide = calloc(1, sizeof(ChipWideMemory));
+        if (!wide) {
+            LOG_ERROR("Out of memory for XO-CHIP memory");
+            return false;
+        }
+        memcpy(wide->memory, cpu->memory, sizeof(cpu->memory));
+        memcpy(wide->decodeCache, cpu->decodeCache, sizeof(cpu->decodeCache));
+        memcpy(wide->blockLength, cpu->blockLength, sizeof(cpu->blockLength));
+        cpu->wide = wide;
+        // Forks taken so far don't have the new pages
+        for (unsigned page = CHIP8_MEMORY_SIZE / MEMORY_PAGE_SIZE; page < MEMORY_PAGE_COUNT; page++) {
+            cpu->dirtyPages[page / 64] |= 1ULL << (page % 64);
+        }
+    } else if (mask == CHIP8_MEMORY_SIZE - 1 && cpu->wide) {
+        ChipWideMemory* wide = cpu->wide;
+        memcpy(cpu->memory, wide->memory, sizeof(cpu->memory));
+        memcpy(cpu->decodeCache, wide->decodeCache, sizeof(cpu->decodeCache));
+        cpu->wide = NULL;
+        cpu->memoryMask = mask;
+        free(wide);
+        // Blocks near the top may have run on past 4 KiB
+        memset(cpu->blockLength, 0, sizeof(cpu->blockLength));
+        memset(cpu->blockPages, 0, sizeof(cpu->blockPages));
+        if (cpu->engine == CHIP_ENGINE_NATIVE) {
+            nativeAttach(cpu);
+        }
+    } else if (mask != MEMORY_SIZE - 1 && mask != CHIP8_MEMORY_SIZE - 1) {
+        return false;
+    }
+    cpu->memoryMask = mask;
+    return true;
+}
+
+// Fetch the next opcode from memory
+uint16_t cpuFetch(const ChipCPU* cpu)
+{
+    // CHIP-8 opcodes are 2 bytes, stored big-endian
+    const uint8_t* memory = cpuMemory(cpu);
+    uint16_t address = cpu->PC & cpu->memoryMask;
+    return (memory[address] << 8) | memory[(address + 1) & cpu->memoryMask];
+}
+
+/**
+ * How many of the remaining n instructions still have to run once the program has
+ * gone idle. The rest would only repeat the idle loop, which changes nothing, so
+ * skipping them leaves the CPU exactly where running them would have. The ones
+ * skipped are added to *skipped.
+ */
+static uint32_t idleRemaining(const ChipCPU* cpu, uint32_t n, uint32_t* skipped){
+    uint32_t remaining;
+
+    switch (cpu->idle) {
+        case CHIP_IDLE_TIMER:
+            // PC is back at the FX07, keep the loop position in phase
+            remaining = n % 3;
+            break;
+        case CHIP_IDLE_KEY:
+        case CHIP_IDLE_HALT:
+            remaining = 0;
+            break;
+        default:
+            remaining = n;
+            break;
+    }
+    *skipped += n - remaining;
+    return remaining;
+}
+
+/**
+ * Execute n instructions back to back with no pacing, rendering or input polling.
+ * Idle loops are fast-forwarded, cpu->idle tells why.
+ *
+ * @return Number of instructions actually executed, n less the ones fast-forwarded
+ */
+uint32_t cpuStep(ChipCPU* cpu, uint32_t n)
+{
+    // The profile is fixed for the whole run, so it is looked up once here
+    const OpHandler* handlers = opHandlers[cpu->quirks];
+    uint32_t budget = n;
+    uint32_t skipped = 0;
+
+    cpu->idle = CHIP_IDLE_NONE;
+    while (n--) {
+        uint16_t address = cpu->PC & cpu->memoryMask;
+
+        // Jumps to odd addresses can't use the per-word cache
+        if (address & 1) {
+            uint16_t opcode = cpuFetch(cpu);
+            cpu->PC += 2;
+            decodeOperation(opcode, cpu);
+            if (cpu->idle) {
+                n = idleRemaining(cpu, n, &skipped);
+            }
+            continue;
+        }
+
+        // Native blocks only run whole too, and only from an unwrapped PC since they
+        // set it to absolute addresses. Code they weren't compiled for, e.g. the
+        // target of a BNNN or a rewritten block, is left to the interpreter.
+        if (cpu->engine == CHIP_ENGINE_NATIVE && cpuBlockLength(cpu)[address >> 1] && cpu->PC == address) {
+            const ChipNativeBlock* block = cpu->native->entries[address >> 1];
+            if (block->count <= n + 1) {
+                COVERAGE_PC(cpu, address);
+                block->run(cpu, &nativeHost);
+                n -= block->count - 1;
+                if (cpu->idle) {
+                    n = idleRemaining(cpu, n, &skipped);
+                }
+                continue;
+            }
+        }
+
+        if (cpu->engine == CHIP_ENGINE_BLOCK) {
+            uint16_t entry = address >> 1;
+            uint8_t length = cpuBlockLength(cpu)[entry];
+            if (length == 0) {
+                length = buildBlock(cpu, entry);
+            }
+            // Blocks only run whole, the tail of a budget is single-stepped
+            if (length <= n + 1) {
+                runBlock(cpu, handlers, entry, length);
+                n -= length - 1;
+                if (cpu->idle) {
+                    n = idleRemaining(cpu, n, &skipped);
+                }
+                continue;
+            }
+        }
+
+        const DecodedOp* op = &cpuDecodeCache(cpu)[address >> 1];
+
+        // Increment PC before execute (most instructions will use this)
+        cpu->PC += 2;
+
+        PROFILE_OP(cpu, op->handler);
+        PROFILE_PC(cpu, address);
+        COVERAGE_PC(cpu, address);
+        handlers[op->handler](cpu, op);
+        if (cpu->idle) {
+            n = idleRemaining(cpu, n, &skipped);
+        }
+    }
+    return budget - skipped;
+}
+
+// Update timers (should be called at 60Hz)
+void cpuTickTimers(ChipCPU* cpu)
+{
+    if (cpu->delayTimer > 0) {
+        cpu->delayTimer--;
+    }
+    // The frontend beeps for as long as this is non-zero
+    if (cpu->soundTimer > 0) {
+        cpu->soundTimer--;
+    }
+}
+
+/**
+ * Run one 60Hz frame: cyclesPerFrame instructions followed by a single timer tick.
+ * cpu->idle tells whether the frame ended in an idle loop.
+ *
+ * @return Number of instructions actually executed, see cpuStep
+ */
+uint32_t cpuRunFrame(ChipCPU* cpu, uint32_t cyclesPerFrame)
+{
+    uint32_t executed = cpuStep(cpu, cyclesPerFrame);
+    cpuTickTimers(cpu);
+#ifdef CHIP8_PROFILE
+    if (cpu->profile) {
+        profileFrame(cpu->profile, executed);
+    }
+#endif
+    return executed;
+}
+
+/**
+ * Copy a program image into memory at PROGRAM_OFFSET. Programs too large for 4 KiB
+ * can only be XO-CHIP, they get the full 64 KiB address space.
+ *
+ * @return false if the program does not fit or out of memory
+ */
+bool cpuLoadProgram(ChipCPU* cpu, const uint8_t* program, size_t size)
+{
+    if (size > (MEMORY_SIZE - PROGRAM_OFFSET)) {
+        return false;
+    }
+    if (size > (size_t)cpu->memoryMask + 1 - PROGRAM_OFFSET) {
+        LOG_DEBUG("%zu byte program, using XO-CHIP memory", size);
+        if (!cpuSetMemoryMask(cpu, MEMORY_SIZE - 1)) {
+            return false;
+        }
+    }
+    memcpy(&cpuMemory(cpu)[PROGRAM_OFFSET], program, size);
+    cpuInvalidateDecodeCache(cpu);
+    return true;
+}
+
+/**
+ * Overwrite part of memory from the host, e.g. to patch a program into a CPU reset
+ * from a template. Unlike cpuLoadProgram this keeps every decoded instruction,
+ * block and fork page outside the written bytes. Addresses wrap like the program's.
+ */
+void cpuWriteMemory(ChipCPU* cpu, uint16_t address, const uint8_t* data, size_t size)
+{
+    size_t done = 0;
+
+    while (done < size) {
+        uint16_t start = (uint16_t)((address + done) & cpu->memoryMask);
+        size_t run = (size_t)cpu->memoryMask + 1 - start;
+        run = run < size - done ? run : size - done;
+        memcpy(&cpuMemory(cpu)[start], data + done, run);
+
+        unsigned last = start + (unsigned)run - 1;
+        for (unsigned page = start / MEMORY_PAGE_SIZE; page <= last / MEMORY_PAGE_SIZE; page++) {
+            cpu->dirtyPages[page / 64] |= 1ULL << (page % 64);
+        }
+        for (unsigned entry = start >> 1; entry <= last >> 1; entry++) {
+            cpuDecodeCache(cpu)[entry].handler = OP_UNDECODED;
+            if (cpu->engine != CHIP_ENGINE_INTERPRETER) {
+                invalidateBlocks(cpu, (uint16_t)entry);
+            }
+        }
+        done += run;
+    }
+}
+
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t size)
+{
+    const uint8_t* bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+/**
+ * 64-bit FNV-1a hash of an arbitrary buffer, e.g. a ROM image
+ */
+uint64_t cpuHashBytes(const void* data, size_t size)
+{
+    return fnv1a(0xCBF29CE484222325ULL, data, size);
+}
+
+/**
+ * 64-bit FNV-1a hash of the architectural state (memory, registers, stack, timers,
+ * display and its mode, keys, RNG and user flags). Caches and host-side flags are not included, so two runs that
+ * behaved identically hash identically whatever engine executed them.
+ */
+uint64_t cpuStateHash(const ChipCPU* cpu)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    // Memory past memoryMask can't be reached, so it isn't state
+    hash = fnv1a(hash, cpuMemory(cpu), (size_t)cpu->memoryMask + 1);
+    hash = fnv1a(hash, &cpu->PC, sizeof(cpu->PC));
+    hash = fnv1a(hash, &cpu->I, sizeof(cpu->I));
+    hash = fnv1a(hash, cpu->V, sizeof(cpu->V));
+    hash = fnv1a(hash, cpu->stack, sizeof(cpu->stack));
+    hash = fnv1a(hash, &cpu->stackPointer, sizeof(cpu->stackPointer));
+    hash = fnv1a(hash, &cpu->soundTimer, sizeof(cpu->soundTimer));
+    hash = fnv1a(hash, &cpu->delayTimer, sizeof(cpu->delayTimer));
+    hash = fnv1a(hash, &cpu->display, sizeof(cpu->display));
+    hash = fnv1a(hash, cpu->keys, sizeof(cpu->keys));
+    hash = fnv1a(hash, &cpu->rngState, sizeof(cpu->rngState));
+    hash = fnv1a(hash, &cpu->hires, sizeof(cpu->hires));
+    hash = fnv1a(hash, &cpu->planeMask, sizeof(cpu->planeMask));
+    hash = fnv1a(hash, &cpu->memoryMask, sizeof(cpu->memoryMask));
+    hash = fnv1a(hash, cpu->rpl, sizeof(cpu->rpl));
+    return hash;
+}
+
+// Key state as a bitmask, bit i set when key i is held
+uint16_t cpuGetKeyMask(const ChipCPU* cpu)
+{
+    uint16_t mask = 0;
+    for (int i = 0; i < KEY_COUNT; i++) {
+        if (cpu->keys[i]) {
+            mask |= (uint16_t)(1u << i);
+        }
+    }
+    return mask;
+}
+
+void cpuSetKeyMask(ChipCPU* cpu, uint16_t mask)
+{
+    for (int i = 0; i < KEY_COUNT; i++) {
+        cpu->keys[i] = (mask >> i) & 1;
+    }
+}
@@ -1,27 +1,123 @@
 //
 // Created by Tristan Possessky on 10/24/25.
 //
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifndef CHIP8_CHIPCPU_H
 #define CHIP8_CHIPCPU_H
 
-#define MEMORY_SIZE 4096
+// XO-CHIP address space. CHIP-8 and SUPER-CHIP programs see the first 4 KiB only,
+// addresses wrap through ChipCPU.memoryMask. Only CPUs that need more carry the
+// rest, see ChipWideMemory.
+#define MEMORY_SIZE 65536
+#define CHIP8_MEMORY_SIZE 4096
 #define V_REGISTER_COUNT 16
 #define STACK_DEPTH 16
 #define DISPLAY_WIDTH 64
 #define DISPLAY_HEIGHT 32
 #define DISPLAY_SIZE (DISPLAY_WIDTH * DISPLAY_HEIGHT)
+#define DISPLAY_HIRES_WIDTH 128
+#define DISPLAY_HIRES_HEIGHT 64
+#define DISPLAY_ROW_WORDS (DISPLAY_HIRES_WIDTH / 64)
+#define DISPLAY_PLANES 4
+#define DISPLAY_ALL_ROWS UINT64_MAX
 #define DISPLAY_SCALE 10
 #define KEY_COUNT 16
 #define FONT_OFFSET 0x50
+#define BIG_FONT_OFFSET (FONT_OFFSET + FONT_ARRAY_SIZE)
 #define PROGRAM_OFFSET 0x200
+#define RPL_FLAG_COUNT 16
 
 
 #define FONT_ARRAY_SIZE 80
+#define BIG_FONT_ARRAY_SIZE 160
+#define DECODE_CACHE_SIZE (MEMORY_SIZE / 2)
+#define CHIP8_DECODE_CACHE_SIZE (CHIP8_MEMORY_SIZE / 2)
+#define BLOCK_MAX_LENGTH 32
+// Granularity of copy-on-write sharing between forks
+#define MEMORY_PAGE_SIZE 256
+#define MEMORY_PAGE_COUNT (MEMORY_SIZE / MEMORY_PAGE_SIZE)
 
-typedef struct ChipCPU {
+typedef enum ChipEngine {
+    CHIP_ENGINE_INTERPRETER = 0,  // One cached instruction per dispatch
+    CHIP_ENGINE_BLOCK,            // Straight-line basic blocks run as one unit
+    CHIP_ENGINE_NATIVE,           // Blocks compiled ahead of time by chip8_aot, see native.h
+} ChipEngine;
+
+/**
+ * Behaviour of the opcodes the historical interpreters disagree on. Each profile has
+ * its own set of compiled handlers, so choosing one costs nothing per instruction.
+ *
+ *             8XY6/8XYE  FX55/FX65 I  BNNN       DXYN  8XY1-3
+ *   modern    VX         I + X + 1    V0 + NNN   wrap  VF kept
+ *   vip       VY         I + X + 1    V0 + NNN   clip  VF = 0
+ *   chip48    VX         I + X        VX + XNN   clip  VF kept
+ *   schip     VX         unchanged    VX + XNN   clip  VF kept
+ */
+typedef enum ChipQuirks {
+    CHIP_QUIRKS_MODERN = 0,  // What this emulator always did, the default
+    CHIP_QUIRKS_VIP,         // COSMAC VIP, the original interpreter
+    CHIP_QUIRKS_CHIP48,      // CHIP-48 on the HP-48
+    CHIP_QUIRKS_SCHIP,       // SUPER-CHIP 1.1
+    CHIP_QUIRKS_COUNT
+} ChipQuirks;
+
+// Why the last cpuStep stopped doing useful work. Only changes on a timer tick or
+// a key press can get the program going again.
+typedef enum ChipIdle {
+    CHIP_IDLE_NONE = 0,
+    CHIP_IDLE_TIMER,  // Spinning on an FX07 / 3XNN|4XNN / 1NNN delay-timer poll
+    CHIP_IDLE_KEY,    // FX0A waiting with no key down
+    CHIP_IDLE_HALT,   // 1NNN jumping to itself
+} ChipIdle;
+
+// Program errors the core caught, or'd into ChipCPU.faults. Execution goes on in a
+// defined way and the bits stay set until the host clears them.
+typedef enum ChipFault {
+    CHIP_FAULT_STACK_OVERFLOW = 1 << 0,   // 2NNN with the stack full, parked on the call
+    CHIP_FAULT_STACK_UNDERFLOW = 1 << 1,  // 00EE with the stack empty (or its pointer past it), parked on the return
+    CHIP_FAULT_MEMORY_WRAP = 1 << 2,      // DXYN / FX33 / FX55 / FX65 / 5XY2 / 5XY3 ran past the
+                                          // end of memory and wrapped to address 0
+    CHIP_FAULT_KEY_RANGE = 1 << 3,        // EX9E / EXA1 with VX above F, only its low nibble is used
+} ChipFault;
+
+// One pre-decoded instruction. handler indexes the interpreter's handler table,
+// 0 means the entry has not been decoded yet (or was invalidated by a write)
+typedef struct DecodedOp {
+    uint8_t handler;
+    uint8_t x;
+    uint8_t y;
+    uint8_t n;
+    uint16_t nnn;
+    uint8_t nn;
+    uint8_t reserved;
+} DecodedOp;
+
+/**
+ * Bit-packed framebuffer, one bitplane per XO-CHIP plane. Each row is 128 pixels in
+ * two words, bit 63 of word 0 is x = 0. In lores (64x32) only word 0 of the first
+ * 32 rows is used, so the classic display is still one word per row.
+ */
+typedef struct ChipDisplay {
+    uint64_t planes[DISPLAY_PLANES][DISPLAY_HIRES_HEIGHT][DISPLAY_ROW_WORDS];
+} ChipDisplay;
+
+/**
+ * The whole XO-CHIP address space with what was decoded from it. Allocated when a
+ * program needs more than 4 KiB (see cpuSetMemoryMask), from then on it holds all
+ * of memory and the 4 KiB arrays in ChipCPU go unused.
+ */
+typedef struct ChipWideMemory {
     uint8_t memory[MEMORY_SIZE];
+    DecodedOp decodeCache[DECODE_CACHE_SIZE];
+    uint8_t blockLength[DECODE_CACHE_SIZE];
+} ChipWideMemory;
+
+// Holds a pointer to its wide memory, so copy it with cpuCopy rather than memcpy
+typedef struct ChipCPU {
+    uint8_t memory[CHIP8_MEMORY_SIZE];  // Go through cpuMemory, XO-CHIP programs use wide
     uint16_t PC;
     uint16_t I;
     uint8_t V[V_REGISTER_COUNT];
@@ -29,13 +125,107 @@ typedef struct ChipCPU {
     uint8_t stackPointer;
     uint8_t soundTimer;
     uint8_t delayTimer;
-    uint8_t display[DISPLAY_SIZE];
+    ChipDisplay display;
     uint8_t keys[KEY_COUNT];
+    uint64_t rngState;  // Per-instance xorshift64* state for CXNN, set by cpuSeed
     uint8_t drawFlag;  // Set to 1 when display should be redrawn
+    uint64_t dirtyRows;  // Display rows drawn since the host last cleared this, bit n is row n
+                         // of the current resolution
+    uint8_t engine;    // ChipEngine used by cpuStep
+    uint8_t quirks;    // ChipQuirks profile, picks the handler table
+    uint8_t idle;      // ChipIdle reason the last cpuStep ended idle, set by the core
+    uint8_t faults;    // ChipFault bits raised since the host last cleared them
+    uint8_t hires;     // SUPER-CHIP 128x64 mode, 00FF / 00FE
+    uint8_t planeMask; // XO-CHIP planes drawn, cleared and scrolled (FN01), 1 = plane 0 only
+    uint16_t memoryMask;  // Addressable memory - 1, grows to 64 KiB for XO-CHIP programs
+    uint8_t rpl[RPL_FLAG_COUNT];  // SUPER-CHIP user flags, FX75 / FX85
+    struct ChipProfile* profile;  // Instrumentation sink, NULL = off (needs CHIP8_PROFILE)
+    struct ChipCoverage* coverage;  // Edge coverage sink, NULL = off (needs CHIP8_COVERAGE)
+    const struct ChipNative* native;  // Compiled blocks for CHIP_ENGINE_NATIVE, NULL = none
+    ChipWideMemory* wide;  // Set while memoryMask covers 64 KiB, owned by this CPU
+    uint64_t dirtyPages[(MEMORY_PAGE_COUNT + 63) / 64];  // Pages written since the last fork/restore
+    uint64_t blockPages[(MEMORY_PAGE_COUNT + 63) / 64];  // Pages a block was built or attached over
+    DecodedOp decodeCache[CHIP8_DECODE_CACHE_SIZE];  // One entry per even address, see cpuDecodeCache
+    uint8_t blockLength[CHIP8_DECODE_CACHE_SIZE];    // Instructions in the block starting here, 0 = not
+                                                     // built (native engine: words of the native block,
+                                                     // 0 = none), see cpuBlockLength
 } ChipCPU;
 
-void cpuInit(ChipCPU* cpu);
+// Memory and the arrays indexed like it, wherever the CPU currently keeps them
+static inline uint8_t* cpuMemory(const ChipCPU* cpu)
+{
+    return cpu->wide ? cpu->wide->memory : (uint8_t*)cpu->memory;
+}
+
+static inline DecodedOp* cpuDecodeCache(const ChipCPU* cpu)
+{
+    return cpu->wide ? cpu->wide->decodeCache : (DecodedOp*)cpu->decodeCache;
+}
+
+static inline uint8_t* cpuBlockLength(const ChipCPU* cpu)
+{
+    return cpu->wide ? cpu->wide->blockLength : (uint8_t*)cpu->blockLength;
+}
+
+// ARGB colour of each palette index, see cpuGetPixel
+extern const uint32_t cpuPalette[1 << DISPLAY_PLANES];
+
+// Display accessors, the framebuffer is bit-packed so read it through these
+static inline int cpuDisplayWidth(const ChipCPU* cpu)
+{
+    return cpu->hires ? DISPLAY_HIRES_WIDTH : DISPLAY_WIDTH;
+}
+
+static inline int cpuDisplayHeight(const ChipCPU* cpu)
+{
+    return cpu->hires ? DISPLAY_HIRES_HEIGHT : DISPLAY_HEIGHT;
+}
+
+// Palette index of a pixel, bit n is plane n
+static inline uint8_t cpuGetPixel(const ChipCPU* cpu, int x, int y)
+{
+    uint8_t color = 0;
+    for (int plane = 0; plane < DISPLAY_PLANES; plane++) {
+        color |= ((cpu->display.planes[plane][y][x >> 6] >> (63 - (x & 63))) & 1) << plane;
+    }
+    return color;
+}
+
+// Note the pages a block covers, only writes to those have to look for blocks to drop
+static inline void cpuMarkBlockPages(ChipCPU* cpu, uint16_t entry, unsigned words)
+{
+    unsigned last = (entry + words) * 2 - 1;
+    for (unsigned page = entry * 2 / MEMORY_PAGE_SIZE; page <= last / MEMORY_PAGE_SIZE; page++) {
+        cpu->blockPages[page / 64] |= 1ULL << (page % 64);
+    }
+}
+
+void cpuInit(ChipCPU* cpu, uint64_t seed);
+void cpuFree(ChipCPU* cpu);
+bool cpuCopy(ChipCPU* dst, const ChipCPU* src);
+bool cpuSetMemoryMask(ChipCPU* cpu, uint16_t mask);
+void cpuSeed(ChipCPU* cpu, uint64_t seed);
 void decodeOperation(uint16_t opcode, ChipCPU* cpu);
 void load_font(ChipCPU* cpu);
 
+// Headless execution API, no SDL required
+uint16_t cpuFetch(const ChipCPU* cpu);
+void cpuInvalidateDecodeCache(ChipCPU* cpu);
+void cpuPredecode(ChipCPU* cpu);
+void cpuSetEngine(ChipCPU* cpu, ChipEngine engine);
+void cpuSetQuirks(ChipCPU* cpu, ChipQuirks quirks);
+int cpuParseQuirks(const char* name);
+const char* cpuQuirksName(ChipQuirks quirks);
+bool cpuLoadProgram(ChipCPU* cpu, const uint8_t* program, size_t size);
+void cpuWriteMemory(ChipCPU* cpu, uint16_t address, const uint8_t* data, size_t size);
+uint64_t cpuStateHash(const ChipCPU* cpu);
+uint64_t cpuHashBytes(const void* data, size_t size);
+uint16_t cpuGetKeyMask(const ChipCPU* cpu);
+void cpuSetKeyMask(ChipCPU* cpu, uint16_t mask);
+uint32_t cpuStep(ChipCPU* cpu, uint32_t n);
+void cpuTickTimers(ChipCPU* cpu);
+uint32_t cpuRunFrame(ChipCPU* cpu, uint32_t cyclesPerFrame);
+bool cpuOpcodeEndsBlock(uint16_t opcode);
+const char* cpuHandlerName(unsigned handler);
+
 #endif //CHIP8_CHIPCPU_H
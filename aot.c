@@ -0,0 +1,573 @@
+//
+// Ahead-of-time compiler: follows a ROM's control flow from PROGRAM_OFFSET, turns
+// every basic block it reaches into a C function on ChipCPU and builds them into a
+// shared object that CHIP_ENGINE_NATIVE runs instead of the interpreter.
+//
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ChipCPU.h"
+#include "native.h"
+
+// Compiler and core headers the generated code is built with, set by CMake
+#ifndef CHIP8_AOT_CC
+#define CHIP8_AOT_CC "cc"
+#endif
+#ifndef CHIP8_AOT_INCLUDE
+#define CHIP8_AOT_INCLUDE "."
+#endif
+
+#define REGISTER_I 16
+
+// Where FX55 / FX65 leave I
+enum {
+    I_UNCHANGED,
+    I_PLUS_X,
+    I_PLUS_X_PLUS_1,
+};
+
+/**
+ * The quirk columns that change translated code, must match CHIP_QUIRK_PROFILES in
+ * ChipCPU.c. Drawing and stores are left to the interpreter, so their quirks
+ * don't matter here.
+ */
+static const struct {
+    bool shiftVY;
+    int indexStep;
+    bool jumpVX;
+    bool vfReset;
+} quirkTable[CHIP_QUIRKS_COUNT] = {
+    [CHIP_QUIRKS_MODERN] = { false, I_PLUS_X_PLUS_1, false, false },
+    [CHIP_QUIRKS_VIP]    = { true,  I_PLUS_X_PLUS_1, false, true  },
+    [CHIP_QUIRKS_CHIP48] = { false, I_PLUS_X,        true,  false },
+    [CHIP_QUIRKS_SCHIP]  = { false, I_UNCHANGED,     true,  false },
+};
+
+typedef struct AotBlock {
+    uint16_t address;
+    uint8_t words;
+    uint8_t count;
+} AotBlock;
+
+static uint8_t rom[MEMORY_SIZE];
+static uint32_t romSize;
+static ChipQuirks quirks;
+static FILE *out;
+
+static uint16_t worklist[DECODE_CACHE_SIZE];
+static uint32_t worklistCount;
+static bool queued[DECODE_CACHE_SIZE];
+static AotBlock blocks[DECODE_CACHE_SIZE];
+static uint32_t blockCount;
+
+// Registers whose local copy is newer than the CPU's, bit 16 is I
+static uint32_t dirty;
+
+static void emit(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vfprintf(out, format, args);
+    va_end(args);
+}
+
+// Whether words code words starting at address are all part of the ROM image
+static bool inRom(uint32_t address, uint32_t words)
+{
+    return address >= PROGRAM_OFFSET && address + words * 2 <= PROGRAM_OFFSET + romSize;
+}
+
+static uint16_t opcodeAt(uint32_t address)
+{
+    return (uint16_t)((rom[address] << 8) | rom[address + 1]);
+}
+
+static void enqueue(uint32_t address)
+{
+    // Odd and out-of-image targets are left to the interpreter
+    if ((address & 1) == 0 && inRom(address, 1) && !queued[address >> 1]) {
+        queued[address >> 1] = true;
+        worklist[worklistCount++] = (uint16_t)address;
+    }
+}
+
+static void storeDirty(void)
+{
+    for (int x = 0; x < V_REGISTER_COUNT; x++) {
+        if (dirty & (1u << x)) {
+            emit("    cpu->V[0x%X] = v%X;\n", x, x);
+        }
+    }
+    if (dirty & (1u << REGISTER_I)) {
+        emit("    cpu->I = i;\n");
+    }
+    dirty = 0;
+}
+
+static void loadAll(void)
+{
+    for (int x = 0; x < V_REGISTER_COUNT; x++) {
+        emit("    v%X = cpu->V[0x%X];\n", x, x);
+    }
+    emit("    i = cpu->I;\n");
+}
+
+/**
+ * Hand one instruction to the interpreter. It may read or change any register.
+ * Instructions the interpreter ends a block on set PC themselves, so they end
+ * this one too and the caller looks up wherever they went.
+ *
+ * @return Whether the instruction ends the block
+ */
+static bool emitHost(uint32_t address)
+{
+    storeDirty();
+    if (cpuOpcodeEndsBlock(opcodeAt(address))) {
+        emit("    cpu->PC = 0x%04X;\n    host->execute(cpu, 0x%04X);\n", (address + 2) & 0xFFFF, address);
+        enqueue(address + 2);
+        return true;
+    }
+    emit("    host->execute(cpu, 0x%04X);\n", address);
+    loadAll();
+    return false;
+}
+
+// Skip instructions end a block, they know statically where both paths go
+static void emitSkip(uint32_t address, const char *condition)
+{
+    uint32_t next = address + 2;
+    uint32_t skip = next + (opcodeAt(next) == 0xF000 ? 4 : 2);
+
+    emit("    cpu->PC = (%s) ? 0x%04X : 0x%04X;\n", condition, skip & 0xFFFF, next);
+    enqueue(next);
+    enqueue(skip);
+}
+
+/**
+ * 1NNN. Jumps to itself and delay-timer polls are flagged idle the same way op_jp
+ * does. The poll's code is checked again at run time in case it was overwritten.
+ */
+static void emitJump(uint32_t address, uint16_t target)
+{
+    emit("    cpu->PC = 0x%04X;\n", target);
+    if (target == address) {
+        emit("    cpu->idle = CHIP_IDLE_HALT;\n");
+    } else if (target == address - 4 && inRom(target, 2) && target + 3 < CHIP8_MEMORY_SIZE) {
+        uint8_t x = rom[target] & 0x0F;
+        uint8_t skip = rom[target + 2] >> 4;
+        if ((rom[target] & 0xF0) == 0xF0 && rom[target + 1] == 0x07 && (skip == 0x3 || skip == 0x4)
+            && (rom[target + 2] & 0x0F) == x) {
+            emit("    if (cpuMemory(cpu)[0x%04X] == 0x%02X && cpuMemory(cpu)[0x%04X] == 0x07\n"
+                 "        && cpuMemory(cpu)[0x%04X] == 0x%02X && cpu->V[0x%X] == cpu->delayTimer) {\n"
+                 "        cpu->idle = CHIP_IDLE_TIMER;\n"
+                 "    }\n",
+                 target, rom[target], target + 1, target + 2, rom[target + 2], x);
+        }
+    }
+    enqueue(target);
+}
+
+/**
+ * Translate the instruction at address. Straight-line instructions work on the
+ * locals v0-vF and i; instructions that end the block run after they were stored
+ * back and set PC themselves.
+ *
+ * @return Whether the instruction ends the block
+ */
+static bool emitInstruction(uint32_t address)
+{
+    uint16_t opcode = opcodeAt(address);
+    unsigned x = (opcode >> 8) & 0xF;
+    unsigned y = (opcode >> 4) & 0xF;
+    unsigned n = opcode & 0xF;
+    unsigned nn = opcode & 0xFF;
+    unsigned nnn = opcode & 0xFFF;
+    uint32_t next = address + 2;
+    char condition[64];
+
+    emit("    // %04X: %04X\n", address, opcode);
+    switch (opcode >> 12) {
+        case 0x0:
+            // Decoded on the low byte like the interpreter does, 0NEE is a RET too
+            if (nn == 0xEE) {
+                // Indirect, the caller looks up whatever block it returns to
+                storeDirty();
+                emit("    if (cpu->stackPointer == 0 || cpu->stackPointer > STACK_DEPTH) {\n"
+                     "        cpu->faults |= CHIP_FAULT_STACK_UNDERFLOW;\n"
+                     "        cpu->PC = 0x%04X;\n"
+                     "        cpu->idle = CHIP_IDLE_HALT;\n"
+                     "    } else {\n"
+                     "        cpu->stackPointer--;\n"
+                     "        cpu->PC = cpu->stack[cpu->stackPointer];\n"
+                     "    }\n", address);
+                return true;
+            }
+            if (nn == 0xFD) {
+                storeDirty();
+                emit("    cpu->PC = 0x%04X;\n    host->execute(cpu, 0x%04X);\n", next, address);
+                enqueue(address);
+                return true;
+            }
+            return emitHost(address);
+        case 0x1:
+            storeDirty();
+            emitJump(address, (uint16_t)nnn);
+            return true;
+        case 0x2:
+            storeDirty();
+            emit("    if (cpu->stackPointer >= STACK_DEPTH) {\n"
+                 "        cpu->faults |= CHIP_FAULT_STACK_OVERFLOW;\n"
+                 "        cpu->PC = 0x%04X;\n"
+                 "        cpu->idle = CHIP_IDLE_HALT;\n"
+                 "    } else {\n"
+                 "        cpu->stack[cpu->stackPointer] = 0x%04X;\n"
+                 "        cpu->stackPointer++;\n"
+                 "        cpu->PC = 0x%04X;\n"
+                 "    }\n", address, next, nnn);
+            enqueue(nnn);
+            enqueue(next);
+            return true;
+        case 0x3:
+        case 0x4:
+        case 0x9:
+            storeDirty();
+            if ((opcode >> 12) == 0x9) {
+                snprintf(condition, sizeof(condition), "cpu->V[0x%X] != cpu->V[0x%X]", x, y);
+            } else {
+                snprintf(condition, sizeof(condition), "cpu->V[0x%X] %s 0x%02X", x,
+                         (opcode >> 12) == 0x3 ? "==" : "!=", nn);
+            }
+            emitSkip(address, condition);
+            return true;
+        case 0x5:
+            if (n == 0x2) {
+                // Writes memory, maybe into this very block
+                storeDirty();
+                emit("    cpu->PC = 0x%04X;\n    host->execute(cpu, 0x%04X);\n", next, address);
+                enqueue(next);
+                return true;
+            }
+            if (n == 0x3) {
+                return emitHost(address);
+            }
+            storeDirty();
+            snprintf(condition, sizeof(condition), "cpu->V[0x%X] == cpu->V[0x%X]", x, y);
+            emitSkip(address, condition);
+            return true;
+        case 0x6:
+            emit("    v%X = 0x%02X;\n", x, nn);
+            dirty |= 1u << x;
+            return false;
+        case 0x7:
+            emit("    v%X = (uint8_t)(v%X + 0x%02X);\n", x, x, nn);
+            dirty |= 1u << x;
+            return false;
+        case 0x8: {
+            // Same statement order as the handlers, which matters when X or Y is F
+            unsigned source = quirkTable[quirks].shiftVY ? y : x;
+            switch (n) {
+                case 0x0: emit("    v%X = v%X;\n", x, y); break;
+                case 0x1: emit("    v%X |= v%X;\n", x, y); break;
+                case 0x2: emit("    v%X &= v%X;\n", x, y); break;
+                case 0x3: emit("    v%X ^= v%X;\n", x, y); break;
+                case 0x4:
+                    emit("    {\n        unsigned sum = v%X + v%X;\n        vF = sum > 255;\n"
+                         "        v%X = (uint8_t)sum;\n    }\n", x, y, x);
+                    break;
+                case 0x5: emit("    vF = v%X >= v%X;\n    v%X = (uint8_t)(v%X - v%X);\n", x, y, x, x, y); break;
+                case 0x6: emit("    vF = v%X & 0x1;\n    v%X = v%X >> 1;\n", source, x, source); break;
+                case 0x7: emit("    vF = v%X >= v%X;\n    v%X = (uint8_t)(v%X - v%X);\n", y, x, x, y, x); break;
+                case 0xE: emit("    vF = (v%X & 0x80) >> 7;\n    v%X = (uint8_t)(v%X << 1);\n", source, x, source); break;
+                default:
+                    return false;
+            }
+            if (n >= 0x1 && n <= 0x3 && quirkTable[quirks].vfReset) {
+                emit("    vF = 0;\n");
+            }
+            dirty |= 1u << x;
+            if (n >= 0x1) {
+                dirty |= 1u << 0xF;
+            }
+            return false;
+        }
+        case 0xA:
+            emit("    i = 0x%03X;\n", nnn);
+            dirty |= 1u << REGISTER_I;
+            return false;
+        case 0xB:
+            // Indirect, the caller looks up the target
+            storeDirty();
+            emit("    cpu->PC = (uint16_t)(cpu->V[0x%X] + 0x%03X);\n", quirkTable[quirks].jumpVX ? x : 0, nnn);
+            return true;
+        case 0xC:
+            // nextRandom, the xorshift64* generator
+            emit("    {\n        uint64_t r = cpu->rngState;\n        r ^= r >> 12;\n        r ^= r << 25;\n"
+                 "        r ^= r >> 27;\n        cpu->rngState = r;\n"
+                 "        v%X = (uint8_t)((r * 0x2545F4914F6CDD1DULL) >> 56) & 0x%02X;\n    }\n", x, nn);
+            dirty |= 1u << x;
+            return false;
+        case 0xD:
+            return emitHost(address);
+        case 0xE:
+            if (nn == 0x9E || nn == 0xA1) {
+                storeDirty();
+                emit("    if (cpu->V[0x%X] >= KEY_COUNT) {\n        cpu->faults |= CHIP_FAULT_KEY_RANGE;\n    }\n", x);
+                snprintf(condition, sizeof(condition), "%scpu->keys[cpu->V[0x%X] & 0xF]", nn == 0xA1 ? "!" : "", x);
+                emitSkip(address, condition);
+                return true;
+            }
+            return false;
+        default:
+            break;
+    }
+
+    switch (nn) {
+        case 0x00:
+            if (x == 0) {
+                storeDirty();
+                // The interpreter widens memory, PC has to be at NNNN for it
+                emit("    cpu->PC = 0x%04X;\n    host->execute(cpu, 0x%04X);\n", next, address);
+                enqueue(address + 4);
+                return true;
+            }
+            return emitHost(address);
+        case 0x07:
+            emit("    v%X = cpu->delayTimer;\n", x);
+            dirty |= 1u << x;
+            return false;
+        case 0x15:
+            emit("    cpu->delayTimer = v%X;\n", x);
+            return false;
+        case 0x18:
+            emit("    cpu->soundTimer = v%X;\n", x);
+            return false;
+        case 0x1E:
+            emit("    i = (uint16_t)(i + v%X);\n", x);
+            dirty |= 1u << REGISTER_I;
+            return false;
+        case 0x29:
+            emit("    i = FONT_OFFSET + (v%X & 0xF) * 5;\n", x);
+            dirty |= 1u << REGISTER_I;
+            return false;
+        case 0x30:
+            emit("    i = BIG_FONT_OFFSET + (v%X & 0xF) * 10;\n", x);
+            dirty |= 1u << REGISTER_I;
+            return false;
+        case 0x65:
+            emit("    if (i + %u > cpu->memoryMask) {\n        cpu->faults |= CHIP_FAULT_MEMORY_WRAP;\n    }\n", x);
+            for (unsigned k = 0; k <= x; k++) {
+                emit("    v%X = cpuMemory(cpu)[(i + %u) & cpu->memoryMask];\n", k, k);
+                dirty |= 1u << k;
+            }
+            if (quirkTable[quirks].indexStep != I_UNCHANGED) {
+                emit("    i = (uint16_t)(i + %u);\n", quirkTable[quirks].indexStep == I_PLUS_X ? x : x + 1);
+                dirty |= 1u << REGISTER_I;
+            }
+            return false;
+        case 0x0A:
+            enqueue(address);
+            // PC is needed to wait on the instruction
+            /* fall through */
+        case 0x33:
+        case 0x55:
+            storeDirty();
+            emit("    cpu->PC = 0x%04X;\n    host->execute(cpu, 0x%04X);\n", next, address);
+            enqueue(next);
+            return true;
+        default:
+            return emitHost(address);
+    }
+}
+
+// Code words an instruction needs translated together with it
+static uint32_t wordsNeeded(uint32_t address)
+{
+    uint16_t opcode = opcodeAt(address);
+    switch (opcode >> 12) {
+        case 0x3:
+        case 0x4:
+        case 0x9:
+            return 2;  // The skipped instruction's length decides the skip target
+        case 0x5:
+            return (opcode & 0xF) == 0x2 || (opcode & 0xF) == 0x3 ? 1 : 2;
+        case 0xE:
+            return (opcode & 0xFF) == 0x9E || (opcode & 0xFF) == 0xA1 ? 2 : 1;
+        case 0xF:
+            return opcode == 0xF000 ? 2 : 1;
+        default:
+            return 1;
+    }
+}
+
+/**
+ * Translate the block starting at entry into block_XXXX and queue the blocks it
+ * can continue in. Blocks end like the interpreter's (see endsBlock), or where
+ * the next instruction would take them past BLOCK_MAX_LENGTH words or the image.
+ */
+static void translateBlock(uint16_t entry)
+{
+    AotBlock block = { entry, 0, 0 };
+    uint32_t address = entry;
+    bool ended = false;
+
+    // Instructions only the interpreter can run here (the skipped word or F000's
+    // operand lies past the image) get no block of their own
+    if (!inRom(entry, wordsNeeded(entry))) {
+        return;
+    }
+
+    emit("\nstatic void block_%04X(ChipCPU *cpu, const ChipNativeHost *host)\n{\n", entry);
+    // Most blocks touch a few registers, the compiler drops the other loads
+    emit("    __attribute__((unused)) uint8_t v0 = cpu->V[0x0], v1 = cpu->V[0x1], v2 = cpu->V[0x2], v3 = cpu->V[0x3],\n"
+         "        v4 = cpu->V[0x4], v5 = cpu->V[0x5], v6 = cpu->V[0x6], v7 = cpu->V[0x7],\n"
+         "        v8 = cpu->V[0x8], v9 = cpu->V[0x9], vA = cpu->V[0xA], vB = cpu->V[0xB],\n"
+         "        vC = cpu->V[0xC], vD = cpu->V[0xD], vE = cpu->V[0xE], vF = cpu->V[0xF];\n"
+         "    __attribute__((unused)) uint16_t i = cpu->I;\n");
+    dirty = 0;
+    while (!ended) {
+        uint32_t words = wordsNeeded(address);
+        if (!inRom(address, words) || block.words + words > BLOCK_MAX_LENGTH) {
+            break;
+        }
+        ended = emitInstruction(address);
+        block.words += words;
+        block.count++;
+        address += 2;
+    }
+    if (!ended) {
+        storeDirty();
+        emit("    cpu->PC = 0x%04X;\n", address);
+        enqueue(address);
+    }
+    emit("    (void)host;\n}\n");
+    blocks[blockCount++] = block;
+}
+
+static bool readRom(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Error: Could not open ROM file: %s\n", path);
+        return false;
+    }
+    romSize = (uint32_t)fread(&rom[PROGRAM_OFFSET], 1, MEMORY_SIZE - PROGRAM_OFFSET, file);
+    fclose(file);
+    return romSize > 0;
+}
+
+static bool writeSource(const char *path)
+{
+    out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Error: Could not write %s\n", path);
+        return false;
+    }
+
+    emit("// Generated by chip8_aot, %s quirks. Do not edit.\n"
+         "#include <stdint.h>\n#include \"native.h\"\n", cpuQuirksName(quirks));
+    enqueue(PROGRAM_OFFSET);
+    for (uint32_t next = 0; next < worklistCount; next++) {
+        translateBlock(worklist[next]);
+    }
+
+    emit("\nstatic const uint8_t image[%u] = {", romSize);
+    for (uint32_t b = 0; b < romSize; b++) {
+        emit("%s0x%02X,", b % 16 ? " " : "\n    ", rom[PROGRAM_OFFSET + b]);
+    }
+    emit("\n};\n\nstatic const ChipNativeBlock blocks[%u] = {\n", blockCount);
+    for (uint32_t b = 0; b < blockCount; b++) {
+        emit("    { 0x%04X, %u, %u, block_%04X },\n", blocks[b].address, blocks[b].words, blocks[b].count,
+             blocks[b].address);
+    }
+    emit("};\n\nconst ChipNativeModule chip8NativeModule = {\n"
+         "    CHIP_NATIVE_ABI, sizeof(ChipCPU), %u, %u, image, %u, blocks\n};\n",
+         quirks, romSize, blockCount);
+
+    bool ok = !ferror(out);
+    fclose(out);
+    return ok;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: chip8_aot [options] <rom> <output.so>\n"
+            "  --quirks=modern|vip|chip48|schip\n"
+            "                    profile to compile for, the module only runs on CPUs\n"
+            "                    using it (default modern)\n"
+            "  --emit-c=FILE     keep the generated C in FILE\n"
+            "  --cc=COMPILER     C compiler to build the module with (default %s)\n",
+            CHIP8_AOT_CC);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *romPath = NULL;
+    const char *outPath = NULL;
+    const char *sourcePath = NULL;
+    const char *compiler = CHIP8_AOT_CC;
+    char tempPath[] = "/tmp/chip8_aotXXXXXX.c";
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--quirks=", 9) == 0 && cpuParseQuirks(arg + 9) >= 0) {
+            quirks = (ChipQuirks)cpuParseQuirks(arg + 9);
+        } else if (strncmp(arg, "--emit-c=", 9) == 0) {
+            sourcePath = arg + 9;
+        } else if (strncmp(arg, "--cc=", 5) == 0) {
+            compiler = arg + 5;
+        } else if (arg[0] == '-') {
+            usage();
+            return 1;
+        } else if (!romPath) {
+            romPath = arg;
+        } else if (!outPath) {
+            outPath = arg;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (!romPath || !outPath) {
+        usage();
+        return 1;
+    }
+    if (!readRom(romPath)) {
+        return 1;
+    }
+
+    if (!sourcePath) {
+        int fd = mkstemps(tempPath, 2);
+        if (fd < 0) {
+            fprintf(stderr, "Error: Could not create a temporary file\n");
+            return 1;
+        }
+        close(fd);
+        sourcePath = tempPath;
+    }
+    if (!writeSource(sourcePath)) {
+        return 1;
+    }
+
+    uint32_t instructions = 0;
+    for (uint32_t b = 0; b < blockCount; b++) {
+        instructions += blocks[b].count;
+    }
+    fprintf(stderr, "%u blocks, %u instructions translated\n", blockCount, instructions);
+
+    char command[4096];
+    snprintf(command, sizeof(command), "%s -std=gnu11 -O2 -fPIC -shared -I'%s' -o '%s' '%s'",
+             compiler, CHIP8_AOT_INCLUDE, outPath, sourcePath);
+    int status = system(command);
+    if (sourcePath == tempPath) {
+        unlink(tempPath);
+    }
+    if (status != 0) {
+        fprintf(stderr, "Error: Compiling %s failed\n", outPath);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,464 @@
+//
+// Headless batch runner: executes many independent ChipCPU instances across a
+// work-stealing thread pool and prints a hash of each instance's final state.
+//
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ChipCPU.h"
+#include "lockstep.h"
+#include "log.h"
+#include "native.h"
+#include "replay.h"
+#include "romcache.h"
+
+#define DEFAULT_FRAMES 600
+#define DEFAULT_CYCLES_PER_FRAME 11
+#define MAX_LINE 4096
+
+typedef struct BatchRom {
+    const char *path;
+    const RomImage *image;  // Shared by every path with the same contents
+    int quirks;             // ChipQuirks from the ROM list, -1 = the --quirks default
+} BatchRom;
+
+typedef struct BatchJob {
+    uint32_t rom;
+    uint32_t instance;  // First instance of the job
+    uint32_t count;     // Instances run together, more than one only with --lockstep
+} BatchJob;
+
+typedef struct BatchConfig {
+    uint32_t frames;
+    uint32_t cyclesPerFrame;
+    uint64_t cycles;  // Fixed instruction budget, overrides frames when non-zero
+    uint64_t seed;    // Instance i is seeded with seed + i
+    ChipEngine engine;
+    ChipQuirks quirks;  // Profile of ROMs the list gives none for
+    Recording *replay;  // Input recording fed to every instance, overrides frames/ipf
+    bool lockstep;      // Run up to LOCKSTEP_LANES instances of a ROM per job in lockstep
+    const ChipNative *native;  // Compiled blocks, runs the native engine instead of engine
+} BatchConfig;
+
+/**
+ * Per-worker range of job indices packed into one atomic word (begin in the low
+ * 32 bits, end in the high 32 bits). The owner takes jobs from the front, thieves
+ * split off the back half, and both sides update the range with a single CAS.
+ */
+typedef struct WorkQueue {
+    _Atomic uint64_t range;
+    char padding[64 - sizeof(uint64_t)];  // Keep queues on separate cache lines
+} WorkQueue;
+
+typedef struct Worker {
+    pthread_t thread;
+    uint32_t index;
+    uint64_t instructions;
+} Worker;
+
+static RomCache romCache;
+static BatchRom *roms;
+static uint32_t romCount;
+static BatchJob *jobs;
+static uint32_t jobCount;
+static uint64_t *results;  // One per instance, rom * instanceCount + instance
+static uint32_t instanceCount;
+static WorkQueue *queues;
+static Worker *workers;
+static uint32_t workerCount;
+static BatchConfig config;
+
+static uint64_t pack_range(uint32_t begin, uint32_t end)
+{
+    return ((uint64_t)end << 32) | begin;
+}
+
+static bool pop_own(WorkQueue *queue, uint32_t *job)
+{
+    uint64_t range = atomic_load(&queue->range);
+    for (;;) {
+        uint32_t begin = (uint32_t)range;
+        uint32_t end = (uint32_t)(range >> 32);
+        if (begin >= end) {
+            return false;
+        }
+        if (atomic_compare_exchange_weak(&queue->range, &range, pack_range(begin + 1, end))) {
+            *job = begin;
+            return true;
+        }
+    }
+}
+
+/**
+ * Move the back half of a victim's remaining jobs into our (empty) queue and
+ * return the first of them.
+ */
+static bool steal(WorkQueue *victim, WorkQueue *self, uint32_t *job)
+{
+    uint64_t range = atomic_load(&victim->range);
+    for (;;) {
+        uint32_t begin = (uint32_t)range;
+        uint32_t end = (uint32_t)(range >> 32);
+        if (begin >= end) {
+            return false;
+        }
+        uint32_t split = end - (end - begin + 1) / 2;
+        if (atomic_compare_exchange_weak(&victim->range, &range, pack_range(begin, split))) {
+            *job = split;
+            atomic_store(&self->range, pack_range(split + 1, end));
+            return true;
+        }
+    }
+}
+
+static bool next_job(Worker *worker, uint32_t *job)
+{
+    WorkQueue *own = &queues[worker->index];
+    if (pop_own(own, job)) {
+        return true;
+    }
+    for (uint32_t i = 1; i < workerCount; i++) {
+        if (steal(&queues[(worker->index + i) % workerCount], own, job)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void start_instance(ChipCPU *cpu, uint32_t rom, uint32_t instance)
+{
+    if (!romCacheInstantiate(roms[rom].image, cpu, config.seed + instance)) {
+        // Only XO-CHIP ROMs allocate, and results can't have holes
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    if (config.native) {
+        cpuSetNative(cpu, config.native);
+    } else {
+        cpuSetEngine(cpu, config.engine);
+    }
+    cpuSetQuirks(cpu, roms[rom].quirks >= 0 ? (ChipQuirks)roms[rom].quirks : config.quirks);
+}
+
+static uint64_t run_instance(ChipCPU *cpu, const BatchJob *job)
+{
+    uint64_t executed = 0;
+
+    start_instance(cpu, job->rom, job->instance);
+
+    if (config.replay) {
+        return replayRun(config.replay, cpu);
+    }
+    if (config.cycles > 0) {
+        for (uint64_t left = config.cycles; left > 0;) {
+            uint32_t chunk = left > UINT32_MAX ? UINT32_MAX : (uint32_t)left;
+            executed += cpuStep(cpu, chunk);
+            left -= chunk;
+        }
+        return executed;
+    }
+    for (uint32_t frame = 0; frame < config.frames; frame++) {
+        executed += cpuRunFrame(cpu, config.cyclesPerFrame);
+    }
+    return executed;
+}
+
+/**
+ * Same as run_instance on each instance of the job, with the instances stepped
+ * together in one lockstep group
+ */
+static uint64_t run_group(ChipCPU *const *cpus, LockstepGroup *group, const BatchJob *job)
+{
+    uint64_t executed = 0;
+
+    for (uint32_t i = 0; i < job->count; i++) {
+        start_instance(cpus[i], job->rom, job->instance + i);
+        if (config.replay) {
+            // The group decides which lanes it can run from the profile at load time
+            cpuSetQuirks(cpus[i], (ChipQuirks)config.replay->quirks);
+        }
+    }
+    lockstepLoad(group, cpus, job->count);
+
+    if (config.replay) {
+        executed = replayRunLockstep(config.replay, group);
+    } else if (config.cycles > 0) {
+        for (uint64_t left = config.cycles; left > 0;) {
+            uint32_t chunk = left > UINT32_MAX ? UINT32_MAX : (uint32_t)left;
+            executed += lockstepStep(group, chunk);
+            left -= chunk;
+        }
+    } else {
+        for (uint32_t frame = 0; frame < config.frames; frame++) {
+            executed += lockstepRunFrame(group, config.cyclesPerFrame);
+        }
+    }
+    lockstepStore(group);
+    return executed;
+}
+
+static void *worker_main(void *arg)
+{
+    Worker *worker = arg;
+    uint32_t lanes = config.lockstep ? LOCKSTEP_LANES : 1;
+    ChipCPU *cpus[LOCKSTEP_LANES] = { NULL };
+    LockstepGroup *group = config.lockstep ? lockstepCreate() : NULL;
+    uint32_t job;
+
+    bool ready = !config.lockstep || group;
+    for (uint32_t i = 0; i < lanes; i++) {
+        cpus[i] = calloc(1, sizeof(ChipCPU));
+        ready = ready && cpus[i];
+    }
+    if (!ready) {
+        fprintf(stderr, "Error: Out of memory\n");
+    }
+    while (ready && next_job(worker, &job)) {
+        const BatchJob *batchJob = &jobs[job];
+        if (config.lockstep) {
+            worker->instructions += run_group(cpus, group, batchJob);
+        } else {
+            worker->instructions += run_instance(cpus[0], batchJob);
+        }
+        for (uint32_t i = 0; i < batchJob->count; i++) {
+            results[batchJob->rom * instanceCount + batchJob->instance + i] = cpuStateHash(cpus[i]);
+        }
+    }
+    for (uint32_t i = 0; i < lanes; i++) {
+        if (cpus[i]) {
+            cpuFree(cpus[i]);
+        }
+        free(cpus[i]);
+    }
+    lockstepDestroy(group);
+    return NULL;
+}
+
+static bool add_rom(const char *path, int quirks)
+{
+    const RomImage *image = romCacheOpen(&romCache, path);
+    if (!image) {
+        return false;
+    }
+    roms = realloc(roms, sizeof(BatchRom) * (romCount + 1));
+    roms[romCount].path = strdup(path);
+    roms[romCount].image = image;
+    roms[romCount].quirks = quirks;
+    romCount++;
+    return true;
+}
+
+static bool add_rom_list(const char *listFile)
+{
+    FILE *list = fopen(listFile, "r");
+    if (!list) {
+        fprintf(stderr, "Error: Could not open ROM list: %s\n", listFile);
+        return false;
+    }
+
+    char line[MAX_LINE];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), list)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        // An optional quirks profile follows the path after a tab
+        int quirks = -1;
+        char *tab = strchr(line, '\t');
+        if (tab) {
+            *tab = '\0';
+            quirks = cpuParseQuirks(tab + 1);
+            if (quirks < 0) {
+                fprintf(stderr, "Error: Unknown quirks profile for %s: %s\n", line, tab + 1);
+                ok = false;
+                continue;
+            }
+        }
+        ok = add_rom(line, quirks);
+    }
+    fclose(list);
+    return ok;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: chip8_batch [options] <rom>...\n"
+            "  --list=FILE       read ROM paths from FILE, one per line, optionally followed\n"
+            "                    by a tab and the ROM's quirks profile\n"
+            "  --instances=N     independent instances per ROM (default 1)\n"
+            "  --seed=N          RNG seed of instance 0, instance i uses N + i (default 0)\n"
+            "  --frames=N        60Hz frames to run per instance (default %d)\n"
+            "  --ipf=N           instructions per frame (default %d)\n"
+            "  --cycles=N        run exactly N instructions instead of frames\n"
+            "  --threads=N       worker threads (default: online CPUs)\n"
+            "  --out=FILE        write results to FILE instead of stdout\n"
+            "  --engine=interpreter|block\n"
+            "  --native=FILE     run blocks compiled by chip8_aot from FILE, the rest of the\n"
+            "                    code (and other ROMs) on the interpreter\n"
+            "  --lockstep        step up to %d instances of a ROM together in SIMD lanes;\n"
+            "                    the engine only applies to instances that leave lockstep\n"
+            "  --quirks=modern|vip|chip48|schip\n"
+            "                    opcode behaviour of ROMs without a profile (default modern)\n"
+            "  --log=LEVEL       trace, debug, info, warn, error or off (default info)\n"
+            "  --replay=FILE     feed a recorded input session to every instance; frames,\n"
+            "                    ipf, seed and quirks come from the recording\n",
+            DEFAULT_FRAMES, DEFAULT_CYCLES_PER_FRAME, LOCKSTEP_LANES);
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *outFile = NULL;
+    const char *replayFile = NULL;
+    const char *nativeFile = NULL;
+    bool seedGiven = false;
+    static Recording recording;
+
+    romCacheInit(&romCache);
+    instanceCount = 1;
+    config.frames = DEFAULT_FRAMES;
+    config.cyclesPerFrame = DEFAULT_CYCLES_PER_FRAME;
+    config.engine = CHIP_ENGINE_INTERPRETER;
+    config.quirks = CHIP_QUIRKS_MODERN;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--list=", 7) == 0) {
+            if (!add_rom_list(arg + 7)) return 1;
+        } else if (strncmp(arg, "--instances=", 12) == 0) {
+            instanceCount = (uint32_t)strtoul(arg + 12, NULL, 10);
+        } else if (strncmp(arg, "--seed=", 7) == 0) {
+            config.seed = strtoull(arg + 7, NULL, 10);
+            seedGiven = true;
+        } else if (strncmp(arg, "--frames=", 9) == 0) {
+            config.frames = (uint32_t)strtoul(arg + 9, NULL, 10);
+        } else if (strncmp(arg, "--ipf=", 6) == 0) {
+            config.cyclesPerFrame = (uint32_t)strtoul(arg + 6, NULL, 10);
+        } else if (strncmp(arg, "--cycles=", 9) == 0) {
+            config.cycles = strtoull(arg + 9, NULL, 10);
+        } else if (strncmp(arg, "--threads=", 10) == 0) {
+            threads = strtol(arg + 10, NULL, 10);
+        } else if (strncmp(arg, "--replay=", 9) == 0) {
+            replayFile = arg + 9;
+        } else if (strncmp(arg, "--out=", 6) == 0) {
+            outFile = arg + 6;
+        } else if (strcmp(arg, "--engine=block") == 0) {
+            config.engine = CHIP_ENGINE_BLOCK;
+        } else if (strcmp(arg, "--engine=interpreter") == 0) {
+            config.engine = CHIP_ENGINE_INTERPRETER;
+        } else if (strncmp(arg, "--native=", 9) == 0) {
+            nativeFile = arg + 9;
+        } else if (strcmp(arg, "--lockstep") == 0) {
+            config.lockstep = true;
+        } else if (strncmp(arg, "--quirks=", 9) == 0 && cpuParseQuirks(arg + 9) >= 0) {
+            config.quirks = (ChipQuirks)cpuParseQuirks(arg + 9);
+        } else if (strncmp(arg, "--log=", 6) == 0 && logParseLevel(arg + 6) >= 0) {
+            logSetLevel(logParseLevel(arg + 6));
+        } else if (arg[0] == '-') {
+            usage();
+            return 1;
+        } else if (!add_rom(arg, -1)) {
+            return 1;
+        }
+    }
+
+    if (romCount == 0 || instanceCount == 0) {
+        usage();
+        return 1;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (nativeFile && !(config.native = nativeLoad(nativeFile))) {
+        return 1;
+    }
+    if (replayFile) {
+        if (!recordingLoad(&recording, replayFile)) {
+            return 1;
+        }
+        for (uint32_t rom = 0; rom < romCount; rom++) {
+            if (roms[rom].image->hash != recording.romHash) {
+                fprintf(stderr, "Warning: %s does not match the ROM the session was recorded with\n",
+                        roms[rom].path);
+            }
+        }
+        if (!seedGiven) {
+            config.seed = recording.seed;
+        }
+        config.replay = &recording;
+    }
+
+    uint32_t perJob = config.lockstep ? LOCKSTEP_LANES : 1;
+    uint32_t jobsPerRom = (instanceCount + perJob - 1) / perJob;
+    jobCount = romCount * jobsPerRom;
+    jobs = malloc(sizeof(BatchJob) * jobCount);
+    results = calloc((size_t)romCount * instanceCount, sizeof(uint64_t));
+    workerCount = (uint32_t)threads;
+    queues = aligned_alloc(64, sizeof(WorkQueue) * workerCount);
+    workers = calloc(workerCount, sizeof(Worker));
+    if (!jobs || !results || !queues || !workers) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 1;
+    }
+
+    for (uint32_t rom = 0; rom < romCount; rom++) {
+        for (uint32_t job = 0; job < jobsPerRom; job++) {
+            uint32_t instance = job * perJob;
+            uint32_t count = instanceCount - instance < perJob ? instanceCount - instance : perJob;
+            jobs[rom * jobsPerRom + job] = (BatchJob){ rom, instance, count };
+        }
+    }
+
+    // Deal out contiguous slices, stealing evens out whatever imbalance is left
+    for (uint32_t w = 0; w < workerCount; w++) {
+        uint32_t begin = (uint32_t)((uint64_t)jobCount * w / workerCount);
+        uint32_t end = (uint32_t)((uint64_t)jobCount * (w + 1) / workerCount);
+        atomic_init(&queues[w].range, pack_range(begin, end));
+    }
+
+    double start = now_seconds();
+    for (uint32_t w = 0; w < workerCount; w++) {
+        workers[w].index = w;
+        pthread_create(&workers[w].thread, NULL, worker_main, &workers[w]);
+    }
+
+    uint64_t instructions = 0;
+    for (uint32_t w = 0; w < workerCount; w++) {
+        pthread_join(workers[w].thread, NULL);
+        instructions += workers[w].instructions;
+    }
+    double elapsed = now_seconds() - start;
+
+    FILE *out = outFile ? fopen(outFile, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Error: Could not open output file: %s\n", outFile);
+        return 1;
+    }
+    for (uint32_t rom = 0; rom < romCount; rom++) {
+        for (uint32_t instance = 0; instance < instanceCount; instance++) {
+            fprintf(out, "%s\t%u\t%016llx\n", roms[rom].path, instance,
+                    (unsigned long long)results[rom * instanceCount + instance]);
+        }
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+    fprintf(stderr, "%u instances, %u threads, %llu instructions in %.3fs (%.1fM instr/s)\n",
+            romCount * instanceCount, workerCount, (unsigned long long)instructions, elapsed,
+            elapsed > 0 ? (double)instructions / elapsed / 1e6 : 0.0);
+    return 0;
+}
@@ -0,0 +1,443 @@
+//
+// Core benchmarks: per-opcode-class cost, sustained throughput, display filters and
+// (when built with SDL) renderer cost. Results are printed as JSON so they can be tracked over time.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ChipCPU.h"
+#include "filters.h"
+#include "lockstep.h"
+#include "log.h"
+#include "native.h"
+#ifdef CHIP8_BENCH_RENDER
+#include <SDL.h>
+#include "renderer.h"
+#endif
+
+#define DEFAULT_INSTRUCTIONS 10000000ULL
+#define REPEATS 3
+#define ROM_PATH_DEFAULT "resources/breakout.ch8"
+#define FILTER_FRAMES 200
+// Breakout is lost after about 320 frames of the scripted keys, and then halts
+#define ROM_RESTART_FRAMES 300
+
+typedef struct BenchProgram {
+    const char *name;
+    const uint16_t *code;
+    size_t length;
+} BenchProgram;
+
+// Each program loops forever through a final jump back to 0x200
+
+static const uint16_t aluProgram[] = {
+    0x6001, 0x6102, 0x6203, 0x8014, 0x8125, 0x8016, 0x8117, 0x810E,
+    0x8203, 0x8231, 0x8312, 0x8020, 0x7105, 0x8234, 0x8045, 0x1200,
+};
+
+// V0 = V1 = 0, none of these skip except the 5010 which hops over a 6000
+static const uint16_t skipProgram[] = {
+    0x6000, 0x6100, 0x3001, 0x4000, 0x9010, 0x3101, 0x4100, 0x5010,
+    0x6000, 0x3002, 0x4000, 0x9100, 0x1204,
+};
+
+static const uint16_t drawProgram[] = {
+    0x6000, 0x610A, 0x620F, 0xA050, 0xD015, 0xD125, 0xD235, 0x7003,
+    0x7105, 0xA055, 0xD015, 0xD12F, 0x1208,
+};
+
+static const uint16_t loadStoreProgram[] = {
+    0x6001, 0x6702, 0xA400, 0xF755, 0xA400, 0xF765, 0xA410, 0xFF55,
+    0xA410, 0xFF65, 0x1204,
+};
+
+static const uint16_t bcdProgram[] = {
+    0x60FF, 0x617B, 0xA400, 0xF033, 0xA403, 0xF133, 0xA406, 0xF033,
+    0x7001, 0x1204,
+};
+
+static const uint16_t mixedProgram[] = {
+    0x6001, 0x6102, 0xA050, 0x8014, 0x3001, 0xD015, 0x8125, 0xA400,
+    0xF133, 0xF265, 0x4100, 0x7103, 0xC0FF, 0x1206,
+};
+
+// SUPER-CHIP hires: 16x16 and 8x10 big-font sprites across the 128-pixel rows
+static const uint16_t hiresDrawProgram[] = {
+    0x00FF, 0x6000, 0x610A, 0xA0A0, 0xD010, 0xD12A, 0x7003, 0x7105,
+    0xD010, 0x1202,
+};
+
+static const uint16_t scrollProgram[] = {
+    0x00FF, 0xA0A0, 0xD01A, 0x00C1, 0x00FB, 0x00D1, 0x00FC, 0x1202,
+};
+
+static const BenchProgram programs[] = {
+    { "alu_8xyn",        aluProgram,       sizeof(aluProgram) / sizeof(uint16_t) },
+    { "skips",           skipProgram,      sizeof(skipProgram) / sizeof(uint16_t) },
+    { "draw_dxyn",       drawProgram,      sizeof(drawProgram) / sizeof(uint16_t) },
+    { "load_store_fx55", loadStoreProgram, sizeof(loadStoreProgram) / sizeof(uint16_t) },
+    { "bcd_fx33",        bcdProgram,       sizeof(bcdProgram) / sizeof(uint16_t) },
+    { "mixed",           mixedProgram,     sizeof(mixedProgram) / sizeof(uint16_t) },
+    { "draw_hires_dxy0", hiresDrawProgram, sizeof(hiresDrawProgram) / sizeof(uint16_t) },
+    { "scroll_hires",    scrollProgram,    sizeof(scrollProgram) / sizeof(uint16_t) },
+};
+
+typedef enum BenchEngine {
+    BENCH_DECODE,       // cpuFetch + decodeOperation, no decode cache
+    BENCH_INTERPRETER,  // CHIP_ENGINE_INTERPRETER
+    BENCH_BLOCK,        // CHIP_ENGINE_BLOCK
+    BENCH_ENGINE_COUNT,
+    BENCH_NATIVE = BENCH_ENGINE_COUNT,  // CHIP_ENGINE_NATIVE, only the ROM and only with --native
+} BenchEngine;
+
+static const char *engineNames[BENCH_ENGINE_COUNT + 1] = { "decode", "interpreter", "block", "native" };
+
+static int resultCount;
+static ChipCPU *boot;
+// Lanes of the lockstep benchmarks, each seeded differently
+static ChipCPU *lanes[LOCKSTEP_LANES];
+static LockstepGroup *group;
+// chip8_aot module for the ROM benchmark's native engine
+static ChipNative *native;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * Print one result. The rate is in millions of instructions per second for
+ * instructions and plain operations per second for anything else, e.g. frames_per_s.
+ */
+static void emit(const char *name, const char *engine, uint64_t operations, const char *unit, double seconds)
+{
+    printf("%s\n    {\"name\": \"%s\", \"engine\": \"%s\", \"%s\": %llu, \"seconds\": %.6f, \"ns_per_op\": %.3f, ",
+           resultCount++ ? "," : "", name, engine, unit, (unsigned long long)operations, seconds,
+           seconds * 1e9 / (double)operations);
+    if (strcmp(unit, "instructions") == 0) {
+        printf("\"mops_per_s\": %.3f}", (double)operations / seconds / 1e6);
+    } else {
+        printf("\"%s_per_s\": %.1f}", unit, (double)operations / seconds);
+    }
+}
+
+static void load_program(ChipCPU *cpu, const BenchProgram *program)
+{
+    uint8_t image[64];
+    for (size_t i = 0; i < program->length; i++) {
+        image[i * 2] = program->code[i] >> 8;
+        image[i * 2 + 1] = program->code[i] & 0xFF;
+    }
+    cpuCopy(cpu, boot);
+    cpuLoadProgram(cpu, image, program->length * 2);
+}
+
+/**
+ * @return Number of instructions actually executed, idle loops are fast-forwarded
+ * on every engine but the decoder
+ */
+static uint64_t run_engine(ChipCPU *cpu, BenchEngine engine, uint64_t instructions)
+{
+    if (engine == BENCH_DECODE) {
+        for (uint64_t i = 0; i < instructions; i++) {
+            uint16_t opcode = cpuFetch(cpu);
+            cpu->PC += 2;
+            decodeOperation(opcode, cpu);
+        }
+        return instructions;
+    }
+    cpuSetEngine(cpu, engine == BENCH_BLOCK ? CHIP_ENGINE_BLOCK : CHIP_ENGINE_INTERPRETER);
+    return cpuStep(cpu, (uint32_t)instructions);
+}
+
+/**
+ * Best of REPEATS runs of the same program, the minimum filters out scheduler noise
+ */
+static void bench_program(ChipCPU *cpu, const BenchProgram *program, BenchEngine engine, uint64_t instructions)
+{
+    double best = 0;
+    uint64_t executed = 0;
+    for (int repeat = 0; repeat < REPEATS; repeat++) {
+        load_program(cpu, program);
+        double start = now_seconds();
+        executed = run_engine(cpu, engine, instructions);
+        double elapsed = now_seconds() - start;
+        if (repeat == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    emit(program->name, engineNames[engine], executed, "instructions", best);
+}
+
+/**
+ * The same program on LOCKSTEP_LANES instances stepped together, the instruction
+ * count is split between the lanes so totals compare directly with the other engines
+ */
+static void bench_program_lockstep(const BenchProgram *program, uint64_t instructions)
+{
+    uint32_t perLane = (uint32_t)(instructions / LOCKSTEP_LANES);
+    double best = 0;
+    uint64_t executed = 0;
+    for (int repeat = 0; repeat < REPEATS; repeat++) {
+        for (uint32_t lane = 0; lane < LOCKSTEP_LANES; lane++) {
+            load_program(lanes[lane], program);
+            cpuSeed(lanes[lane], lane);
+        }
+        double start = now_seconds();
+        lockstepLoad(group, lanes, LOCKSTEP_LANES);
+        executed = lockstepStep(group, perLane);
+        lockstepStore(group);
+        double elapsed = now_seconds() - start;
+        if (repeat == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    emit(program->name, "lockstep", executed, "instructions", best);
+}
+
+static bool read_rom(const char *path, uint8_t *data, size_t *size)
+{
+    FILE *rom = fopen(path, "rb");
+    if (!rom) {
+        return false;
+    }
+    *size = fread(data, 1, MEMORY_SIZE - PROGRAM_OFFSET, rom);
+    fclose(rom);
+    return *size > 0;
+}
+
+/**
+ * Put a fresh copy of the ROM on cpu, on the engine being measured
+ */
+static void start_rom(ChipCPU *cpu, const uint8_t *data, size_t size, BenchEngine engine)
+{
+    cpuCopy(cpu, boot);
+    cpuLoadProgram(cpu, data, size);
+    if (engine == BENCH_BLOCK) {
+        cpuSetEngine(cpu, CHIP_ENGINE_BLOCK);
+    } else if (engine == BENCH_NATIVE) {
+        cpuSetNative(cpu, native);
+    }
+}
+
+/**
+ * Sustained throughput on a real ROM: frames at a high instruction rate with a
+ * scripted key pattern so the game actually moves. Breakout waits on the delay
+ * timer for most of each frame and halts once the game is lost, both of which the
+ * engines fast-forward, so the game is restarted every ROM_RESTART_FRAMES and frames
+ * run until the instructions actually executed reach the target.
+ */
+static void bench_rom(ChipCPU *cpu, const char *path, BenchEngine engine, uint64_t instructions)
+{
+    uint8_t data[MEMORY_SIZE];
+    size_t size;
+    const uint32_t cyclesPerFrame = 1000;
+
+    if (!read_rom(path, data, &size)) {
+        fprintf(stderr, "Skipping ROM benchmark, could not read %s\n", path);
+        return;
+    }
+
+    uint64_t executed = 0;
+    double start = now_seconds();
+    // A ROM that stops executing altogether ends the run after one frame per instruction
+    for (uint64_t frame = 0; executed < instructions && frame < instructions; frame++) {
+        if (frame % ROM_RESTART_FRAMES == 0) {
+            start_rom(cpu, data, size, engine);
+        }
+        cpuSetKeyMask(cpu, (uint16_t)(((frame / 40) % 2) ? 1u << 4 : 1u << 6));
+        if (engine == BENCH_DECODE) {
+            executed += run_engine(cpu, BENCH_DECODE, cyclesPerFrame);
+            cpuTickTimers(cpu);
+        } else {
+            executed += cpuRunFrame(cpu, cyclesPerFrame);
+        }
+    }
+    emit("rom_breakout", engineNames[engine], executed, "instructions", now_seconds() - start);
+}
+
+/**
+ * bench_rom on LOCKSTEP_LANES instances in lockstep, the instructions are counted
+ * over all lanes like bench_program_lockstep. Each lane starts its key pattern a few
+ * frames later than the one before, so the lanes do drift apart.
+ */
+static void bench_rom_lockstep(const char *path, uint64_t instructions)
+{
+    uint8_t data[MEMORY_SIZE];
+    size_t size;
+    const uint32_t cyclesPerFrame = 1000;
+
+    if (!read_rom(path, data, &size)) {
+        return;
+    }
+
+    uint64_t executed = 0;
+    double start = now_seconds();
+    for (uint64_t frame = 0; executed < instructions && frame < instructions; frame++) {
+        if (frame % ROM_RESTART_FRAMES == 0) {
+            if (frame > 0) {
+                lockstepStore(group);
+            }
+            for (uint32_t lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                start_rom(lanes[lane], data, size, BENCH_INTERPRETER);
+                cpuSeed(lanes[lane], lane);
+            }
+            lockstepLoad(group, lanes, LOCKSTEP_LANES);
+        }
+        for (uint32_t lane = 0; lane < LOCKSTEP_LANES; lane++) {
+            uint64_t shifted = frame + lane * 3;
+            lockstepSetKeyMask(group, lane, (uint16_t)(((shifted / 40) % 2) ? 1u << 4 : 1u << 6));
+        }
+        executed += lockstepRunFrame(group, cyclesPerFrame);
+    }
+    lockstepStore(group);
+    emit("rom_breakout", "lockstep", executed, "instructions", now_seconds() - start);
+}
+
+// Filter chains taking a 128x64 frame to 1920x960
+static const char *const filterChains[] = {
+    "nearest:15",
+    "scale3x,nearest:5",
+    "phosphor:8,scale3x,nearest:5,scanlines",
+};
+
+/**
+ * Cost of post-processing a hires frame for a 1080p screen, with every kernel build
+ * the host can run
+ */
+static void bench_filters(ChipCPU *cpu, uint32_t frames)
+{
+    static uint32_t pixels[DISPLAY_HIRES_HEIGHT][DISPLAY_HIRES_WIDTH];
+    FilterImage frame = { &pixels[0][0], DISPLAY_HIRES_WIDTH, DISPLAY_HIRES_HEIGHT, DISPLAY_HIRES_WIDTH };
+    FilterChain chain;
+    char name[96];
+
+    // Whatever the hires draw loop (draw_hires_dxy0) leaves on screen
+    load_program(cpu, &programs[6]);
+    cpuStep(cpu, 100000);
+    for (int y = 0; y < DISPLAY_HIRES_HEIGHT; y++) {
+        for (int x = 0; x < DISPLAY_HIRES_WIDTH; x++) {
+            pixels[y][x] = cpuPalette[cpuGetPixel(cpu, x, y)];
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(filterChains) / sizeof(filterChains[0]); i++) {
+        filterChainParse(&chain, filterChains[i]);
+        int scale = filterChainScale(&chain);
+        FilterImage screen = { NULL, DISPLAY_HIRES_WIDTH * scale, DISPLAY_HIRES_HEIGHT * scale,
+                               DISPLAY_HIRES_WIDTH * scale };
+        screen.pixels = malloc((size_t)screen.width * screen.height * sizeof(uint32_t));
+        snprintf(name, sizeof(name), "filter_%s", filterChains[i]);
+
+        for (int isa = 0; isa <= (int)filterBestIsa() && screen.pixels; isa++) {
+            chain.isa = (FilterIsa)isa;
+            filterChainApply(&chain, &frame, &screen);  // Allocates the chain's buffers
+            double start = now_seconds();
+            for (uint32_t f = 0; f < frames; f++) {
+                pixels[f % DISPLAY_HIRES_HEIGHT][0] ^= 0x00FFFFFF;
+                filterChainApply(&chain, &frame, &screen);
+            }
+            emit(name, filterIsaName((FilterIsa)isa), frames, "frames", now_seconds() - start);
+        }
+        free(screen.pixels);
+        filterChainFree(&chain);
+    }
+}
+
+#ifdef CHIP8_BENCH_RENDER
+/**
+ * Cost of pushing a changed framebuffer through rndr_update_screen on SDL's dummy
+ * (offscreen) video driver
+ */
+static void bench_render(ChipCPU *cpu, uint32_t calls)
+{
+    setenv("SDL_VIDEODRIVER", "dummy", 0);
+    setenv("SDL_AUDIODRIVER", "dummy", 0);
+    rndr_initialize_graphics();
+
+    cpuCopy(cpu, boot);
+    double start = now_seconds();
+    for (uint32_t i = 0; i < calls; i++) {
+        cpu->display.planes[0][i % DISPLAY_HEIGHT][0] ^= 0x5555555555555555ULL;
+        rndr_update_screen(&cpu->display, false);
+    }
+    emit("render_update_screen", "sdl_dummy", calls, "calls", now_seconds() - start);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    uint64_t instructions = DEFAULT_INSTRUCTIONS;
+    const char *romPath = ROM_PATH_DEFAULT;
+    const char *nativePath = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--instructions=", 15) == 0) {
+            instructions = strtoull(argv[i] + 15, NULL, 10);
+        } else if (strncmp(argv[i], "--rom=", 6) == 0) {
+            romPath = argv[i] + 6;
+        } else if (strncmp(argv[i], "--native=", 9) == 0) {
+            nativePath = argv[i] + 9;
+        } else {
+            fprintf(stderr, "Usage: chip8_bench [--instructions=N] [--rom=FILE] [--native=FILE.so]\n");
+            return 1;
+        }
+    }
+    if (instructions == 0 || instructions > UINT32_MAX) {
+        instructions = DEFAULT_INSTRUCTIONS;
+    }
+
+    // Unsupported opcodes in the ROM case would otherwise be reported while timing
+    logSetLevel(LOG_LEVEL_ERROR);
+
+    boot = calloc(1, sizeof(ChipCPU));
+    ChipCPU *cpu = calloc(1, sizeof(ChipCPU));
+    group = lockstepCreate();
+    bool ready = boot && cpu && group;
+    for (uint32_t lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        lanes[lane] = calloc(1, sizeof(ChipCPU));
+        ready = ready && lanes[lane];
+    }
+    if (!ready) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 1;
+    }
+    if (nativePath && !(native = nativeLoad(nativePath))) {
+        return 1;
+    }
+    cpuInit(boot, 1);
+
+    printf("{\n  \"sizeof_ChipCPU\": %zu,\n  \"results\": [", sizeof(ChipCPU));
+    for (size_t p = 0; p < sizeof(programs) / sizeof(programs[0]); p++) {
+        for (int engine = 0; engine < BENCH_ENGINE_COUNT; engine++) {
+            bench_program(cpu, &programs[p], (BenchEngine)engine, instructions);
+        }
+        bench_program_lockstep(&programs[p], instructions);
+    }
+    for (int engine = 0; engine < BENCH_ENGINE_COUNT; engine++) {
+        bench_rom(cpu, romPath, (BenchEngine)engine, instructions);
+    }
+    if (native) {
+        bench_rom(cpu, romPath, BENCH_NATIVE, instructions);
+    }
+    bench_rom_lockstep(romPath, instructions);
+    bench_filters(cpu, FILTER_FRAMES);
+#ifdef CHIP8_BENCH_RENDER
+    bench_render(cpu, 2000);
+#endif
+    printf("\n  ]\n}\n");
+
+    for (uint32_t lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        cpuFree(lanes[lane]);
+        free(lanes[lane]);
+    }
+    lockstepDestroy(group);
+    nativeFree(native);
+    cpuFree(cpu);
+    free(cpu);
+    free(boot);
+    return 0;
+}
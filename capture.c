@@ -0,0 +1,588 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "capture.h"
+#include "log.h"
+//
+// The sinks allocate everything they need when opened, nothing is allocated per
+// frame. Video frames are kept encoded and only the rows that changed are encoded
+// again, repeats are the same bytes written again.
+//
+
+// GIF: 16 colour global palette, so 4-bit LZW codes to start from
+#define GIF_MIN_CODE_SIZE 4
+#define GIF_CLEAR_CODE (1 << GIF_MIN_CODE_SIZE)
+#define GIF_END_CODE (GIF_CLEAR_CODE + 1)
+#define GIF_MAX_CODE 4095
+// Browsers stretch delays under 2 centiseconds to 10, so anything shorter is merged
+// into the image after it
+#define GIF_MIN_DELAY 2
+#define GIF_MAX_DELAY 65535
+#define GIF_QUEUE_LENGTH 8
+
+static const char *const formatNames[CAPTURE_FORMAT_COUNT] = {
+    [CAPTURE_FORMAT_RAW] = "raw",
+    [CAPTURE_FORMAT_Y4M] = "y4m",
+    [CAPTURE_FORMAT_GIF] = "gif",
+};
+
+// Spreads the 8 pixels of a display byte over the bytes of a word, leftmost pixel in
+// the lowest byte, so the planes of 8 pixels combine into palette indices with shifts
+static uint64_t planeSpread[256];
+
+static void initPlaneSpread(void)
+{
+    for (int byte = 0; byte < 256; byte++) {
+        uint64_t spread = 0;
+        for (int bit = 0; bit < 8; bit++) {
+            if (byte & (0x80 >> bit)) {
+                spread |= 1ULL << (bit * 8);
+            }
+        }
+        planeSpread[byte] = spread;
+    }
+}
+
+// Palette indices of display row y, width pixels of the current resolution
+static void convertRow(const ChipCPU *cpu, int y, int width, uint8_t *out)
+{
+    for (int x = 0; x < width; x += 8) {
+        uint64_t indices = 0;
+        for (int plane = 0; plane < DISPLAY_PLANES; plane++) {
+            uint64_t word = cpu->display.planes[plane][y][x >> 6];
+            indices |= planeSpread[(word >> (56 - (x & 63))) & 0xFF] << plane;
+        }
+        memcpy(&out[x], &indices, 8);
+    }
+}
+
+void captureInit(FrameCapture *capture, FrameSink *sink)
+{
+    memset(capture, 0, sizeof(*capture));
+    capture->sink = sink;
+    capture->ok = sink != NULL;
+    if (planeSpread[1] == 0) {
+        initPlaneSpread();
+    }
+}
+
+static void flushImage(FrameCapture *capture)
+{
+    if (capture->ok && !capture->sink->write(capture->sink, &capture->image, capture->firstRow,
+                                             capture->lastRow - capture->firstRow + 1, capture->frames)) {
+        LOG_ERROR("Frame capture failed after %llu frames", (unsigned long long)capture->captured);
+        capture->ok = false;
+    }
+    capture->images++;
+}
+
+/**
+ * Call once per 60Hz frame, after the CPU ran it. Clears cpu->dirtyRows.
+ *
+ * @return false once writing to the sink has failed
+ */
+bool captureFrame(FrameCapture *capture, ChipCPU *cpu)
+{
+    int height = cpuDisplayHeight(cpu);
+    int repeat = CAPTURE_HEIGHT / height;
+    uint64_t dirty = capture->frames ? cpu->dirtyRows : DISPLAY_ALL_ROWS;
+    uint64_t changed = 0;
+
+    cpu->dirtyRows = 0;
+    capture->captured++;
+    if (height < 64) {
+        dirty &= (1ULL << height) - 1;
+    }
+    for (; dirty; dirty &= dirty - 1) {
+        int y = __builtin_ctzll(dirty);
+        uint8_t *row = capture->next.pixels[y * repeat];
+        if (repeat == 1) {
+            convertRow(cpu, y, CAPTURE_WIDTH, row);
+        } else {
+            // Lores: double every pixel into the hires row, then the row itself
+            uint8_t lores[DISPLAY_WIDTH];
+            convertRow(cpu, y, DISPLAY_WIDTH, lores);
+            for (int x = 0; x < DISPLAY_WIDTH; x++) {
+                row[x * 2] = row[x * 2 + 1] = lores[x];
+            }
+            memcpy(capture->next.pixels[y * repeat + 1], row, CAPTURE_WIDTH);
+        }
+        for (int out = y * repeat; out < (y + 1) * repeat; out++) {
+            if (memcmp(capture->next.pixels[out], capture->image.pixels[out], CAPTURE_WIDTH) != 0) {
+                changed |= 1ULL << out;
+            }
+        }
+    }
+
+    if (capture->frames == 0) {
+        // The first image counts as changed everywhere
+        capture->firstRow = 0;
+        capture->lastRow = CAPTURE_HEIGHT - 1;
+    } else if (!changed) {
+        capture->frames++;
+        return capture->ok;
+    } else {
+        flushImage(capture);
+        capture->firstRow = __builtin_ctzll(changed);
+        capture->lastRow = 63 - __builtin_clzll(changed);
+    }
+    for (; changed; changed &= changed - 1) {
+        int out = __builtin_ctzll(changed);
+        memcpy(capture->image.pixels[out], capture->next.pixels[out], CAPTURE_WIDTH);
+    }
+    capture->frames = 1;
+    return capture->ok;
+}
+
+/**
+ * Hand over the last image and close the sink
+ *
+ * @return Whether everything was written
+ */
+bool captureFinish(FrameCapture *capture)
+{
+    if (capture->frames) {
+        flushImage(capture);
+    }
+    if (capture->sink && !capture->sink->close(capture->sink)) {
+        capture->ok = false;
+    }
+    capture->sink = NULL;
+    return capture->ok;
+}
+
+/**
+ * @return The CaptureFormat called name (raw, y4m, gif), -1 if there is none
+ */
+int captureParseFormat(const char *name)
+{
+    for (int format = 0; format < CAPTURE_FORMAT_COUNT; format++) {
+        if (strcmp(name, formatNames[format]) == 0) {
+            return format;
+        }
+    }
+    return -1;
+}
+
+const char *captureFormatName(CaptureFormat format)
+{
+    return format < CAPTURE_FORMAT_COUNT ? formatNames[format] : "unknown";
+}
+
+// ------- Raw RGB / Y4M ------- //
+
+typedef struct VideoSink {
+    FrameSink base;
+    FILE *out;
+    CaptureFormat format;
+    int scale;
+    bool dropRepeats;    // Write each image once instead of once per frame shown
+    size_t planeSize;    // Bytes per plane (Y4M) or of the whole RGB frame
+    uint8_t *frame;      // The current image, encoded
+    uint8_t colors[1 << DISPLAY_PLANES][3];  // RGB or YCbCr per palette index
+} VideoSink;
+
+static bool videoWrite(FrameSink *base, const CaptureImage *image, int firstRow, int rowCount, uint32_t frames)
+{
+    VideoSink *video = (VideoSink *)base;
+    int scale = video->scale;
+    size_t stride = (size_t)CAPTURE_WIDTH * scale;
+
+    for (int y = firstRow; y < firstRow + rowCount; y++) {
+        const uint8_t *row = image->pixels[y];
+        size_t top = (size_t)y * scale * stride;
+        if (video->format == CAPTURE_FORMAT_RAW) {
+            uint8_t *line = &video->frame[top * 3];
+            for (size_t x = 0; x < stride; x++) {
+                memcpy(&line[x * 3], video->colors[row[x / scale]], 3);
+            }
+            for (int copy = 1; copy < scale; copy++) {
+                memcpy(&line[copy * stride * 3], line, stride * 3);
+            }
+        } else {
+            for (int plane = 0; plane < 3; plane++) {
+                uint8_t *line = &video->frame[plane * video->planeSize + top];
+                for (size_t x = 0; x < stride; x++) {
+                    line[x] = video->colors[row[x / scale]][plane];
+                }
+                for (int copy = 1; copy < scale; copy++) {
+                    memcpy(&line[copy * stride], line, stride);
+                }
+            }
+        }
+    }
+
+    size_t frameSize = video->format == CAPTURE_FORMAT_RAW ? video->planeSize : video->planeSize * 3;
+    for (uint32_t i = 0; i < (video->dropRepeats ? 1 : frames); i++) {
+        if (video->format == CAPTURE_FORMAT_Y4M) {
+            fputs("FRAME\n", video->out);
+        }
+        if (fwrite(video->frame, 1, frameSize, video->out) != frameSize) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool videoClose(FrameSink *base)
+{
+    VideoSink *video = (VideoSink *)base;
+    bool ok = fflush(video->out) == 0 && !ferror(video->out);
+    free(video->frame);
+    free(video);
+    return ok;
+}
+
+/**
+ * Stream frames to out as raw RGB24 or Y4M, at 60 fps and CAPTURE_WIDTH x
+ * CAPTURE_HEIGHT times scale. The stream is written on the caller's thread.
+ *
+ * @param dropRepeats Write each distinct image once, the stream then no longer
+ *                    keeps time
+ */
+FrameSink *sinkOpenVideo(FILE *out, CaptureFormat format, int scale, bool dropRepeats)
+{
+    if (format != CAPTURE_FORMAT_RAW && format != CAPTURE_FORMAT_Y4M) {
+        return NULL;
+    }
+    if (scale < 1 || scale > CAPTURE_MAX_SCALE) {
+        return NULL;
+    }
+    VideoSink *video = calloc(1, sizeof(VideoSink));
+    if (!video) {
+        return NULL;
+    }
+    size_t pixels = (size_t)CAPTURE_WIDTH * CAPTURE_HEIGHT * scale * scale;
+    video->base.write = videoWrite;
+    video->base.close = videoClose;
+    video->out = out;
+    video->format = format;
+    video->scale = scale;
+    video->dropRepeats = dropRepeats;
+    video->planeSize = format == CAPTURE_FORMAT_RAW ? pixels * 3 : pixels;
+    video->frame = malloc(pixels * 3);  // RGB or the three Y4M planes
+    if (!video->frame) {
+        free(video);
+        return NULL;
+    }
+
+    for (int index = 0; index < 1 << DISPLAY_PLANES; index++) {
+        int r = (cpuPalette[index] >> 16) & 0xFF;
+        int g = (cpuPalette[index] >> 8) & 0xFF;
+        int b = cpuPalette[index] & 0xFF;
+        if (format == CAPTURE_FORMAT_RAW) {
+            video->colors[index][0] = (uint8_t)r;
+            video->colors[index][1] = (uint8_t)g;
+            video->colors[index][2] = (uint8_t)b;
+        } else {
+            // BT.601, studio range, what players assume for Y4M without a colour tag
+            video->colors[index][0] = (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+            video->colors[index][1] = (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+            video->colors[index][2] = (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        }
+    }
+    if (format == CAPTURE_FORMAT_Y4M) {
+        fprintf(out, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 C444\n", CAPTURE_WIDTH * scale, CAPTURE_HEIGHT * scale);
+    }
+    return &video->base;
+}
+
+// ------- Animated GIF ------- //
+
+typedef struct GifJob {
+    CaptureImage image;
+    int firstRow;
+    int rowCount;
+    uint16_t delay;  // Centiseconds
+} GifJob;
+
+/**
+ * The caller queues images, a background thread compresses and writes them. The
+ * slot after the queued ones can hold an image shown too briefly to write yet,
+ * the next image is merged into it.
+ */
+typedef struct GifSink {
+    FrameSink base;
+    FILE *out;
+    int scale;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t drained;
+    GifJob jobs[GIF_QUEUE_LENGTH];
+    uint32_t head;      // Next job to encode
+    uint32_t count;     // Jobs queued
+    bool held;          // jobs[head + count] holds an image not queued yet
+    bool closing;
+    bool failed;
+
+    // Caller only: time in 60Hz frames, all of it and as far as images were queued
+    uint64_t shownFrames;
+    uint64_t queuedFrames;
+
+    // Encoder thread only
+    uint32_t dictionary[1 << (12 + GIF_MIN_CODE_SIZE)];  // Prefix code and pixel -> code, tagged
+    uint32_t generation;                                 // Tag of the entries still valid
+    uint32_t bits;
+    int bitCount;
+    int blockSize;
+    uint8_t block[256];  // Length byte and up to 255 bytes of LZW data
+} GifSink;
+
+static void putLE16(uint8_t *out, unsigned value)
+{
+    out[0] = (uint8_t)(value & 0xFF);
+    out[1] = (uint8_t)(value >> 8);
+}
+
+static void gifFlushBlock(GifSink *gif)
+{
+    if (gif->blockSize) {
+        gif->block[0] = (uint8_t)gif->blockSize;
+        fwrite(gif->block, 1, gif->blockSize + 1, gif->out);
+        gif->blockSize = 0;
+    }
+}
+
+static void gifPutCode(GifSink *gif, uint32_t code, int width)
+{
+    gif->bits |= code << gif->bitCount;
+    gif->bitCount += width;
+    while (gif->bitCount >= 8) {
+        gif->block[1 + gif->blockSize++] = (uint8_t)gif->bits;
+        gif->bits >>= 8;
+        gif->bitCount -= 8;
+        if (gif->blockSize == 255) {
+            gifFlushBlock(gif);
+        }
+    }
+}
+
+// Forget every dictionary entry at once by moving on to a new tag
+static void gifResetDictionary(GifSink *gif)
+{
+    if (++gif->generation == 1u << (32 - 12)) {
+        memset(gif->dictionary, 0, sizeof(gif->dictionary));
+        gif->generation = 1;
+    }
+}
+
+/**
+ * Write one image as a frame covering the rows that changed, left in place for the
+ * next frame to draw over
+ */
+static bool gifEncode(GifSink *gif, const GifJob *job)
+{
+    int scale = gif->scale;
+    uint8_t header[19] = {
+        0x21, 0xF9, 0x04, 0x04, 0, 0, 0, 0,  // Graphic control: keep the image, delay
+        0x2C, 0, 0, 0, 0, 0, 0, 0, 0, 0,     // Image descriptor, no local palette
+        GIF_MIN_CODE_SIZE,
+    };
+    putLE16(&header[4], job->delay);
+    putLE16(&header[11], (unsigned)(job->firstRow * scale));
+    putLE16(&header[13], (unsigned)(CAPTURE_WIDTH * scale));
+    putLE16(&header[15], (unsigned)(job->rowCount * scale));
+    fwrite(header, 1, sizeof(header), gif->out);
+
+    int width = GIF_MIN_CODE_SIZE + 1;
+    uint32_t last = GIF_END_CODE;
+    int prefix = -1;
+
+    gifResetDictionary(gif);
+    gifPutCode(gif, GIF_CLEAR_CODE, width);
+    for (int y = job->firstRow * scale; y < (job->firstRow + job->rowCount) * scale; y++) {
+        const uint8_t *row = job->image.pixels[y / scale];
+        for (int x = 0; x < CAPTURE_WIDTH * scale; x++) {
+            int pixel = row[x / scale];
+            if (prefix < 0) {
+                prefix = pixel;
+                continue;
+            }
+            uint32_t key = (uint32_t)prefix << GIF_MIN_CODE_SIZE | (uint32_t)pixel;
+            uint32_t entry = gif->dictionary[key];
+            if (entry >> 12 == gif->generation) {
+                prefix = (int)(entry & 0xFFF);
+                continue;
+            }
+            gifPutCode(gif, (uint32_t)prefix, width);
+            gif->dictionary[key] = gif->generation << 12 | ++last;
+            if (last >= 1u << width) {
+                width++;
+            }
+            if (last == GIF_MAX_CODE) {
+                gifPutCode(gif, GIF_CLEAR_CODE, width);
+                gifResetDictionary(gif);
+                width = GIF_MIN_CODE_SIZE + 1;
+                last = GIF_END_CODE;
+            }
+            prefix = pixel;
+        }
+    }
+    gifPutCode(gif, (uint32_t)prefix, width);
+    gifPutCode(gif, GIF_END_CODE, width);
+    if (gif->bitCount) {
+        gifPutCode(gif, 0, 8 - gif->bitCount);
+    }
+    gifFlushBlock(gif);
+    fputc(0, gif->out);
+    return !ferror(gif->out);
+}
+
+static void *gifThread(void *arg)
+{
+    GifSink *gif = arg;
+
+    pthread_mutex_lock(&gif->lock);
+    for (;;) {
+        while (gif->count == 0 && !gif->closing) {
+            pthread_cond_wait(&gif->queued, &gif->lock);
+        }
+        if (gif->count == 0) {
+            break;
+        }
+        // The caller never touches queued jobs, they can be encoded unlocked
+        const GifJob *job = &gif->jobs[gif->head];
+        pthread_mutex_unlock(&gif->lock);
+        bool ok = gifEncode(gif, job);
+        pthread_mutex_lock(&gif->lock);
+
+        gif->head = (gif->head + 1) % GIF_QUEUE_LENGTH;
+        gif->count--;
+        gif->failed |= !ok;
+        pthread_cond_signal(&gif->drained);
+    }
+    pthread_mutex_unlock(&gif->lock);
+    return NULL;
+}
+
+// Rounded, so the delays of consecutive images add up to the real duration
+static uint64_t centiseconds(uint64_t frames)
+{
+    return (frames * 100 + 30) / 60;
+}
+
+// Caller holds the lock
+static void gifQueueHeld(GifSink *gif, uint64_t delay)
+{
+    GifJob *job = &gif->jobs[(gif->head + gif->count) % GIF_QUEUE_LENGTH];
+    job->delay = (uint16_t)(delay < GIF_MAX_DELAY ? delay : GIF_MAX_DELAY);
+    gif->held = false;
+    gif->count++;
+    pthread_cond_signal(&gif->queued);
+}
+
+static bool gifWrite(FrameSink *base, const CaptureImage *image, int firstRow, int rowCount, uint32_t frames)
+{
+    GifSink *gif = (GifSink *)base;
+
+    pthread_mutex_lock(&gif->lock);
+    while (gif->count == GIF_QUEUE_LENGTH && !gif->failed) {
+        pthread_cond_wait(&gif->drained, &gif->lock);
+    }
+    bool ok = !gif->failed;
+    // The free slot is the caller's until it is queued, the encoder only moves head
+    // and count under the lock
+    GifJob *job = &gif->jobs[(gif->head + gif->count) % GIF_QUEUE_LENGTH];
+    pthread_mutex_unlock(&gif->lock);
+    if (!ok) {
+        return false;
+    }
+
+    if (gif->held) {
+        int lastRow = job->firstRow + job->rowCount - 1;
+        job->firstRow = firstRow < job->firstRow ? firstRow : job->firstRow;
+        lastRow = firstRow + rowCount - 1 > lastRow ? firstRow + rowCount - 1 : lastRow;
+        job->rowCount = lastRow - job->firstRow + 1;
+    } else {
+        job->firstRow = firstRow;
+        job->rowCount = rowCount;
+    }
+    memcpy(&job->image, image, sizeof(CaptureImage));
+    gif->shownFrames += frames;
+
+    uint64_t delay = centiseconds(gif->shownFrames) - centiseconds(gif->queuedFrames);
+    pthread_mutex_lock(&gif->lock);
+    if (delay < GIF_MIN_DELAY) {
+        gif->held = true;
+    } else {
+        gifQueueHeld(gif, delay);
+        gif->queuedFrames = gif->shownFrames;
+    }
+    pthread_mutex_unlock(&gif->lock);
+    return true;
+}
+
+static bool gifClose(FrameSink *base)
+{
+    GifSink *gif = (GifSink *)base;
+
+    pthread_mutex_lock(&gif->lock);
+    if (gif->held) {
+        gifQueueHeld(gif, GIF_MIN_DELAY);
+    }
+    gif->closing = true;
+    pthread_cond_signal(&gif->queued);
+    pthread_mutex_unlock(&gif->lock);
+    pthread_join(gif->thread, NULL);
+
+    fputc(0x3B, gif->out);
+    bool ok = !gif->failed && fflush(gif->out) == 0 && !ferror(gif->out);
+    pthread_cond_destroy(&gif->drained);
+    pthread_cond_destroy(&gif->queued);
+    pthread_mutex_destroy(&gif->lock);
+    free(gif);
+    return ok;
+}
+
+/**
+ * Write frames to out as a looping animated GIF, CAPTURE_WIDTH x CAPTURE_HEIGHT
+ * times scale. Each frame only covers the rows that changed, runs of identical
+ * frames become one frame with a longer delay. Encoding happens on a thread of
+ * its own, the caller only waits when it gets GIF_QUEUE_LENGTH images ahead.
+ */
+FrameSink *sinkOpenGif(FILE *out, int scale)
+{
+    if (scale < 1 || scale > CAPTURE_MAX_SCALE) {
+        return NULL;
+    }
+    GifSink *gif = calloc(1, sizeof(GifSink));
+    if (!gif) {
+        return NULL;
+    }
+    gif->base.write = gifWrite;
+    gif->base.close = gifClose;
+    gif->out = out;
+    gif->scale = scale;
+
+    uint8_t header[13 + 3 * (1 << DISPLAY_PLANES) + 19] = {
+        'G', 'I', 'F', '8', '9', 'a', 0, 0, 0, 0,
+        0xF0 | (DISPLAY_PLANES - 1), 0, 0,  // Global palette of 2^DISPLAY_PLANES colours
+    };
+    putLE16(&header[6], (unsigned)(CAPTURE_WIDTH * scale));
+    putLE16(&header[8], (unsigned)(CAPTURE_HEIGHT * scale));
+    for (int index = 0; index < 1 << DISPLAY_PLANES; index++) {
+        header[13 + index * 3] = (uint8_t)(cpuPalette[index] >> 16);
+        header[13 + index * 3 + 1] = (uint8_t)(cpuPalette[index] >> 8);
+        header[13 + index * 3 + 2] = (uint8_t)cpuPalette[index];
+    }
+    // NETSCAPE2.0 application extension: loop forever
+    static const uint8_t loop[19] = {
+        0x21, 0xFF, 0x0B, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 0x03, 0x01, 0, 0, 0,
+    };
+    memcpy(&header[13 + 3 * (1 << DISPLAY_PLANES)], loop, sizeof(loop));
+    fwrite(header, 1, sizeof(header), out);
+
+    pthread_mutex_init(&gif->lock, NULL);
+    pthread_cond_init(&gif->queued, NULL);
+    pthread_cond_init(&gif->drained, NULL);
+    if (pthread_create(&gif->thread, NULL, gifThread, gif) != 0) {
+        pthread_cond_destroy(&gif->drained);
+        pthread_cond_destroy(&gif->queued);
+        pthread_mutex_destroy(&gif->lock);
+        free(gif);
+        return NULL;
+    }
+    return &gif->base;
+}
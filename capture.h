@@ -0,0 +1,70 @@
+//
+// Headless frame capture: samples the display once per 60Hz frame, collapses runs
+// of identical frames and streams the distinct images to a sink, raw RGB / Y4M
+// video or an animated GIF encoded on a background thread
+//
+
+#ifndef CHIP8_CAPTURE_H
+#define CHIP8_CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "ChipCPU.h"
+
+// Images are always hires sized so a stream keeps one size across 00FE / 00FF,
+// lores pixels are doubled
+#define CAPTURE_WIDTH DISPLAY_HIRES_WIDTH
+#define CAPTURE_HEIGHT DISPLAY_HIRES_HEIGHT
+#define CAPTURE_MAX_SCALE 16
+
+typedef enum CaptureFormat {
+    CAPTURE_FORMAT_RAW = 0,  // Packed RGB24, e.g. for ffmpeg -f rawvideo -pix_fmt rgb24 -r 60
+    CAPTURE_FORMAT_Y4M,      // YUV4MPEG2, 4:4:4, 60 fps
+    CAPTURE_FORMAT_GIF,      // Animated GIF, looping
+    CAPTURE_FORMAT_COUNT
+} CaptureFormat;
+
+// The display as palette indices, see cpuPalette
+typedef struct CaptureImage {
+    uint8_t pixels[CAPTURE_HEIGHT][CAPTURE_WIDTH];
+} CaptureImage;
+
+/**
+ * Where captured images go. write gets each distinct image once, when it has been
+ * replaced: how many 60Hz frames it was shown for, and the rows that differ from
+ * the image before it (all of them for the first). close flushes whatever is
+ * buffered and frees the sink.
+ */
+typedef struct FrameSink {
+    bool (*write)(struct FrameSink *sink, const CaptureImage *image, int firstRow, int rowCount, uint32_t frames);
+    bool (*close)(struct FrameSink *sink);
+} FrameSink;
+
+FrameSink *sinkOpenVideo(FILE *out, CaptureFormat format, int scale, bool dropRepeats);
+FrameSink *sinkOpenGif(FILE *out, int scale);
+
+/**
+ * Turns a CPU's display into images for a sink. Only the rows the CPU marked in
+ * dirtyRows are converted and compared, frames where none of them changed just
+ * extend the current image.
+ */
+typedef struct FrameCapture {
+    FrameSink *sink;
+    CaptureImage image;    // On screen now, handed to the sink once it is replaced
+    CaptureImage next;     // Rows converted this frame, before they are compared
+    uint32_t frames;       // 60Hz frames image has been on screen, 0 before the first
+    int firstRow;          // Rows image changed in from the one before
+    int lastRow;
+    uint64_t captured;     // Frames fed in
+    uint64_t images;       // Distinct images handed to the sink
+    bool ok;               // Cleared by the first failed write
+} FrameCapture;
+
+void captureInit(FrameCapture *capture, FrameSink *sink);
+bool captureFrame(FrameCapture *capture, ChipCPU *cpu);
+bool captureFinish(FrameCapture *capture);
+int captureParseFormat(const char *name);
+const char *captureFormatName(CaptureFormat format);
+
+#endif //CHIP8_CAPTURE_H
@@ -0,0 +1,179 @@
+//
+// Headless frame export: runs a ROM unpaced and writes what its display showed
+// each 60Hz frame as raw RGB, Y4M or an animated GIF.
+//
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ChipCPU.h"
+#include "capture.h"
+#include "log.h"
+#include "replay.h"
+#include "romcache.h"
+
+#define DEFAULT_FRAMES 600
+#define DEFAULT_CYCLES_PER_FRAME 11
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: chip8_export [options] <rom> <output>\n"
+            "  Writes the display to output, - for stdout, once per 60Hz frame.\n"
+            "  --format=raw|y4m|gif\n"
+            "                    raw is RGB24 at 60 fps; default from the output's\n"
+            "                    extension, y4m for stdout\n"
+            "  --frames=N        60Hz frames to run (default %d)\n"
+            "  --ipf=N           instructions per frame (default %d)\n"
+            "  --seed=N          RNG seed (default 0)\n"
+            "  --quirks=modern|vip|chip48|schip\n"
+            "                    opcode behaviour (default modern)\n"
+            "  --scale=N         pixels per hires pixel, 1 to %d (default 1)\n"
+            "  --drop-repeats    raw/y4m: write each distinct image once\n"
+            "  --replay=FILE     feed a recorded input session; frames, ipf, seed and\n"
+            "                    quirks come from the recording\n"
+            "  --log=LEVEL       trace, debug, info, warn, error or off (default info)\n",
+            DEFAULT_FRAMES, DEFAULT_CYCLES_PER_FRAME, CAPTURE_MAX_SCALE);
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int format_from_name(const char *output)
+{
+    const char *dot = strrchr(output, '.');
+    if (strcmp(output, "-") == 0) {
+        return CAPTURE_FORMAT_Y4M;
+    }
+    return dot ? captureParseFormat(dot + 1) : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *romFile = NULL;
+    const char *outFile = NULL;
+    const char *replayFile = NULL;
+    uint32_t frames = DEFAULT_FRAMES;
+    uint32_t cyclesPerFrame = DEFAULT_CYCLES_PER_FRAME;
+    uint64_t seed = 0;
+    bool seedGiven = false;
+    ChipQuirks quirks = CHIP_QUIRKS_MODERN;
+    int format = -1;
+    int scale = 1;
+    bool dropRepeats = false;
+    static Recording recording;
+    static RomCache romCache;
+    static FrameCapture capture;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--format=", 9) == 0 && captureParseFormat(arg + 9) >= 0) {
+            format = captureParseFormat(arg + 9);
+        } else if (strncmp(arg, "--frames=", 9) == 0) {
+            frames = (uint32_t)strtoul(arg + 9, NULL, 10);
+        } else if (strncmp(arg, "--ipf=", 6) == 0) {
+            cyclesPerFrame = (uint32_t)strtoul(arg + 6, NULL, 10);
+        } else if (strncmp(arg, "--seed=", 7) == 0) {
+            seed = strtoull(arg + 7, NULL, 10);
+            seedGiven = true;
+        } else if (strncmp(arg, "--quirks=", 9) == 0 && cpuParseQuirks(arg + 9) >= 0) {
+            quirks = (ChipQuirks)cpuParseQuirks(arg + 9);
+        } else if (strncmp(arg, "--scale=", 8) == 0) {
+            scale = (int)strtol(arg + 8, NULL, 10);
+        } else if (strcmp(arg, "--drop-repeats") == 0) {
+            dropRepeats = true;
+        } else if (strncmp(arg, "--replay=", 9) == 0) {
+            replayFile = arg + 9;
+        } else if (strncmp(arg, "--log=", 6) == 0 && logParseLevel(arg + 6) >= 0) {
+            logSetLevel(logParseLevel(arg + 6));
+        } else if (arg[0] == '-' && arg[1] != '\0') {
+            usage();
+            return 1;
+        } else if (!romFile) {
+            romFile = arg;
+        } else if (!outFile) {
+            outFile = arg;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (!romFile || !outFile || scale < 1 || scale > CAPTURE_MAX_SCALE) {
+        usage();
+        return 1;
+    }
+    if (format < 0 && (format = format_from_name(outFile)) < 0) {
+        fprintf(stderr, "Error: Can't tell the format of %s, use --format\n", outFile);
+        return 1;
+    }
+
+    romCacheInit(&romCache);
+    const RomImage *image = romCacheOpen(&romCache, romFile);
+    if (!image) {
+        return 1;
+    }
+    if (replayFile) {
+        if (!recordingLoad(&recording, replayFile)) {
+            return 1;
+        }
+        if (image->hash != recording.romHash) {
+            fprintf(stderr, "Warning: %s does not match the ROM the session was recorded with\n", romFile);
+        }
+        frames = recording.frameCount;
+        cyclesPerFrame = recording.cyclesPerFrame;
+        quirks = (ChipQuirks)recording.quirks;
+        if (!seedGiven) {
+            seed = recording.seed;
+        }
+    }
+
+    FILE *out = strcmp(outFile, "-") == 0 ? stdout : fopen(outFile, "wb");
+    if (!out) {
+        fprintf(stderr, "Error: Could not open %s for writing\n", outFile);
+        return 1;
+    }
+    FrameSink *sink = format == CAPTURE_FORMAT_GIF ? sinkOpenGif(out, scale)
+                                                   : sinkOpenVideo(out, (CaptureFormat)format, scale, dropRepeats);
+    ChipCPU *cpu = calloc(1, sizeof(ChipCPU));
+    if (!sink || !cpu || !romCacheInstantiate(image, cpu, seed)) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 1;
+    }
+    cpuSetQuirks(cpu, quirks);
+    captureInit(&capture, sink);
+
+    double start = now_seconds();
+    uint32_t next = 0;
+    for (uint32_t frame = 0; frame < frames && capture.ok; frame++) {
+        while (replayFile && next < recording.eventCount && recording.events[next].frame == frame) {
+            cpuSetKeyMask(cpu, recording.events[next].keys);
+            next++;
+        }
+        cpuRunFrame(cpu, cyclesPerFrame);
+        captureFrame(&capture, cpu);
+    }
+    bool ok = captureFinish(&capture);
+    double elapsed = now_seconds() - start;
+    if (out != stdout) {
+        ok = fclose(out) == 0 && ok;
+    }
+
+    fprintf(stderr, "%s: %llu frames, %llu distinct images, %.3fs (%.0fx real time)\n",
+            captureFormatName((CaptureFormat)format), (unsigned long long)capture.captured,
+            (unsigned long long)capture.images, elapsed, capture.captured / 60.0 / (elapsed > 0 ? elapsed : 1e-9));
+    if (!ok) {
+        fprintf(stderr, "Error: Writing %s failed\n", outFile);
+    }
+
+    cpuFree(cpu);
+    free(cpu);
+    recordingFree(&recording);
+    romCacheFree(&romCache);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,312 @@
+//
+// Vector kernels of the display filters, see filters.c. It includes this once per
+// kernel build, defining KERNEL_ISA (suffix of the names), KERNEL_LANES (pixels per
+// vector), KERNEL_VECTORS (false to only build the scalar loops) and KERNEL_TARGET
+// (attributes of every function). Deliberately no include guard.
+//
+
+#define KERNEL_JOIN(name, isa) name##_##isa
+#define KERNEL_NAME(name, isa) KERNEL_JOIN(name, isa)
+
+#define Pixels KERNEL_NAME(Pixels, KERNEL_ISA)
+#define PixelMask KERNEL_NAME(PixelMask, KERNEL_ISA)
+#define PixelWords KERNEL_NAME(PixelWords, KERNEL_ISA)
+#define PixelBytes KERNEL_NAME(PixelBytes, KERNEL_ISA)
+#define UnalignedPixels KERNEL_NAME(UnalignedPixels, KERNEL_ISA)
+#define scaleVector KERNEL_NAME(scaleVector, KERNEL_ISA)
+#define maxVector KERNEL_NAME(maxVector, KERNEL_ISA)
+#define storeTriples KERNEL_NAME(storeTriples, KERNEL_ISA)
+#define nearestKernel KERNEL_NAME(nearestKernel, KERNEL_ISA)
+#define scale2xKernel KERNEL_NAME(scale2xKernel, KERNEL_ISA)
+#define scale3xKernel KERNEL_NAME(scale3xKernel, KERNEL_ISA)
+#define scanlinesKernel KERNEL_NAME(scanlinesKernel, KERNEL_ISA)
+#define phosphorKernel KERNEL_NAME(phosphorKernel, KERNEL_ISA)
+
+#define LANES KERNEL_LANES
+#define HELPER static inline __attribute__((always_inline)) KERNEL_TARGET
+
+typedef uint32_t Pixels __attribute__((vector_size(LANES * 4)));
+typedef int32_t PixelMask __attribute__((vector_size(LANES * 4)));
+typedef uint16_t PixelWords __attribute__((vector_size(LANES * 4)));
+typedef uint8_t PixelBytes __attribute__((vector_size(LANES * 4)));
+// Loads and stores at any pixel
+typedef uint32_t UnalignedPixels __attribute__((vector_size(LANES * 4), aligned(4), may_alias));
+
+// Vectors only live in locals and behind pointers: passed by value, 256-bit ones
+// would be passed differently by the SSE2 and AVX2 builds
+#define LOAD(p) (*(const UnalignedPixels *)(p))
+#define STORE(p, v) (*(UnalignedPixels *)(p) = (v))
+#define SELECT(mask, a, b) (((Pixels)(mask) & (a)) | (~(Pixels)(mask) & (b)))
+
+#if LANES == 8
+#define PAIRS_LOW 0, 8, 1, 9, 2, 10, 3, 11
+#define PAIRS_HIGH 4, 12, 5, 13, 6, 14, 7, 15
+// Triples of a, b, c: the a and b lanes of each output vector first, then the c lanes
+#define TRIPLES_AB_0 0, 8, 0, 1, 9, 1, 2, 10
+#define TRIPLES_C_0 0, 1, 8, 3, 4, 9, 6, 7
+#define TRIPLES_AB_1 3, 3, 11, 3, 4, 12, 4, 5
+#define TRIPLES_C_1 10, 1, 2, 11, 4, 5, 12, 7
+#define TRIPLES_AB_2 13, 6, 6, 14, 7, 7, 15, 7
+#define TRIPLES_C_2 0, 13, 2, 3, 14, 5, 6, 15
+#else
+#define PAIRS_LOW 0, 4, 1, 5
+#define PAIRS_HIGH 2, 6, 3, 7
+#define TRIPLES_AB_0 0, 4, 0, 1
+#define TRIPLES_C_0 0, 1, 4, 3
+#define TRIPLES_AB_1 5, 5, 2, 6
+#define TRIPLES_C_1 0, 5, 2, 3
+#define TRIPLES_AB_2 3, 3, 7, 3
+#define TRIPLES_C_2 6, 1, 2, 7
+#endif
+
+HELPER void scaleVector(Pixels *pixels, uint16_t weight)
+{
+    // 16-bit lanes keep every channel product apart, and multiply on plain SSE2
+    PixelWords words = (PixelWords)*pixels;
+    PixelWords low = ((words & 0xFF) * weight) >> 8;
+    PixelWords high = ((words >> 8) * weight) & 0xFF00;
+    *pixels = (Pixels)(low | high);
+}
+
+HELPER void maxVector(Pixels *result, const Pixels *other)
+{
+    PixelBytes a = (PixelBytes)*result;
+    PixelBytes b = (PixelBytes)*other;
+    PixelBytes greater = (PixelBytes)(a > b);
+    *result = (Pixels)((a & greater) | (b & ~greater));
+}
+
+/**
+ * Integer nearest-neighbour: every pixel becomes a factor x factor block
+ */
+KERNEL_TARGET static void nearestKernel(const FilterImage *src, const FilterImage *dst, int factor)
+{
+    int width = src->width * factor;
+    int step = factor > LANES ? factor : LANES;
+
+    for (int y = 0; y < src->height; y++) {
+        const uint32_t *in = pixelRow(src, y);
+        uint32_t *out = pixelRow(dst, y * factor);
+        int x = 0;
+
+        if (KERNEL_VECTORS) {
+            // A run of LANES copies per pixel, what spills past its block is
+            // overwritten by the next pixel's
+            for (; x < src->width && x * factor + step <= width; x++) {
+                Pixels splat = (Pixels){0} + in[x];
+                uint32_t *block = &out[x * factor];
+                for (int k = 0; k + LANES < factor; k += LANES) {
+                    STORE(&block[k], splat);
+                }
+                STORE(&block[factor > LANES ? factor - LANES : 0], splat);
+            }
+        }
+        for (; x < src->width; x++) {
+            for (int k = 0; k < factor; k++) {
+                out[x * factor + k] = in[x];
+            }
+        }
+        for (int copy = 1; copy < factor; copy++) {
+            memcpy(pixelRow(dst, y * factor + copy), out, (size_t)width * sizeof(uint32_t));
+        }
+    }
+}
+
+KERNEL_TARGET static void scale2xKernel(const FilterImage *src, const FilterImage *dst)
+{
+    int width = src->width;
+
+    for (int y = 0; y < src->height; y++) {
+        const uint32_t *above = pixelRow(src, y > 0 ? y - 1 : y);
+        const uint32_t *row = pixelRow(src, y);
+        const uint32_t *below = pixelRow(src, y + 1 < src->height ? y + 1 : y);
+        uint32_t *out0 = pixelRow(dst, y * 2);
+        uint32_t *out1 = pixelRow(dst, y * 2 + 1);
+        int x = 0;
+
+        // The vector loop reads one pixel either side
+        scale2xPixel(above, row, below, x++, width, out0, out1);
+        if (KERNEL_VECTORS) {
+            for (; x + LANES < width; x += LANES) {
+                Pixels B = LOAD(&above[x]), D = LOAD(&row[x - 1]), E = LOAD(&row[x]);
+                Pixels F = LOAD(&row[x + 1]), H = LOAD(&below[x]);
+                PixelMask db = D == B, bf = B == F, dh = D == H, hf = H == F;
+                Pixels e0 = SELECT(db & ~bf & ~dh, D, E);
+                Pixels e1 = SELECT(bf & ~db & ~hf, F, E);
+                Pixels e2 = SELECT(dh & ~db & ~hf, D, E);
+                Pixels e3 = SELECT(hf & ~dh & ~bf, F, E);
+
+                STORE(&out0[x * 2], __builtin_shufflevector(e0, e1, PAIRS_LOW));
+                STORE(&out0[x * 2 + LANES], __builtin_shufflevector(e0, e1, PAIRS_HIGH));
+                STORE(&out1[x * 2], __builtin_shufflevector(e2, e3, PAIRS_LOW));
+                STORE(&out1[x * 2 + LANES], __builtin_shufflevector(e2, e3, PAIRS_HIGH));
+            }
+        }
+        for (; x < width; x++) {
+            scale2xPixel(above, row, below, x, width, out0, out1);
+        }
+    }
+}
+
+// a0 b0 c0 a1 b1 c1 ...
+HELPER void storeTriples(uint32_t *out, const Pixels *a, const Pixels *b, const Pixels *c)
+{
+    Pixels ab0 = __builtin_shufflevector(*a, *b, TRIPLES_AB_0);
+    Pixels ab1 = __builtin_shufflevector(*a, *b, TRIPLES_AB_1);
+    Pixels ab2 = __builtin_shufflevector(*a, *b, TRIPLES_AB_2);
+
+    STORE(&out[0], __builtin_shufflevector(ab0, *c, TRIPLES_C_0));
+    STORE(&out[LANES], __builtin_shufflevector(ab1, *c, TRIPLES_C_1));
+    STORE(&out[LANES * 2], __builtin_shufflevector(ab2, *c, TRIPLES_C_2));
+}
+
+KERNEL_TARGET static void scale3xKernel(const FilterImage *src, const FilterImage *dst)
+{
+    int width = src->width;
+
+    for (int y = 0; y < src->height; y++) {
+        const uint32_t *above = pixelRow(src, y > 0 ? y - 1 : y);
+        const uint32_t *row = pixelRow(src, y);
+        const uint32_t *below = pixelRow(src, y + 1 < src->height ? y + 1 : y);
+        uint32_t *out0 = pixelRow(dst, y * 3);
+        uint32_t *out1 = pixelRow(dst, y * 3 + 1);
+        uint32_t *out2 = pixelRow(dst, y * 3 + 2);
+        int x = 0;
+
+        scale3xPixel(above, row, below, x++, width, out0, out1, out2);
+        if (KERNEL_VECTORS) {
+            for (; x + LANES < width; x += LANES) {
+                Pixels A = LOAD(&above[x - 1]), B = LOAD(&above[x]), C = LOAD(&above[x + 1]);
+                Pixels D = LOAD(&row[x - 1]), E = LOAD(&row[x]), F = LOAD(&row[x + 1]);
+                Pixels G = LOAD(&below[x - 1]), H = LOAD(&below[x]), I = LOAD(&below[x + 1]);
+                PixelMask db = D == B, bf = B == F, dh = D == H, hf = H == F;
+                PixelMask topLeft = db & ~bf & ~dh;
+                PixelMask topRight = bf & ~db & ~hf;
+                PixelMask bottomLeft = dh & ~db & ~hf;
+                PixelMask bottomRight = hf & ~dh & ~bf;
+                PixelMask ea = E != A, ec = E != C, eg = E != G, ei = E != I;
+
+                Pixels e0 = SELECT(topLeft, D, E);
+                Pixels e1 = SELECT((topLeft & ec) | (topRight & ea), B, E);
+                Pixels e2 = SELECT(topRight, F, E);
+                Pixels e3 = SELECT((topLeft & eg) | (bottomLeft & ea), D, E);
+                Pixels e5 = SELECT((topRight & ei) | (bottomRight & ec), F, E);
+                Pixels e6 = SELECT(bottomLeft, D, E);
+                Pixels e7 = SELECT((bottomLeft & ei) | (bottomRight & eg), H, E);
+                Pixels e8 = SELECT(bottomRight, F, E);
+
+                storeTriples(&out0[x * 3], &e0, &e1, &e2);
+                storeTriples(&out1[x * 3], &e3, &E, &e5);
+                storeTriples(&out2[x * 3], &e6, &e7, &e8);
+            }
+        }
+        for (; x < width; x++) {
+            scale3xPixel(above, row, below, x, width, out0, out1, out2);
+        }
+    }
+}
+
+/**
+ * Darken the bottom third (at least one row) of every period rows to weight / 256,
+ * period being the height of a display pixel by now. Works in place.
+ */
+KERNEL_TARGET static void scanlinesKernel(const FilterImage *src, const FilterImage *dst, int period,
+                                          uint16_t weight)
+{
+    int thickness = period / 3 > 0 ? period / 3 : 1;
+
+    for (int y = 0; y < src->height; y++) {
+        const uint32_t *in = pixelRow(src, y);
+        uint32_t *out = pixelRow(dst, y);
+        int x = 0;
+
+        if (y % period < period - thickness) {
+            if (in != out) {
+                memcpy(out, in, (size_t)src->width * sizeof(uint32_t));
+            }
+            continue;
+        }
+        if (KERNEL_VECTORS) {
+            for (; x + LANES <= src->width; x += LANES) {
+                Pixels pixels = LOAD(&in[x]);
+                scaleVector(&pixels, weight);
+                STORE(&out[x], pixels | OPAQUE);
+            }
+        }
+        for (; x < src->width; x++) {
+            out[x] = scalePixel(in[x], weight) | OPAQUE;
+        }
+    }
+}
+
+/**
+ * Each channel at its brightest over the remembered frames, a frame age frames old
+ * counting (frames - age) / frames as much. Pixels lit on alternate frames, as
+ * CHIP-8 sprites that are erased and redrawn are, stay lit.
+ */
+KERNEL_TARGET static void phosphorKernel(const FilterStage *stage, const FilterImage *dst)
+{
+    const uint32_t *rows[FILTER_MAX_HISTORY];
+    uint16_t weights[FILTER_MAX_HISTORY];
+    int frames = stage->historyFrames;
+    size_t frameSize = (size_t)stage->historyWidth * stage->historyHeight;
+
+    for (int age = 0; age < frames; age++) {
+        int slot = (stage->historyNext - 1 - age + stage->amount) % stage->amount;
+        rows[age] = &stage->history[slot * frameSize];
+        weights[age] = (uint16_t)(256 * (stage->amount - age) / stage->amount);
+    }
+    for (int y = 0; y < dst->height; y++) {
+        size_t offset = (size_t)y * stage->historyWidth;
+        uint32_t *out = pixelRow(dst, y);
+        int x = 0;
+
+        if (KERNEL_VECTORS) {
+            for (; x + LANES <= dst->width; x += LANES) {
+                Pixels result = LOAD(&rows[0][offset + x]);
+                for (int age = 1; age < frames; age++) {
+                    Pixels older = LOAD(&rows[age][offset + x]);
+                    scaleVector(&older, weights[age]);
+                    maxVector(&result, &older);
+                }
+                STORE(&out[x], result | OPAQUE);
+            }
+        }
+        for (; x < dst->width; x++) {
+            uint32_t result = rows[0][offset + x];
+            for (int age = 1; age < frames; age++) {
+                result = maxPixel(result, scalePixel(rows[age][offset + x], weights[age]));
+            }
+            out[x] = result | OPAQUE;
+        }
+    }
+}
+
+#undef Pixels
+#undef PixelMask
+#undef PixelWords
+#undef PixelBytes
+#undef UnalignedPixels
+#undef scaleVector
+#undef maxVector
+#undef storeTriples
+#undef nearestKernel
+#undef scale2xKernel
+#undef scale3xKernel
+#undef scanlinesKernel
+#undef phosphorKernel
+#undef LANES
+#undef HELPER
+#undef LOAD
+#undef STORE
+#undef SELECT
+#undef PAIRS_LOW
+#undef PAIRS_HIGH
+#undef TRIPLES_AB_0
+#undef TRIPLES_C_0
+#undef TRIPLES_AB_1
+#undef TRIPLES_C_1
+#undef TRIPLES_AB_2
+#undef TRIPLES_C_2
+#undef KERNEL_JOIN
+#undef KERNEL_NAME
@@ -0,0 +1,385 @@
+#include <stdlib.h>
+#include <string.h>
+#include "filters.h"
+#include "log.h"
+//
+// Every kernel is written once over generic vectors, in filterkernels.h, and built
+// three times: without the vector loops (scalar), for the build's baseline
+// instruction set (SSE2 on x86-64) and for AVX2, chosen at run time. Each build
+// uses vectors as wide as its registers, wider ones would be split up piecewise.
+// Image edges and row tails always take the scalar path.
+//
+
+#define OPAQUE 0xFF000000u
+
+static const char *const kindNames[FILTER_KIND_COUNT] = {
+    [FILTER_NEAREST] = "nearest",
+    [FILTER_SCALE2X] = "scale2x",
+    [FILTER_SCALE3X] = "scale3x",
+    [FILTER_SCANLINES] = "scanlines",
+    [FILTER_PHOSPHOR] = "phosphor",
+};
+
+static const char *const isaNames[FILTER_ISA_COUNT] = {
+    [FILTER_ISA_SCALAR] = "scalar",
+    [FILTER_ISA_SSE2] = "sse2",
+    [FILTER_ISA_AVX2] = "avx2",
+};
+
+// Amount of a stage given without one
+static const int defaultAmounts[FILTER_KIND_COUNT] = {
+    [FILTER_NEAREST] = 2,
+    [FILTER_SCANLINES] = 50,
+    [FILTER_PHOSPHOR] = 4,
+};
+
+static inline uint32_t *pixelRow(const FilterImage *image, int y)
+{
+    return &image->pixels[(size_t)y * image->pitch];
+}
+
+// Each channel times weight / 256, weight up to 256
+static inline uint32_t scalePixel(uint32_t pixel, uint32_t weight)
+{
+    return ((((pixel & 0x00FF00FF) * weight) >> 8) & 0x00FF00FF) |
+           ((((pixel >> 8) & 0x00FF00FF) * weight) & 0xFF00FF00);
+}
+
+static inline uint32_t maxPixel(uint32_t a, uint32_t b)
+{
+    uint32_t result = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t channelA = (a >> shift) & 0xFF;
+        uint32_t channelB = (b >> shift) & 0xFF;
+        result |= (channelA > channelB ? channelA : channelB) << shift;
+    }
+    return result;
+}
+
+/*
+ * Scale2x / Scale3x name the 3x3 neighbourhood of pixel E
+ *   A B C
+ *   D E F
+ *   G H I
+ * and replace the corners of its block where two neighbours meet at an edge:
+ * top-left when D == B but the edge doesn't continue (B != F, D != H), and so on.
+ */
+
+static inline void scale2xPixel(const uint32_t *above, const uint32_t *row, const uint32_t *below, int x,
+                                int width, uint32_t *out0, uint32_t *out1)
+{
+    uint32_t B = above[x], D = row[x > 0 ? x - 1 : x], E = row[x];
+    uint32_t F = row[x + 1 < width ? x + 1 : x], H = below[x];
+    bool topLeft = D == B && B != F && D != H;
+    bool topRight = B == F && B != D && F != H;
+    bool bottomLeft = D == H && D != B && H != F;
+    bool bottomRight = H == F && D != H && B != F;
+
+    out0[x * 2] = topLeft ? D : E;
+    out0[x * 2 + 1] = topRight ? F : E;
+    out1[x * 2] = bottomLeft ? D : E;
+    out1[x * 2 + 1] = bottomRight ? F : E;
+}
+
+static inline void scale3xPixel(const uint32_t *above, const uint32_t *row, const uint32_t *below, int x,
+                                int width, uint32_t *out0, uint32_t *out1, uint32_t *out2)
+{
+    int left = x > 0 ? x - 1 : x;
+    int right = x + 1 < width ? x + 1 : x;
+    uint32_t A = above[left], B = above[x], C = above[right];
+    uint32_t D = row[left], E = row[x], F = row[right];
+    uint32_t G = below[left], H = below[x], I = below[right];
+    bool topLeft = D == B && B != F && D != H;
+    bool topRight = B == F && B != D && F != H;
+    bool bottomLeft = D == H && D != B && H != F;
+    bool bottomRight = H == F && D != H && B != F;
+
+    out0[x * 3] = topLeft ? D : E;
+    out0[x * 3 + 1] = (topLeft && E != C) || (topRight && E != A) ? B : E;
+    out0[x * 3 + 2] = topRight ? F : E;
+    out1[x * 3] = (topLeft && E != G) || (bottomLeft && E != A) ? D : E;
+    out1[x * 3 + 1] = E;
+    out1[x * 3 + 2] = (topRight && E != I) || (bottomRight && E != C) ? F : E;
+    out2[x * 3] = bottomLeft ? D : E;
+    out2[x * 3 + 1] = (bottomLeft && E != I) || (bottomRight && E != G) ? H : E;
+    out2[x * 3 + 2] = bottomRight ? F : E;
+}
+
+typedef struct FilterKernels {
+    void (*nearest)(const FilterImage *src, const FilterImage *dst, int factor);
+    void (*scale2x)(const FilterImage *src, const FilterImage *dst);
+    void (*scale3x)(const FilterImage *src, const FilterImage *dst);
+    void (*scanlines)(const FilterImage *src, const FilterImage *dst, int period, uint16_t weight);
+    void (*phosphor)(const FilterStage *stage, const FilterImage *dst);
+} FilterKernels;
+
+#define KERNEL_TABLE(ISA) { \
+    nearestKernel_##ISA, scale2xKernel_##ISA, scale3xKernel_##ISA, scanlinesKernel_##ISA, phosphorKernel_##ISA }
+
+#define KERNEL_ISA scalar
+#define KERNEL_LANES 4
+#define KERNEL_VECTORS false
+#define KERNEL_TARGET
+#include "filterkernels.h"
+#undef KERNEL_ISA
+#undef KERNEL_LANES
+#undef KERNEL_VECTORS
+#undef KERNEL_TARGET
+
+#define KERNEL_ISA sse2
+#define KERNEL_LANES 4
+#define KERNEL_VECTORS true
+#define KERNEL_TARGET
+#include "filterkernels.h"
+#undef KERNEL_ISA
+#undef KERNEL_LANES
+#undef KERNEL_VECTORS
+#undef KERNEL_TARGET
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FILTER_HAVE_AVX2
+#define KERNEL_ISA avx2
+#define KERNEL_LANES 8
+#define KERNEL_VECTORS true
+#define KERNEL_TARGET __attribute__((target("avx2")))
+#include "filterkernels.h"
+#undef KERNEL_ISA
+#undef KERNEL_LANES
+#undef KERNEL_VECTORS
+#undef KERNEL_TARGET
+#endif
+
+static const FilterKernels kernels[FILTER_ISA_COUNT] = {
+    [FILTER_ISA_SCALAR] = KERNEL_TABLE(scalar),
+    [FILTER_ISA_SSE2] = KERNEL_TABLE(sse2),
+#ifdef FILTER_HAVE_AVX2
+    [FILTER_ISA_AVX2] = KERNEL_TABLE(avx2),
+#else
+    [FILTER_ISA_AVX2] = KERNEL_TABLE(sse2),
+#endif
+};
+
+/**
+ * @return The fastest kernel build the host CPU can run
+ */
+FilterIsa filterBestIsa(void)
+{
+#ifdef FILTER_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return FILTER_ISA_AVX2;
+    }
+#endif
+    return FILTER_ISA_SSE2;
+}
+
+const char *filterIsaName(FilterIsa isa)
+{
+    return isa < FILTER_ISA_COUNT ? isaNames[isa] : "unknown";
+}
+
+const char *filterKindName(FilterKind kind)
+{
+    return kind < FILTER_KIND_COUNT ? kindNames[kind] : "unknown";
+}
+
+static int stageScale(const FilterStage *stage)
+{
+    switch (stage->kind) {
+        case FILTER_NEAREST: return stage->amount;
+        case FILTER_SCALE2X: return 2;
+        case FILTER_SCALE3X: return 3;
+        default:             return 1;
+    }
+}
+
+/**
+ * @return How many times wider and taller the chain's output is than its input
+ */
+int filterChainScale(const FilterChain *chain)
+{
+    int scale = 1;
+    for (int i = 0; i < chain->count; i++) {
+        scale *= stageScale(&chain->stages[i]);
+    }
+    return scale;
+}
+
+static bool parseStage(FilterStage *stage, const char *token, size_t length)
+{
+    const char *colon = memchr(token, ':', length);
+    size_t nameLength = colon ? (size_t)(colon - token) : length;
+    int kind = -1;
+
+    for (int i = 0; i < FILTER_KIND_COUNT; i++) {
+        if (strlen(kindNames[i]) == nameLength && strncmp(token, kindNames[i], nameLength) == 0) {
+            kind = i;
+        }
+    }
+    if (nameLength == 3 && strncmp(token, "epx", 3) == 0) {
+        kind = FILTER_SCALE2X;  // Same rules, found independently
+    }
+    if (kind < 0) {
+        return false;
+    }
+    memset(stage, 0, sizeof(*stage));
+    stage->kind = (FilterKind)kind;
+    stage->amount = defaultAmounts[kind];
+    if (colon) {
+        char *end;
+        stage->amount = (int)strtol(colon + 1, &end, 10);
+        if (end != token + length || kind == FILTER_SCALE2X || kind == FILTER_SCALE3X) {
+            return false;
+        }
+    }
+    switch (stage->kind) {
+        case FILTER_NEAREST:   return stage->amount >= 1 && stage->amount <= FILTER_MAX_SCALE;
+        case FILTER_SCANLINES: return stage->amount >= 0 && stage->amount <= 100;
+        case FILTER_PHOSPHOR:  return stage->amount >= 1 && stage->amount <= FILTER_MAX_HISTORY;
+        default:               return true;
+    }
+}
+
+/**
+ * Set up a chain from a comma separated list of stages, applied in order, each
+ * optionally followed by :amount, e.g. "phosphor:4,scale2x,nearest:4,scanlines:60".
+ * "none" or "" is the empty chain. Phosphor is cheapest before any scaling.
+ *
+ * @return false if spec is invalid, the chain is then empty
+ */
+bool filterChainParse(FilterChain *chain, const char *spec)
+{
+    memset(chain, 0, sizeof(*chain));
+    chain->isa = filterBestIsa();
+    if (strcmp(spec, "none") == 0) {
+        return true;
+    }
+    for (const char *token = spec; *token;) {
+        size_t length = strcspn(token, ",");
+        if (chain->count == FILTER_MAX_STAGES || !parseStage(&chain->stages[chain->count], token, length)) {
+            chain->count = 0;
+            return false;
+        }
+        chain->count++;
+        token += length;
+        token += *token == ',';
+    }
+    if (filterChainScale(chain) > FILTER_MAX_SCALE) {
+        chain->count = 0;
+        return false;
+    }
+    return true;
+}
+
+// Remember the phosphor stage's input as the newest frame
+static bool pushHistory(FilterStage *stage, const FilterImage *src)
+{
+    if (!stage->history || stage->historyWidth != src->width || stage->historyHeight != src->height) {
+        free(stage->history);
+        stage->history = malloc((size_t)src->width * src->height * stage->amount * sizeof(uint32_t));
+        stage->historyWidth = src->width;
+        stage->historyHeight = src->height;
+        stage->historyFrames = 0;
+        stage->historyNext = 0;
+        if (!stage->history) {
+            return false;
+        }
+    }
+    uint32_t *frame = &stage->history[(size_t)stage->historyNext * src->width * src->height];
+    for (int y = 0; y < src->height; y++) {
+        memcpy(&frame[(size_t)y * src->width], pixelRow(src, y), (size_t)src->width * sizeof(uint32_t));
+    }
+    stage->historyNext = (stage->historyNext + 1) % stage->amount;
+    if (stage->historyFrames < stage->amount) {
+        stage->historyFrames++;
+    }
+    return true;
+}
+
+/**
+ * Run src through every stage into dst, which has to be filterChainScale times src's
+ * size. Stages in between use the chain's buffers, allocated on first use; the ones
+ * after the last scaling stage work on dst in place.
+ *
+ * @return false if out of memory, dst is then incomplete
+ */
+bool filterChainApply(FilterChain *chain, const FilterImage *src, const FilterImage *dst)
+{
+    const FilterKernels *kernel = &kernels[chain->isa];
+    FilterImage in = *src;
+    int scale = 1;
+    int direct = chain->count - 1;
+
+    if (chain->count == 0) {
+        for (int y = 0; y < src->height; y++) {
+            memcpy(pixelRow(dst, y), pixelRow(src, y), (size_t)src->width * sizeof(uint32_t));
+        }
+        return true;
+    }
+    while (direct > 0 && stageScale(&chain->stages[direct]) == 1) {
+        direct--;
+    }
+    size_t pixels = (size_t)dst->width * dst->height;
+    if (direct > 0 && chain->bufferPixels < pixels) {
+        for (int i = 0; i < 2; i++) {
+            free(chain->buffers[i]);
+            chain->buffers[i] = malloc(pixels * sizeof(uint32_t));
+        }
+        chain->bufferPixels = chain->buffers[0] && chain->buffers[1] ? pixels : 0;
+        if (!chain->bufferPixels) {
+            LOG_ERROR("Out of memory for display filters");
+            return false;
+        }
+    }
+
+    for (int i = 0; i < chain->count; i++) {
+        FilterStage *stage = &chain->stages[i];
+        int factor = stageScale(stage);
+        FilterImage out = {
+            .pixels = chain->buffers[i & 1],
+            .width = in.width * factor,
+            .height = in.height * factor,
+            .pitch = in.width * factor,
+        };
+        if (i >= direct) {
+            out = *dst;
+        }
+
+        switch (stage->kind) {
+            case FILTER_NEAREST:
+                kernel->nearest(&in, &out, stage->amount);
+                break;
+            case FILTER_SCALE2X:
+                kernel->scale2x(&in, &out);
+                break;
+            case FILTER_SCALE3X:
+                kernel->scale3x(&in, &out);
+                break;
+            case FILTER_SCANLINES:
+                kernel->scanlines(&in, &out, scale > 1 ? scale : 2, (uint16_t)(stage->amount * 256 / 100));
+                break;
+            case FILTER_PHOSPHOR:
+                if (!pushHistory(stage, &in)) {
+                    LOG_ERROR("Out of memory for display filters");
+                    return false;
+                }
+                kernel->phosphor(stage, &out);
+                break;
+            default:
+                break;
+        }
+        scale *= factor;
+        in = out;
+    }
+    return true;
+}
+
+void filterChainFree(FilterChain *chain)
+{
+    for (int i = 0; i < chain->count; i++) {
+        free(chain->stages[i].history);
+    }
+    free(chain->buffers[0]);
+    free(chain->buffers[1]);
+    memset(chain, 0, sizeof(*chain));
+}
@@ -0,0 +1,68 @@
+//
+// Display post-processing between the framebuffer and the screen texture: a chain of
+// ARGB image filters, integer upscalers, scanlines and phosphor persistence
+//
+
+#ifndef CHIP8_FILTERS_H
+#define CHIP8_FILTERS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define FILTER_MAX_STAGES 8
+#define FILTER_MAX_SCALE 32     // Of the whole chain, 128 * 32 = 4096 pixels wide
+#define FILTER_MAX_HISTORY 16   // Frames a phosphor stage remembers
+
+typedef enum FilterKind {
+    FILTER_NEAREST = 0,  // Integer nearest-neighbour, amount = factor
+    FILTER_SCALE2X,      // Scale2x, a.k.a. EPX: 2x, rounds off diagonal steps
+    FILTER_SCALE3X,      // Scale3x (AdvMAME3x)
+    FILTER_SCANLINES,    // Darkens the bottom of each pixel row, amount = brightness in percent
+    FILTER_PHOSPHOR,     // Pixels fade over the last amount frames instead of going out at once
+    FILTER_KIND_COUNT
+} FilterKind;
+
+// Kernel builds, picked once per chain
+typedef enum FilterIsa {
+    FILTER_ISA_SCALAR = 0,
+    FILTER_ISA_SSE2,     // The build's baseline vectors: SSE2 on x86-64, NEON on ARM
+    FILTER_ISA_AVX2,     // x86 only, used when the host CPU has it
+    FILTER_ISA_COUNT
+} FilterIsa;
+
+// ARGB8888 pixels, pitch counts pixels from one row to the next
+typedef struct FilterImage {
+    uint32_t *pixels;
+    int width;
+    int height;
+    int pitch;
+} FilterImage;
+
+typedef struct FilterStage {
+    FilterKind kind;
+    int amount;
+    // Phosphor: ring of the last amount input frames, reset when the input size changes
+    uint32_t *history;
+    int historyWidth;
+    int historyHeight;
+    int historyFrames;  // Filled so far
+    int historyNext;
+} FilterStage;
+
+typedef struct FilterChain {
+    FilterStage stages[FILTER_MAX_STAGES];
+    int count;
+    FilterIsa isa;
+    uint32_t *buffers[2];   // Between stages, grown on demand
+    size_t bufferPixels;
+} FilterChain;
+
+bool filterChainParse(FilterChain *chain, const char *spec);
+int filterChainScale(const FilterChain *chain);
+bool filterChainApply(FilterChain *chain, const FilterImage *src, const FilterImage *dst);
+void filterChainFree(FilterChain *chain);
+FilterIsa filterBestIsa(void);
+const char *filterIsaName(FilterIsa isa);
+const char *filterKindName(FilterKind kind);
+
+#endif //CHIP8_FILTERS_H
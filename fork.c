@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <string.h>
+#include "fork.h"
+#include "native.h"
+//
+// A ChipCPU tracks which pages it wrote since it was last restored from or forked
+// into a ChipFork (its base). Forking again only copies those pages and shares the
+// rest with the base, pages are freed when the last fork holding them is released.
+//
+
+static ChipPage *pageNew(const uint8_t *bytes)
+{
+    ChipPage *page = malloc(sizeof(ChipPage));
+    if (page) {
+        atomic_init(&page->refs, 1);
+        memcpy(page->bytes, bytes, MEMORY_PAGE_SIZE);
+    }
+    return page;
+}
+
+static ChipPage *pageRetain(ChipPage *page)
+{
+    atomic_fetch_add_explicit(&page->refs, 1, memory_order_relaxed);
+    return page;
+}
+
+static void pageRelease(ChipPage *page)
+{
+    if (page && atomic_fetch_sub_explicit(&page->refs, 1, memory_order_acq_rel) == 1) {
+        free(page);
+    }
+}
+
+static bool pageDirty(const ChipCPU *cpu, int page)
+{
+    return (cpu->dirtyPages[page / 64] >> (page % 64)) & 1;
+}
+
+/**
+ * Share base's page if this one still holds the same bytes, otherwise copy it
+ */
+static ChipPage *sharePage(ChipPage *basePage, const uint8_t *bytes, bool dirty)
+{
+    if (basePage && (!dirty || memcmp(basePage->bytes, bytes, MEMORY_PAGE_SIZE) == 0)) {
+        return pageRetain(basePage);
+    }
+    return pageNew(bytes);
+}
+
+/**
+ * Snapshot cpu into a new fork
+ *
+ * @param base The fork cpu was last restored from or forked into, or NULL to copy
+ *             everything. Passing anything else gives a wrong snapshot.
+ * @return NULL if out of memory. On success cpu's base becomes the new fork.
+ */
+ChipFork *cpuFork(ChipCPU *cpu, const ChipFork *base)
+{
+    int pageCount = forkPageCount(cpu->memoryMask);
+    int basePages = base ? forkPageCount(base->memoryMask) : 0;
+    ChipFork *fork = calloc(1, sizeof(ChipFork) + sizeof(ChipPage *) * pageCount);
+    if (!fork) {
+        return NULL;
+    }
+
+    // Set first, forkRelease goes by it
+    fork->memoryMask = cpu->memoryMask;
+    const uint8_t *memory = cpuMemory(cpu);
+    for (int page = 0; page < pageCount; page++) {
+        fork->pages[page] = sharePage(page < basePages ? base->pages[page] : NULL, &memory[page * MEMORY_PAGE_SIZE],
+                                      pageDirty(cpu, page));
+        if (!fork->pages[page]) {
+            forkRelease(fork);
+            return NULL;
+        }
+    }
+    // Display writes aren't tracked, it is always compared
+    const uint8_t *display = (const uint8_t *)&cpu->display;
+    for (size_t page = 0; page < DISPLAY_PAGE_COUNT; page++) {
+        fork->display[page] = sharePage(base ? base->display[page] : NULL, &display[page * MEMORY_PAGE_SIZE], true);
+        if (!fork->display[page]) {
+            forkRelease(fork);
+            return NULL;
+        }
+    }
+
+    fork->rngState = cpu->rngState;
+    fork->PC = cpu->PC;
+    fork->I = cpu->I;
+    memcpy(fork->stack, cpu->stack, sizeof(fork->stack));
+    memcpy(fork->V, cpu->V, sizeof(fork->V));
+    fork->stackPointer = cpu->stackPointer;
+    fork->soundTimer = cpu->soundTimer;
+    fork->delayTimer = cpu->delayTimer;
+    fork->keys = cpuGetKeyMask(cpu);
+    fork->hires = cpu->hires;
+    fork->planeMask = cpu->planeMask;
+    memcpy(fork->rpl, cpu->rpl, sizeof(fork->rpl));
+
+    memset(cpu->dirtyPages, 0, sizeof(cpu->dirtyPages));
+    return fork;
+}
+
+// Blocks can straddle pages, rebuilding them is cheap
+static void dropBlocks(ChipCPU *cpu)
+{
+    memset(cpuBlockLength(cpu), 0, ((size_t)cpu->memoryMask + 1) / 2);
+    if (cpu->engine == CHIP_ENGINE_NATIVE) {
+        nativeAttach(cpu);
+    }
+}
+
+/**
+ * Copy a fork's page over cpu's if they differ, dropping the decoded instructions
+ *
+ * @return Whether anything was copied
+ */
+static bool restorePage(ChipCPU *cpu, const ChipFork *fork, int page)
+{
+    uint8_t *bytes = &cpuMemory(cpu)[page * MEMORY_PAGE_SIZE];
+    if (memcmp(bytes, fork->pages[page]->bytes, MEMORY_PAGE_SIZE) == 0) {
+        return false;
+    }
+    memcpy(bytes, fork->pages[page]->bytes, MEMORY_PAGE_SIZE);
+    memset(&cpuDecodeCache(cpu)[page * MEMORY_PAGE_SIZE / 2], 0, sizeof(DecodedOp) * MEMORY_PAGE_SIZE / 2);
+    return true;
+}
+
+// Everything but memory
+static void restoreState(ChipCPU *cpu, const ChipFork *fork)
+{
+    uint8_t *display = (uint8_t *)&cpu->display;
+    for (size_t page = 0; page < DISPLAY_PAGE_COUNT; page++) {
+        memcpy(&display[page * MEMORY_PAGE_SIZE], fork->display[page]->bytes, MEMORY_PAGE_SIZE);
+    }
+    cpu->drawFlag = 1;
+    cpu->dirtyRows = DISPLAY_ALL_ROWS;
+
+    cpu->rngState = fork->rngState;
+    cpu->PC = fork->PC;
+    cpu->I = fork->I;
+    memcpy(cpu->stack, fork->stack, sizeof(cpu->stack));
+    memcpy(cpu->V, fork->V, sizeof(cpu->V));
+    cpu->stackPointer = fork->stackPointer;
+    cpu->soundTimer = fork->soundTimer;
+    cpu->delayTimer = fork->delayTimer;
+    cpuSetKeyMask(cpu, fork->keys);
+    cpu->hires = fork->hires;
+    cpu->planeMask = fork->planeMask;
+    memcpy(cpu->rpl, fork->rpl, sizeof(cpu->rpl));
+
+    memset(cpu->dirtyPages, 0, sizeof(cpu->dirtyPages));
+}
+
+/**
+ * Load a fork into cpu, which then has it as its base. Only pages that differ from
+ * what cpu holds are copied, and only those drop their decoded instructions.
+ *
+ * @return false if out of memory for the fork's XO-CHIP memory, cpu is then unchanged
+ */
+bool cpuRestoreFork(ChipCPU *cpu, const ChipFork *fork)
+{
+    bool changed = false;
+
+    if (!cpuSetMemoryMask(cpu, fork->memoryMask)) {
+        return false;
+    }
+    for (int page = 0; page < forkPageCount(fork->memoryMask); page++) {
+        changed |= restorePage(cpu, fork, page);
+    }
+    if (changed) {
+        dropBlocks(cpu);
+    }
+    restoreState(cpu, fork);
+    return true;
+}
+
+/**
+ * cpuRestoreFork for going back to cpu's own base, e.g. resetting to a template
+ * between fuzzing runs. Only the pages written since cpu was last restored from or
+ * forked into base are looked at, the rest can't differ.
+ */
+void cpuRewindFork(ChipCPU *cpu, const ChipFork *base)
+{
+    int pageCount = forkPageCount(base->memoryMask);
+    bool changed = false;
+
+    // Memory can only have grown since base, shrinking it back needs no allocation
+    cpuSetMemoryMask(cpu, base->memoryMask);
+    for (int word = 0; word < (pageCount + 63) / 64; word++) {
+        for (uint64_t dirty = cpu->dirtyPages[word]; dirty; dirty &= dirty - 1) {
+            int page = word * 64 + __builtin_ctzll(dirty);
+            if (page < pageCount) {
+                changed |= restorePage(cpu, base, page);
+            }
+        }
+    }
+    if (changed) {
+        dropBlocks(cpu);
+    }
+    restoreState(cpu, base);
+}
+
+void forkRelease(ChipFork *fork)
+{
+    if (!fork) {
+        return;
+    }
+    for (int page = 0; page < forkPageCount(fork->memoryMask); page++) {
+        pageRelease(fork->pages[page]);
+    }
+    for (size_t page = 0; page < DISPLAY_PAGE_COUNT; page++) {
+        pageRelease(fork->display[page]);
+    }
+    free(fork);
+}
+
+/**
+ * Bytes this fork holds that no other fork shares, roughly what releasing it frees
+ */
+size_t forkPrivateBytes(const ChipFork *fork)
+{
+    size_t total = sizeof(ChipFork) + sizeof(ChipPage *) * forkPageCount(fork->memoryMask);
+    for (int page = 0; page < forkPageCount(fork->memoryMask); page++) {
+        if (atomic_load(&fork->pages[page]->refs) == 1) {
+            total += sizeof(ChipPage);
+        }
+    }
+    for (size_t page = 0; page < DISPLAY_PAGE_COUNT; page++) {
+        if (atomic_load(&fork->display[page]->refs) == 1) {
+            total += sizeof(ChipPage);
+        }
+    }
+    return total;
+}
@@ -0,0 +1,57 @@
+//
+// Copy-on-write snapshots of a ChipCPU for fanning out into many branches. Memory
+// and the display are held in refcounted pages shared between forks, so a fork
+// only costs the pages its branch actually wrote.
+//
+
+#ifndef CHIP8_FORK_H
+#define CHIP8_FORK_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "ChipCPU.h"
+
+typedef struct ChipPage {
+    _Atomic uint32_t refs;
+    uint8_t bytes[MEMORY_PAGE_SIZE];
+} ChipPage;
+
+#define DISPLAY_PAGE_COUNT (sizeof(ChipDisplay) / MEMORY_PAGE_SIZE)
+_Static_assert(sizeof(ChipDisplay) % MEMORY_PAGE_SIZE == 0, "display is shared in whole pages");
+
+/**
+ * Architectural state of one branch. Caches, the engine and other host-side
+ * fields are not part of a fork, they belong to whichever ChipCPU runs it.
+ */
+typedef struct ChipFork {
+    ChipPage *display[DISPLAY_PAGE_COUNT];
+    uint64_t rngState;
+    uint16_t PC;
+    uint16_t I;
+    uint16_t stack[STACK_DEPTH];
+    uint8_t V[V_REGISTER_COUNT];
+    uint8_t stackPointer;
+    uint8_t soundTimer;
+    uint8_t delayTimer;
+    uint16_t keys;
+    uint16_t memoryMask;
+    uint8_t hires;
+    uint8_t planeMask;
+    uint8_t rpl[RPL_FLAG_COUNT];
+    ChipPage *pages[];  // One per page of addressable memory, see forkPageCount
+} ChipFork;
+
+// Memory pages a fork of a CPU with this memoryMask holds
+static inline int forkPageCount(uint16_t memoryMask)
+{
+    return ((int)memoryMask + 1) / MEMORY_PAGE_SIZE;
+}
+
+ChipFork *cpuFork(ChipCPU *cpu, const ChipFork *base);
+bool cpuRestoreFork(ChipCPU *cpu, const ChipFork *fork);
+void cpuRewindFork(ChipCPU *cpu, const ChipFork *base);
+void forkRelease(ChipFork *fork);
+size_t forkPrivateBytes(const ChipFork *fork);
+
+#endif //CHIP8_FORK_H
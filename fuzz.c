@@ -0,0 +1,599 @@
+//
+// Coverage-guided fuzzing harness. Built with CHIP8_LIBFUZZER it is a libFuzzer
+// target, otherwise a small standalone mutator drives the same entry point.
+//
+// Inputs are read one of two ways:
+//   ROM mode (--rom=FILE, CHIP8_FUZZ_ROM under libFuzzer): the whole input is one
+//     key mask per 60Hz frame, u16 little-endian, played into that ROM
+//   program mode (no ROM): FUZZ_KEY_FRAMES key masks, then a program to run
+//
+// Every input runs on the same preallocated CPU, rewound between runs to a template
+// that was booted once. Coverage is the edges between PCs the core reports through
+// cpu->coverage, plus one counter per ChipFault. In ROM mode a fault is a bug in the
+// ROM and is reported like a crash; random programs fault all the time, so in
+// program mode faults only count as coverage.
+//
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "ChipCPU.h"
+#include "fork.h"
+#include "log.h"
+#include "profile.h"
+#include "romcache.h"
+
+#ifndef CHIP8_COVERAGE
+#error "chip8_fuzz needs the core built with CHIP8_COVERAGE"
+#endif
+
+#define FUZZ_KEY_FRAMES 16       // Key masks in front of a program
+#define FUZZ_MAX_FRAMES 2048     // Frames run per input at most, ROM mode
+#define FUZZ_MAX_INPUT 4096
+#define FUZZ_FAULT_KINDS 4       // ChipFault bits
+#define DEFAULT_CYCLES_PER_FRAME 11
+
+/**
+ * Everything one run needs, allocated once. The CPU is never re-initialised: it is
+ * rewound to base, which only copies back what the last run changed.
+ */
+typedef struct FuzzArena {
+    ChipCPU *cpu;
+    ChipFork *base;          // The booted template every run starts from
+    ChipCoverage coverage;
+    bool romMode;
+    uint32_t cyclesPerFrame;
+} FuzzArena;
+
+// Edge counters, then one per fault kind. libFuzzer picks up counters in this
+// section on its own and resets them before every run.
+#ifdef CHIP8_LIBFUZZER
+__attribute__((used, section("__libfuzzer_extra_counters")))
+#endif
+static uint8_t counters[COVERAGE_MAP_SIZE + FUZZ_FAULT_KINDS] __attribute__((aligned(64)));
+
+static FuzzArena arena;
+static RomCache romCache;
+
+static const char *const faultNames[FUZZ_FAULT_KINDS] = {
+    "stack overflow (2NNN with 16 calls deep)",
+    "stack underflow (00EE with an empty stack)",
+    "memory access past the end of memory (DXYN / FX33 / FX55 / FX65 / 5XY2 / 5XY3)",
+    "key index above F (EX9E / EXA1)",
+};
+
+/**
+ * Boot the template and keep it as the base fork. Without a ROM the template is
+ * an empty machine for programs to be written into.
+ *
+ * @return false if the ROM can't be opened or memory runs out
+ */
+static bool arenaInit(FuzzArena *fuzz, const char *romPath, ChipEngine engine, ChipQuirks quirks,
+                      uint32_t cyclesPerFrame)
+{
+    fuzz->cpu = aligned_alloc(64, (sizeof(ChipCPU) + 63) / 64 * 64);
+    if (!fuzz->cpu) {
+        return false;
+    }
+    memset(fuzz->cpu, 0, sizeof(ChipCPU));
+    if (romPath) {
+        const RomImage *image = romCacheOpen(&romCache, romPath);
+        if (!image || !romCacheInstantiate(image, fuzz->cpu, 0)) {
+            return false;
+        }
+    } else {
+        cpuInit(fuzz->cpu, 0);
+        cpuPredecode(fuzz->cpu);
+    }
+    cpuSetEngine(fuzz->cpu, engine);
+    cpuSetQuirks(fuzz->cpu, quirks);
+
+    fuzz->base = cpuFork(fuzz->cpu, NULL);
+    fuzz->coverage.counters = counters;
+    fuzz->cpu->coverage = &fuzz->coverage;
+    fuzz->romMode = romPath != NULL;
+    fuzz->cyclesPerFrame = cyclesPerFrame;
+    return fuzz->base != NULL;
+}
+
+static uint16_t keyMaskAt(const uint8_t *data, size_t size, size_t frame)
+{
+    size_t at = frame * 2;
+    return at + 1 < size ? (uint16_t)(data[at] | data[at + 1] << 8) : 0;
+}
+
+/**
+ * Run one input from the template
+ *
+ * @return ChipFault bits it raised
+ */
+static uint8_t runInput(FuzzArena *fuzz, const uint8_t *data, size_t size)
+{
+    ChipCPU *cpu = fuzz->cpu;
+    size_t frames = size / 2;
+
+    cpuRewindFork(cpu, fuzz->base);
+    cpu->faults = 0;
+    fuzz->coverage.previous = 0;
+
+    if (!fuzz->romMode) {
+        frames = FUZZ_KEY_FRAMES;
+        if (size > FUZZ_KEY_FRAMES * 2) {
+            size_t length = size - FUZZ_KEY_FRAMES * 2;
+            if (length > CHIP8_MEMORY_SIZE - PROGRAM_OFFSET) {
+                length = CHIP8_MEMORY_SIZE - PROGRAM_OFFSET;
+            }
+            cpuWriteMemory(cpu, PROGRAM_OFFSET, data + FUZZ_KEY_FRAMES * 2, length);
+        }
+    } else if (frames > FUZZ_MAX_FRAMES) {
+        frames = FUZZ_MAX_FRAMES;
+    }
+
+    for (size_t frame = 0; frame < frames; frame++) {
+        cpuSetKeyMask(cpu, keyMaskAt(data, size, frame));
+        // Parked on a fault or a jump to itself, nothing more can happen
+        cpuRunFrame(cpu, fuzz->cyclesPerFrame);
+        if (cpu->idle == CHIP_IDLE_HALT) {
+            break;
+        }
+    }
+
+    for (int kind = 0; kind < FUZZ_FAULT_KINDS; kind++) {
+        if (cpu->faults & (1 << kind)) {
+            counters[COVERAGE_MAP_SIZE + kind] = 1;
+        }
+    }
+    return cpu->faults;
+}
+
+static void printFaults(FILE *out, uint8_t faults, uint16_t pc)
+{
+    for (int kind = 0; kind < FUZZ_FAULT_KINDS; kind++) {
+        if (faults & (1 << kind)) {
+            fprintf(out, "chip8_fuzz: %s, PC at 0x%03X\n", faultNames[kind], pc);
+        }
+    }
+}
+
+static bool configure(const char *romPath, const char *engineName, const char *quirksName, uint32_t cyclesPerFrame)
+{
+    ChipEngine engine = CHIP_ENGINE_INTERPRETER;
+    ChipQuirks quirks = CHIP_QUIRKS_MODERN;
+
+    if (engineName && strcmp(engineName, "block") == 0) {
+        engine = CHIP_ENGINE_BLOCK;
+    } else if (engineName && strcmp(engineName, "interpreter") != 0) {
+        fprintf(stderr, "Error: Unknown engine: %s\n", engineName);
+        return false;
+    }
+    if (quirksName) {
+        if (cpuParseQuirks(quirksName) < 0) {
+            fprintf(stderr, "Error: Unknown quirks profile: %s\n", quirksName);
+            return false;
+        }
+        quirks = (ChipQuirks)cpuParseQuirks(quirksName);
+    }
+    // Unsupported opcodes would flood the log
+    logSetLevel(LOG_LEVEL_OFF);
+    romCacheInit(&romCache);
+    if (!arenaInit(&arena, romPath, engine, quirks, cyclesPerFrame ? cyclesPerFrame : DEFAULT_CYCLES_PER_FRAME)) {
+        fprintf(stderr, "Error: Could not set up the fuzzing arena%s%s\n", romPath ? " for " : "", romPath ? romPath : "");
+        return false;
+    }
+    return true;
+}
+
+#ifdef CHIP8_LIBFUZZER
+
+// libFuzzer owns the command line, the harness is configured from the environment
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    (void)argc;
+    (void)argv;
+    const char *ipf = getenv("CHIP8_FUZZ_IPF");
+    if (!configure(getenv("CHIP8_FUZZ_ROM"), getenv("CHIP8_FUZZ_ENGINE"), getenv("CHIP8_FUZZ_QUIRKS"),
+                   ipf ? (uint32_t)strtoul(ipf, NULL, 10) : 0)) {
+        exit(1);
+    }
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    uint8_t faults = runInput(&arena, data, size);
+    if (faults && arena.romMode) {
+        printFaults(stderr, faults, arena.cpu->PC);
+        abort();
+    }
+    return 0;
+}
+
+#else
+
+typedef struct FuzzInput {
+    uint8_t *data;
+    size_t size;
+} FuzzInput;
+
+static FuzzInput *corpus;
+static size_t corpusCount;
+static size_t corpusCapacity;
+static uint8_t seen[sizeof(counters)];  // Hit-count buckets seen per counter
+static uint64_t rngState = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t nextRandom(void)
+{
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    return rngState * 0x2545F4914F6CDD1DULL;
+}
+
+// AFL's hit count classes, 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+, one bit each
+static uint8_t buckets[256];
+
+static void initBuckets(void)
+{
+    static const struct { int first; uint8_t bit; } classes[] = {
+        { 1, 1 }, { 2, 2 }, { 3, 4 }, { 4, 8 }, { 8, 16 }, { 16, 32 }, { 32, 64 }, { 128, 128 },
+    };
+    for (int count = 1; count < 256; count++) {
+        for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]) && count >= classes[i].first; i++) {
+            buckets[count] = classes[i].bit;
+        }
+    }
+}
+
+static uint8_t collectCounter(size_t i)
+{
+    uint8_t hit = buckets[counters[i]];
+    uint8_t fresh = hit & ~seen[i];
+    seen[i] |= hit;
+    counters[i] = 0;
+    return fresh;
+}
+
+/**
+ * Fold the counters of the last run into seen and clear them for the next one.
+ * Only the counters the core listed as touched are looked at, plus the fault
+ * counters, which runInput sets itself. A run that overflowed the list has the
+ * whole map scanned.
+ *
+ * @return Whether any counter reached a bucket it never reached before
+ */
+static bool collectCoverage(void)
+{
+    ChipCoverage *coverage = &arena.coverage;
+    uint8_t fresh = 0;
+
+    if (coverage->touchedCount < COVERAGE_MAP_SIZE) {
+        for (uint32_t i = 0; i < coverage->touchedCount; i++) {
+            fresh |= collectCounter(coverage->touched[i]);
+        }
+    } else {
+        for (size_t i = 0; i < COVERAGE_MAP_SIZE; i++) {
+            fresh |= collectCounter(i);
+        }
+    }
+    coverage->touchedCount = 0;
+    for (size_t i = COVERAGE_MAP_SIZE; i < COVERAGE_MAP_SIZE + FUZZ_FAULT_KINDS; i++) {
+        fresh |= collectCounter(i);
+    }
+    return fresh != 0;
+}
+
+static uint32_t coveredEdges(void)
+{
+    uint32_t edges = 0;
+    for (size_t i = 0; i < COVERAGE_MAP_SIZE; i++) {
+        edges += seen[i] != 0;
+    }
+    return edges;
+}
+
+static bool addToCorpus(const uint8_t *data, size_t size)
+{
+    if (corpusCount == corpusCapacity) {
+        size_t capacity = corpusCapacity ? corpusCapacity * 2 : 256;
+        FuzzInput *grown = realloc(corpus, sizeof(FuzzInput) * capacity);
+        if (!grown) {
+            return false;
+        }
+        corpus = grown;
+        corpusCapacity = capacity;
+    }
+    uint8_t *copy = malloc(size ? size : 1);
+    if (!copy) {
+        return false;
+    }
+    memcpy(copy, data, size);
+    corpus[corpusCount++] = (FuzzInput){ copy, size };
+    return true;
+}
+
+static bool saveInput(const char *prefix, const char *kind, const uint8_t *data, size_t size)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s%s-%016llx", prefix, kind, (unsigned long long)cpuHashBytes(data, size));
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Error: Could not write %s\n", path);
+        return false;
+    }
+    fwrite(data, 1, size, file);
+    fclose(file);
+    fprintf(stderr, "chip8_fuzz: saved %s\n", path);
+    return true;
+}
+
+static bool loadFile(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Error: Could not open %s\n", path);
+        return false;
+    }
+    uint8_t data[FUZZ_MAX_INPUT];
+    size_t size = fread(data, 1, sizeof(data), file);
+    fclose(file);
+    return addToCorpus(data, size);
+}
+
+// A seed file, or a directory of them like a libFuzzer corpus
+static bool loadSeeds(const char *path)
+{
+    struct stat info;
+    if (stat(path, &info) != 0 || !S_ISDIR(info.st_mode)) {
+        return loadFile(path);
+    }
+    DIR *dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "Error: Could not open %s\n", path);
+        return false;
+    }
+    bool ok = true;
+    for (struct dirent *entry; ok && (entry = readdir(dir));) {
+        char child[4096];
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        if (entry->d_name[0] != '.' && stat(child, &info) == 0 && S_ISREG(info.st_mode)) {
+            ok = loadFile(child);
+        }
+    }
+    closedir(dir);
+    return ok;
+}
+
+/**
+ * Stack a few random edits on an input. Programs are edited a whole instruction at
+ * a time as often as byte-wise, so most mutants still decode to something.
+ */
+static size_t mutate(uint8_t *data, size_t size, size_t maxSize)
+{
+    int edits = 1 + (int)(nextRandom() % 4);
+    for (int edit = 0; edit < edits; edit++) {
+        uint64_t r = nextRandom();
+        size_t at = size ? (size_t)(r >> 32) % size : 0;
+        switch (r % 7) {
+            case 0:
+                if (size) data[at] ^= (uint8_t)(1 << (r >> 8 & 7));
+                break;
+            case 1:
+                if (size) data[at] = (uint8_t)(r >> 16);
+                break;
+            case 2:
+                if (size >= 2) {
+                    at &= ~(size_t)1;
+                    data[at] = (uint8_t)(r >> 16);
+                    data[at + 1] = (uint8_t)(r >> 24);
+                }
+                break;
+            case 3: {
+                size_t count = 1 + (r >> 8 & 3);
+                if (size + count <= maxSize) {
+                    memmove(&data[at + count], &data[at], size - at);
+                    for (size_t i = 0; i < count; i++) {
+                        data[at + i] = (uint8_t)(nextRandom() >> 56);
+                    }
+                    size += count;
+                }
+                break;
+            }
+            case 4: {
+                size_t count = 1 + (r >> 8 & 3);
+                if (at + count <= size) {
+                    memmove(&data[at], &data[at + count], size - at - count);
+                    size -= count;
+                }
+                break;
+            }
+            case 5: {
+                // Duplicate a chunk elsewhere, repeats are what loops are made of
+                size_t from = size ? (size_t)(r >> 8 & 0xFFFFFF) % size : 0;
+                size_t count = 1 + (r >> 40 & 15);
+                if (from + count <= size && at + count <= size) {
+                    memmove(&data[at], &data[from], count);
+                }
+                break;
+            }
+            default: {
+                // Splice in the tail of another input
+                const FuzzInput *other = &corpus[nextRandom() % corpusCount];
+                size_t from = other->size ? (size_t)(r >> 8 & 0xFFFFFF) % other->size : 0;
+                size_t count = other->size - from;
+                if (at + count > maxSize) {
+                    count = maxSize - at;
+                }
+                memcpy(&data[at], &other->data[from], count);
+                size = at + count > size ? at + count : size;
+                break;
+            }
+        }
+    }
+    return size;
+}
+
+static double nowSeconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void report(const char *event, uint64_t runs, double elapsed)
+{
+    fprintf(stderr, "#%llu\t%s edges: %u corpus: %zu exec/s: %.0f\n", (unsigned long long)runs, event,
+            coveredEdges(), corpusCount, elapsed > 0 ? (double)runs / elapsed : 0.0);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: chip8_fuzz [options] [seed file or directory]...\n"
+            "  --rom=FILE        fuzz the key input of FILE; without it inputs are programs\n"
+            "                    preceded by %d frames of key masks\n"
+            "  --runs=N          inputs to try, 0 only runs the seeds (default: until --time)\n"
+            "  --time=S          stop after S seconds (default 10)\n"
+            "  --seed=N          mutation RNG seed\n"
+            "  --max-len=N       longest input to generate (default %d)\n"
+            "  --ipf=N           instructions per frame (default %d)\n"
+            "  --engine=interpreter|block\n"
+            "  --quirks=modern|vip|chip48|schip\n"
+            "  --save=DIR        write every input that found new coverage to DIR\n"
+            "  --artifacts=PREFIX\n"
+            "                    path prefix of inputs that fault a ROM (default ./)\n",
+            FUZZ_KEY_FRAMES, FUZZ_MAX_INPUT, DEFAULT_CYCLES_PER_FRAME);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *romPath = NULL;
+    const char *engineName = NULL;
+    const char *quirksName = NULL;
+    const char *saveDir = NULL;
+    const char *artifacts = "./";
+    uint64_t maxRuns = UINT64_MAX;
+    double seconds = 10;
+    size_t maxSize = FUZZ_MAX_INPUT;
+    uint32_t cyclesPerFrame = DEFAULT_CYCLES_PER_FRAME;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--rom=", 6) == 0) {
+            romPath = arg + 6;
+        } else if (strncmp(arg, "--runs=", 7) == 0) {
+            maxRuns = strtoull(arg + 7, NULL, 10);
+        } else if (strncmp(arg, "--time=", 7) == 0) {
+            seconds = strtod(arg + 7, NULL);
+        } else if (strncmp(arg, "--seed=", 7) == 0) {
+            rngState ^= strtoull(arg + 7, NULL, 10) * 0xBF58476D1CE4E5B9ULL;
+        } else if (strncmp(arg, "--max-len=", 10) == 0) {
+            maxSize = strtoul(arg + 10, NULL, 10);
+        } else if (strncmp(arg, "--ipf=", 6) == 0) {
+            cyclesPerFrame = (uint32_t)strtoul(arg + 6, NULL, 10);
+        } else if (strncmp(arg, "--engine=", 9) == 0) {
+            engineName = arg + 9;
+        } else if (strncmp(arg, "--quirks=", 9) == 0) {
+            quirksName = arg + 9;
+        } else if (strncmp(arg, "--save=", 7) == 0) {
+            saveDir = arg + 7;
+        } else if (strncmp(arg, "--artifacts=", 12) == 0) {
+            artifacts = arg + 12;
+        } else if (arg[0] == '-') {
+            usage();
+            return 1;
+        }
+    }
+    if (maxSize == 0 || maxSize > FUZZ_MAX_INPUT || rngState == 0) {
+        usage();
+        return 1;
+    }
+    if (!configure(romPath, engineName, quirksName, cyclesPerFrame)) {
+        return 1;
+    }
+    initBuckets();
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-' && !loadSeeds(argv[i])) {
+            return 1;
+        }
+    }
+
+    // Seeds first, so a run with --runs=0 reproduces them
+    uint8_t faultsSeen = 0;
+    int status = 0;
+    size_t seeds = corpusCount;
+    for (size_t i = 0; i < seeds; i++) {
+        uint8_t faults = runInput(&arena, corpus[i].data, corpus[i].size);
+        collectCoverage();
+        if (faults && arena.romMode) {
+            printFaults(stderr, faults, arena.cpu->PC);
+            status = 1;
+        }
+        faultsSeen |= faults;
+    }
+    if (corpusCount == 0) {
+        // Something for the mutator to work on: no keys and, for programs, a block
+        // of zeroed code
+        static const uint8_t empty[FUZZ_KEY_FRAMES * 2 + 64];
+        size_t size = arena.romMode ? 0 : sizeof(empty);
+        addToCorpus(empty, size);
+        runInput(&arena, empty, size);
+        collectCoverage();
+    }
+
+    double start = nowSeconds();
+    double nextReport = start + 1;
+    uint64_t runs = 0;
+    uint8_t mutant[FUZZ_MAX_INPUT];
+    report("INITED", runs, 0);
+
+    while (runs < maxRuns && maxRuns > 0) {
+        const FuzzInput *parent = &corpus[nextRandom() % corpusCount];
+        size_t size = parent->size < maxSize ? parent->size : maxSize;
+        memcpy(mutant, parent->data, size);
+        size = mutate(mutant, size, maxSize);
+
+        uint8_t faults = runInput(&arena, mutant, size);
+        runs++;
+        if (collectCoverage()) {
+            addToCorpus(mutant, size);
+            if (saveDir) {
+                char prefix[4096];
+                snprintf(prefix, sizeof(prefix), "%s/", saveDir);
+                saveInput(prefix, "input", mutant, size);
+            }
+        }
+        uint8_t newFaults = faults & ~faultsSeen;
+        if (newFaults) {
+            faultsSeen |= newFaults;
+            if (arena.romMode) {
+                printFaults(stderr, newFaults, arena.cpu->PC);
+                saveInput(artifacts, "fault", mutant, size);
+                status = 1;
+            }
+        }
+
+        if ((runs & 0xFFF) == 0) {
+            double now = nowSeconds();
+            if (now >= nextReport) {
+                report("pulse", runs, now - start);
+                nextReport = now + 1;
+            }
+            if (now - start >= seconds) {
+                break;
+            }
+        }
+    }
+
+    report("DONE", runs, nowSeconds() - start);
+    for (int kind = 0; kind < FUZZ_FAULT_KINDS; kind++) {
+        if (faultsSeen & (1 << kind)) {
+            fprintf(stderr, "  reached: %s\n", faultNames[kind]);
+        }
+    }
+    return status;
+}
+
+#endif
@@ -0,0 +1,878 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lockstep.h"
+#include "log.h"
+
+// Signed views of the lane vectors, widening and narrowing all-ones masks needs the
+// sign extension
+typedef int8_t LaneMask8 __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef int16_t LaneMask16 __attribute__((vector_size(LOCKSTEP_LANES * 2)));
+typedef int64_t LaneMask64 __attribute__((vector_size(LOCKSTEP_LANES * 8)));
+
+#define LOCKSTEP_MEMORY_MASK (CHIP8_MEMORY_SIZE - 1)
+// Longest run of a step that fits the 16-bit per-lane budget
+#define LOCKSTEP_CHUNK 0xFFFF
+
+// dst = value in the lanes selected by mask, unchanged elsewhere
+#define BLEND(dst, value, mask) ((dst) = ((value) & (mask)) | ((dst) & ~(mask)))
+#define TO_BYTES(mask) ((LaneBytes)__builtin_convertvector((LaneMask16)(mask), LaneMask8))
+#define TO_WORDS(mask) ((LaneWords)__builtin_convertvector((LaneMask8)(mask), LaneMask16))
+#define TO_ROWS(mask) ((LaneRows)__builtin_convertvector((LaneMask8)(mask), LaneMask64))
+
+// Comparisons on vectors wider than the target's registers are split into one
+// compare per lane by GCC, these stay in vector arithmetic. All-ones where true, like
+// the built-in comparisons.
+#define NONZERO8(v) ((LaneBytes)((LaneMask8)((v) | -(v)) >> 7))
+#define NONZERO16(v) ((LaneWords)((LaneMask16)((v) | -(v)) >> 15))
+#define BELOW8(a, b) ((LaneBytes)((LaneMask8)((~(a) & (b)) | (~((a) ^ (b)) & ((a) - (b)))) >> 7))
+
+/**
+ * The lanes one instruction runs on, as all-ones / all-zeros masks in both widths
+ */
+typedef struct LaneSelect {
+    LaneBytes bytes;
+    LaneWords words;
+    uint32_t bits;  // Bit n set for lane n
+    int leader;     // Lowest selected lane, its memory supplies the shared code
+    bool split;     // PC or budget may no longer be the same on all of them
+} LaneSelect;
+
+static bool anyBytes(const LaneBytes *mask)
+{
+    uint64_t words[sizeof(LaneBytes) / sizeof(uint64_t)];
+    uint64_t any = 0;
+    memcpy(words, mask, sizeof(words));
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        any |= words[i];
+    }
+    return any != 0;
+}
+
+static bool anyWords(const LaneWords *mask)
+{
+    uint64_t words[sizeof(LaneWords) / sizeof(uint64_t)];
+    uint64_t any = 0;
+    memcpy(words, mask, sizeof(words));
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        any |= words[i];
+    }
+    return any != 0;
+}
+
+// Masks to lane bit sets and back, 8 lanes per multiply (little-endian hosts)
+#define LANE_BIT_PICK 0x8040201008040201ULL
+#define LANE_BIT_SPREAD 0x0101010101010101ULL
+
+static uint32_t laneBits(const LaneBytes *mask)
+{
+    uint64_t words[LOCKSTEP_LANES / 8];
+    uint32_t bits = 0;
+    memcpy(words, mask, sizeof(words));
+    for (int i = 0; i < LOCKSTEP_LANES / 8; i++) {
+        bits |= (uint32_t)(((words[i] & LANE_BIT_PICK) * LANE_BIT_SPREAD) >> 56) << (i * 8);
+    }
+    return bits;
+}
+
+static void bitsToBytes(LaneBytes *mask, uint32_t bits)
+{
+    uint64_t words[LOCKSTEP_LANES / 8];
+    for (int i = 0; i < LOCKSTEP_LANES / 8; i++) {
+        words[i] = (((bits >> (i * 8)) & 0xFF) * LANE_BIT_SPREAD) & LANE_BIT_PICK;
+    }
+    memcpy(mask, words, sizeof(words));
+    *mask = NONZERO8(*mask);
+}
+
+static void selectLanes(LaneSelect *select, uint32_t bits)
+{
+    select->bits = bits;
+    bitsToBytes(&select->bytes, bits);
+    select->words = TO_WORDS(select->bytes);
+    select->leader = bits ? __builtin_ctz(bits) : 0;
+}
+
+// Pages holding the n bytes from address on, which can wrap around 4 KiB
+static uint16_t pagesOf(uint16_t address, int n)
+{
+    uint16_t first = address & LOCKSTEP_MEMORY_MASK;
+    uint16_t last = (address + (n > 0 ? n - 1 : 0)) & LOCKSTEP_MEMORY_MASK;
+    return (uint16_t)((1u << (first / MEMORY_PAGE_SIZE)) | (1u << (last / MEMORY_PAGE_SIZE)));
+}
+
+static void writeLane(LockstepGroup *group, int lane, uint16_t address, uint8_t value)
+{
+    address &= LOCKSTEP_MEMORY_MASK;
+    group->memory[lane][address] = value;
+    group->written[lane] |= (uint16_t)(1u << (address / MEMORY_PAGE_SIZE));
+}
+
+/**
+ * Copy one lane back into its CPU. Memory is shared in place, only the decoded
+ * forms of it have to be dropped if the lane wrote any.
+ */
+static void storeLane(LockstepGroup *group, int lane)
+{
+    ChipCPU *cpu = group->cpus[lane];
+
+    for (int i = 0; i < V_REGISTER_COUNT; i++) {
+        cpu->V[i] = group->V[i][lane];
+    }
+    for (int i = 0; i < STACK_DEPTH; i++) {
+        cpu->stack[i] = group->stack[i][lane];
+    }
+    cpu->I = group->I[lane];
+    cpu->PC = group->PC[lane];
+    cpu->stackPointer = group->stackPointer[lane];
+    cpu->delayTimer = group->delayTimer[lane];
+    cpu->soundTimer = group->soundTimer[lane];
+    cpu->rngState = group->rngState[lane];
+    cpuSetKeyMask(cpu, group->keys[lane]);
+    for (int y = 0; y < DISPLAY_HEIGHT; y++) {
+        cpu->display.planes[0][y][0] = group->display[y][lane];
+    }
+    if (group->drew[lane]) {
+        // Lanes don't track rows
+        cpu->drawFlag = 1;
+        cpu->dirtyRows = DISPLAY_ALL_ROWS;
+        group->drew[lane] = 0;
+    }
+    if (group->written[lane]) {
+        cpuInvalidateDecodeCache(cpu);
+        group->written[lane] = 0;
+    }
+}
+
+/**
+ * Hand lanes over to the scalar interpreter for good. The instruction they stopped
+ * at has not run yet, they finish the step from there on their own.
+ */
+static void ejectLanes(LockstepGroup *group, uint32_t bits, uint32_t pending)
+{
+    for (; bits; bits &= bits - 1) {
+        int lane = __builtin_ctz(bits);
+        uint32_t left = group->left[lane] + pending;
+
+        storeLane(group, lane);
+        group->active &= ~(1u << lane);
+        group->left[lane] = 0;
+        LOG_DEBUG("Lockstep lane %d continues on the interpreter at 0x%03X", lane, group->PC[lane]);
+        group->skipped += left - cpuStep(group->cpus[lane], left);
+    }
+}
+
+static bool canRunLockstep(const ChipCPU *cpu)
+{
+    return cpu->quirks == CHIP_QUIRKS_MODERN && !cpu->hires && cpu->planeMask == 1
+           && cpu->memoryMask == LOCKSTEP_MEMORY_MASK && cpu->stackPointer <= STACK_DEPTH;
+}
+
+LockstepGroup *lockstepCreate(void)
+{
+    LockstepGroup *group = aligned_alloc(_Alignof(LockstepGroup), sizeof(LockstepGroup));
+    if (group) {
+        memset(group, 0, sizeof(*group));
+    }
+    return group;
+}
+
+void lockstepDestroy(LockstepGroup *group)
+{
+    free(group);
+}
+
+/**
+ * Take over count CPUs, normally fresh instances of the same ROM. CPUs that are in a
+ * mode lockstep can't run go straight to the scalar interpreter.
+ */
+void lockstepLoad(LockstepGroup *group, ChipCPU *const *cpus, uint32_t count)
+{
+    memset(group, 0, sizeof(*group));
+    group->count = count < LOCKSTEP_LANES ? count : LOCKSTEP_LANES;
+
+    for (uint32_t lane = 0; lane < group->count; lane++) {
+        ChipCPU *cpu = cpus[lane];
+        group->cpus[lane] = cpu;
+        group->memory[lane] = cpuMemory(cpu);
+        if (!canRunLockstep(cpu)) {
+            continue;
+        }
+        group->active |= 1u << lane;
+
+        for (int i = 0; i < V_REGISTER_COUNT; i++) {
+            group->V[i][lane] = cpu->V[i];
+        }
+        for (int i = 0; i < STACK_DEPTH; i++) {
+            group->stack[i][lane] = cpu->stack[i];
+        }
+        group->I[lane] = cpu->I;
+        group->PC[lane] = cpu->PC;
+        group->stackPointer[lane] = cpu->stackPointer;
+        group->delayTimer[lane] = cpu->delayTimer;
+        group->soundTimer[lane] = cpu->soundTimer;
+        group->rngState[lane] = cpu->rngState;
+        group->keys[lane] = cpuGetKeyMask(cpu);
+        for (int y = 0; y < DISPLAY_HEIGHT; y++) {
+            group->display[y][lane] = cpu->display.planes[0][y][0];
+        }
+    }
+
+    // Code is only compared lane by lane on pages where the memories differ
+    int first = group->active ? __builtin_ctz(group->active) : 0;
+    for (uint32_t bits = group->active; bits; bits &= bits - 1) {
+        const uint8_t *memory = group->memory[__builtin_ctz(bits)];
+        for (int page = 0; page < CHIP8_MEMORY_SIZE / MEMORY_PAGE_SIZE; page++) {
+            if (memcmp(memory + page * MEMORY_PAGE_SIZE, group->memory[first] + page * MEMORY_PAGE_SIZE,
+                       MEMORY_PAGE_SIZE) != 0) {
+                group->codeDiffers |= (uint16_t)(1u << page);
+            }
+        }
+    }
+}
+
+/**
+ * Write every lane still in lockstep back into its CPU. The group stays loaded and
+ * can keep running afterwards.
+ */
+void lockstepStore(LockstepGroup *group)
+{
+    for (uint32_t bits = group->active; bits; bits &= bits - 1) {
+        storeLane(group, __builtin_ctz(bits));
+    }
+}
+
+void lockstepSetKeyMask(LockstepGroup *group, uint32_t lane, uint16_t mask)
+{
+    if (lane >= group->count) {
+        return;
+    }
+    if (group->active & (1u << lane)) {
+        group->keys[lane] = mask;
+    } else {
+        cpuSetKeyMask(group->cpus[lane], mask);
+    }
+}
+
+uint32_t lockstepActiveLanes(const LockstepGroup *group)
+{
+    return (uint32_t)__builtin_popcount(group->active);
+}
+
+// Cut the budget of the lanes in mask down to left, like the scalar idle fast-forward
+static void cutLanes(LockstepGroup *group, const LaneWords *left, const LaneWords *mask)
+{
+    LaneWords cut = (group->left - *left) & *mask;
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        group->skipped += cut[lane];
+    }
+    BLEND(group->left, *left, *mask);
+}
+
+// Lanes whose budget runs out with this instruction
+static void finishLanes(LockstepGroup *group, const LaneWords *mask)
+{
+    LaneWords last = (LaneWords){0} + 1;
+    cutLanes(group, &last, mask);
+}
+
+/**
+ * Skip the instruction after the current one on the lanes in skip. Like the scalar
+ * interpreter, an F000 NNNN is skipped as a whole.
+ */
+static void skipLanes(LockstepGroup *group, LaneSelect *exec, const LaneBytes *skip)
+{
+    LaneWords words = TO_WORDS(*skip);
+    LaneBytes rest = exec->bytes & ~*skip;
+    uint16_t next = group->PC[exec->leader] & LOCKSTEP_MEMORY_MASK;
+
+    if (!anyBytes(skip)) {
+        return;
+    }
+    exec->split |= anyBytes(&rest);
+    if (group->codeDiffers & pagesOf(next, 2)) {
+        uint32_t bits = laneBits(skip);
+        for (; bits; bits &= bits - 1) {
+            int lane = __builtin_ctz(bits);
+            const uint8_t *memory = group->memory[lane];
+            bool longOp = memory[next] == 0xF0 && memory[(next + 1) & LOCKSTEP_MEMORY_MASK] == 0x00;
+            group->PC[lane] += longOp ? 4 : 2;
+        }
+        return;
+    }
+    const uint8_t *memory = group->memory[exec->leader];
+    bool longOp = memory[next] == 0xF0 && memory[(next + 1) & LOCKSTEP_MEMORY_MASK] == 0x00;
+    BLEND(group->PC, group->PC + (uint16_t)(longOp ? 4 : 2), words);
+}
+
+static bool sameBytes(const LaneBytes *values, const LaneSelect *exec)
+{
+    LaneBytes differ = NONZERO8(*values ^ (*values)[exec->leader]) & exec->bytes;
+    return !anyBytes(&differ);
+}
+
+static bool sameWords(const LaneWords *values, const LaneSelect *exec)
+{
+    LaneWords differ = NONZERO16(*values ^ (*values)[exec->leader]) & exec->words;
+    return !anyWords(&differ);
+}
+
+//DXYN for classic lores sprites. Lanes drawing the same sprite at the same place,
+//the common case in lockstep, share one pass over the rows.
+static void drawLanes(LockstepGroup *group, const LaneSelect *exec, uint8_t x, uint8_t y, uint8_t n)
+{
+    LaneBytes collided = {0};
+
+    if (sameBytes(&group->V[x], exec) && sameBytes(&group->V[y], exec) && sameWords(&group->I, exec)
+        && !(group->codeDiffers & pagesOf(group->I[exec->leader], n))) {
+        const uint8_t *memory = group->memory[exec->leader];
+        uint16_t address = group->I[exec->leader];
+        uint8_t x_pos = group->V[x][exec->leader] % DISPLAY_WIDTH;
+        uint8_t y_pos = group->V[y][exec->leader] % DISPLAY_HEIGHT;
+        LaneRows rows = TO_ROWS(exec->bytes);
+        LaneRows hits = {0};
+
+        for (int row = 0; row < n; row++) {
+            uint64_t sprite = (uint64_t)memory[(address + row) & LOCKSTEP_MEMORY_MASK] << 56;
+            uint64_t bits = (sprite >> x_pos) | (sprite << ((DISPLAY_WIDTH - x_pos) & 63));
+            LaneRows *line = &group->display[(y_pos + row) % DISPLAY_HEIGHT];
+            LaneRows masked = rows & bits;
+
+            hits |= *line & masked;
+            *line ^= masked;
+        }
+        collided = __builtin_convertvector((hits | -hits) >> 63, LaneBytes);
+    } else {
+        for (uint32_t lanes = exec->bits; lanes; lanes &= lanes - 1) {
+            int lane = __builtin_ctz(lanes);
+            const uint8_t *memory = group->memory[lane];
+            uint16_t address = group->I[lane];
+            uint8_t x_pos = group->V[x][lane] % DISPLAY_WIDTH;
+            uint8_t y_pos = group->V[y][lane] % DISPLAY_HEIGHT;
+
+            for (int row = 0; row < n; row++) {
+                uint64_t sprite = (uint64_t)memory[(address + row) & LOCKSTEP_MEMORY_MASK] << 56;
+                uint64_t bits = (sprite >> x_pos) | (sprite << ((DISPLAY_WIDTH - x_pos) & 63));
+                uint64_t *line = &group->display[(y_pos + row) % DISPLAY_HEIGHT][lane];
+
+                if (*line & bits) {
+                    collided[lane] = 0xFF;
+                }
+                *line ^= bits;
+            }
+        }
+    }
+    BLEND(group->V[0xF], collided & 1, exec->bytes);
+    group->drew |= exec->bytes;
+}
+
+/**
+ * Mark the pages of the n bytes the selected lanes just stored at I if the lanes'
+ * memory may differ there now. The same bytes stored on every lane, like a shared
+ * score counter, keep the code around them shared.
+ */
+static void checkWrites(LockstepGroup *group, const LaneSelect *exec, int n)
+{
+    if (!sameWords(&group->I, exec)) {
+        for (uint32_t lanes = exec->bits; lanes; lanes &= lanes - 1) {
+            group->codeDiffers |= pagesOf(group->I[__builtin_ctz(lanes)], n);
+        }
+        return;
+    }
+    uint16_t address = group->I[exec->leader];
+    const uint8_t *reference = group->memory[exec->leader];
+    for (uint32_t lanes = group->active; lanes; lanes &= lanes - 1) {
+        const uint8_t *memory = group->memory[__builtin_ctz(lanes)];
+        for (int i = 0; i < n; i++) {
+            if (memory[(address + i) & LOCKSTEP_MEMORY_MASK] != reference[(address + i) & LOCKSTEP_MEMORY_MASK]) {
+                group->codeDiffers |= pagesOf(address, n);
+                return;
+            }
+        }
+    }
+}
+
+// Drop lanes from the selection, returning them
+static uint32_t excludeLanes(LaneSelect *exec, const LaneBytes *drop)
+{
+    uint32_t bits = laneBits(drop) & exec->bits;
+    if (bits) {
+        selectLanes(exec, exec->bits & ~bits);
+        exec->split = true;
+    }
+    return bits;
+}
+
+// Drop lanes whose n bytes from I run past the end of memory, the interpreter flags
+// those as CHIP_FAULT_MEMORY_WRAP
+static uint32_t excludeWrapping(const LockstepGroup *group, LaneSelect *exec, int n)
+{
+    LaneWords last = group->I + (uint16_t)(n - 1);
+    LaneBytes wraps = TO_BYTES(NONZERO16((group->I | last) & (uint16_t)~LOCKSTEP_MEMORY_MASK));
+    return excludeLanes(exec, &wraps);
+}
+
+/**
+ * Run one instruction on the selected lanes, their PC already points past it
+ *
+ * @return Lanes that have to leave lockstep instead of running it, they are taken
+ *         out of exec
+ */
+static uint32_t executeLanes(LockstepGroup *group, uint16_t opcode, LaneSelect *exec)
+{
+    uint8_t x = (opcode >> 8) & 0xF;
+    uint8_t y = (opcode >> 4) & 0xF;
+    uint8_t n = opcode & 0xF;
+    uint8_t nn = opcode & 0xFF;
+    uint16_t nnn = opcode & 0xFFF;
+    LaneBytes *V = group->V;
+    uint32_t leave = 0;
+
+    // Lanes the interpreter has to handle on its own leave first, the rest carry on
+    switch (opcode & 0xF000) {
+        case 0x0000:
+            if (nn == 0xEE) {
+                // 0 wraps to 255, so this catches an empty stack and a corrupt pointer
+                LaneBytes empty = NONZERO8((LaneBytes)(group->stackPointer - 1) & (uint8_t)~(STACK_DEPTH - 1));
+                leave = excludeLanes(exec, &empty);
+            } else if (nn != 0xE0) {
+                // 0NNN machine code and the SUPER-CHIP / XO-CHIP display ops
+                return exec->bits;
+            }
+            break;
+        case 0x2000: {
+            // Both limits are 16, anything above the low nibble is past the end
+            LaneBytes full = NONZERO8(group->stackPointer & (uint8_t)~(STACK_DEPTH - 1));
+            leave = excludeLanes(exec, &full);
+            break;
+        }
+        case 0x5000:
+            if (n == 0x2 || n == 0x3) {
+                return exec->bits;
+            }
+            break;
+        case 0xD000:
+            // DXY0 is a 16x16 SUPER-CHIP sprite
+            if (n == 0) {
+                return exec->bits;
+            }
+            leave = excludeWrapping(group, exec, n);
+            break;
+        case 0xE000:
+            // Keys past F read outside the key array on the interpreter
+            if (nn == 0x9E || nn == 0xA1) {
+                LaneBytes wild = NONZERO8(V[x] & (uint8_t)~(KEY_COUNT - 1));
+                leave = excludeLanes(exec, &wild);
+            }
+            break;
+        case 0xF000:
+            switch (nn) {
+                case 0x07: case 0x0A: case 0x15: case 0x18: case 0x1E: case 0x29:
+                case 0x30:
+                    break;
+                case 0x33:
+                    leave = excludeWrapping(group, exec, 3);
+                    break;
+                case 0x55: case 0x65:
+                    leave = excludeWrapping(group, exec, x + 1);
+                    break;
+                default:
+                    // F000 / FN01 / FX75 / FX85 and unsupported opcodes
+                    return exec->bits;
+            }
+            break;
+    }
+
+    if (!exec->bits) {
+        return leave;
+    }
+
+    LaneBytes bytes = exec->bytes;
+    LaneWords words = exec->words;
+    LaneBytes skip;
+
+    switch (opcode & 0xF000) {
+        case 0x0000:
+            if (nn == 0xE0) {
+                LaneRows rows = TO_ROWS(bytes);
+                for (int row = 0; row < DISPLAY_HEIGHT; row++) {
+                    group->display[row] &= ~rows;
+                }
+                group->drew |= bytes;
+            } else {
+                exec->split = true;
+                BLEND(group->stackPointer, group->stackPointer - 1, bytes);
+                if (sameBytes(&group->stackPointer, exec)) {
+                    BLEND(group->PC, group->stack[group->stackPointer[exec->leader]], words);
+                } else {
+                    for (uint32_t lanes = exec->bits; lanes; lanes &= lanes - 1) {
+                        int lane = __builtin_ctz(lanes);
+                        group->PC[lane] = group->stack[group->stackPointer[lane]][lane];
+                    }
+                }
+            }
+            return leave;
+
+        case 0x1000: {
+            uint16_t from = group->PC[exec->leader] - 2;
+            BLEND(group->PC, (LaneWords){0} + nnn, words);
+            if (nnn == from) {
+                // Jump to itself, nothing changes any more this step
+                finishLanes(group, &words);
+                exec->split = true;
+            } else if (nnn == (uint16_t)(from - 4) && !(group->codeDiffers & pagesOf(nnn, 4))) {
+                // Delay timer poll, run only what keeps the loop in phase
+                const uint8_t *code = &group->memory[exec->leader][nnn & LOCKSTEP_MEMORY_MASK];
+                uint8_t vx = code[0] & 0x0F;
+                if (nnn <= LOCKSTEP_MEMORY_MASK - 3 && (code[0] & 0xF0) == 0xF0 && code[1] == 0x07
+                    && ((code[2] >> 4) == 0x3 || (code[2] >> 4) == 0x4) && (code[2] & 0x0F) == vx) {
+                    LaneWords polling = TO_WORDS(~NONZERO8(V[vx] ^ group->delayTimer)) & words;
+                    LaneWords inPhase = (group->left - 1) % 3 + 1;
+                    cutLanes(group, &inPhase, &polling);
+                    exec->split = true;
+                }
+            }
+            return 0;
+        }
+
+        case 0x2000:
+            if (sameBytes(&group->stackPointer, exec)) {
+                BLEND(group->stack[group->stackPointer[exec->leader]], group->PC, words);
+            } else {
+                for (uint32_t lanes = exec->bits; lanes; lanes &= lanes - 1) {
+                    int lane = __builtin_ctz(lanes);
+                    group->stack[group->stackPointer[lane]][lane] = group->PC[lane];
+                }
+            }
+            BLEND(group->stackPointer, group->stackPointer + 1, bytes);
+            BLEND(group->PC, (LaneWords){0} + nnn, words);
+            return leave;
+
+        case 0x3000:
+            skip = ~NONZERO8(V[x] ^ nn) & bytes;
+            skipLanes(group, exec, &skip);
+            return 0;
+
+        case 0x4000:
+            skip = NONZERO8(V[x] ^ nn) & bytes;
+            skipLanes(group, exec, &skip);
+            return 0;
+
+        case 0x5000:
+            skip = ~NONZERO8(V[x] ^ V[y]) & bytes;
+            skipLanes(group, exec, &skip);
+            return 0;
+
+        case 0x6000:
+            BLEND(V[x], (LaneBytes){0} + nn, bytes);
+            return 0;
+
+        case 0x7000:
+            BLEND(V[x], V[x] + nn, bytes);
+            return 0;
+
+        case 0x8000:
+            // Same order of reads and writes as the scalar handlers, so X or Y = F
+            // comes out the same
+            switch (n) {
+                case 0x0: BLEND(V[x], V[y], bytes); break;
+                case 0x1: BLEND(V[x], V[x] | V[y], bytes); break;
+                case 0x2: BLEND(V[x], V[x] & V[y], bytes); break;
+                case 0x3: BLEND(V[x], V[x] ^ V[y], bytes); break;
+                case 0x4: {
+                    LaneBytes sum = V[x] + V[y];
+                    LaneBytes carry = BELOW8(sum, V[x]) & 1;
+                    BLEND(V[0xF], carry, bytes);
+                    BLEND(V[x], sum, bytes);
+                    break;
+                }
+                case 0x5:
+                    BLEND(V[0xF], ~BELOW8(V[x], V[y]) & 1, bytes);
+                    BLEND(V[x], V[x] - V[y], bytes);
+                    break;
+                case 0x6:
+                    BLEND(V[0xF], V[x] & 1, bytes);
+                    BLEND(V[x], V[x] >> 1, bytes);
+                    break;
+                case 0x7:
+                    BLEND(V[0xF], ~BELOW8(V[y], V[x]) & 1, bytes);
+                    BLEND(V[x], V[y] - V[x], bytes);
+                    break;
+                case 0xE:
+                    BLEND(V[0xF], V[x] >> 7, bytes);
+                    BLEND(V[x], V[x] << 1, bytes);
+                    break;
+                default:
+                    break;
+            }
+            return 0;
+
+        case 0x9000:
+            skip = NONZERO8(V[x] ^ V[y]) & bytes;
+            skipLanes(group, exec, &skip);
+            return 0;
+
+        case 0xA000:
+            BLEND(group->I, (LaneWords){0} + nnn, words);
+            return 0;
+
+        case 0xB000:
+            exec->split = true;
+            BLEND(group->PC, __builtin_convertvector(V[0], LaneWords), words);
+            BLEND(group->PC, group->PC + nnn, words);
+            return 0;
+
+        case 0xC000: {
+            LaneRows state = group->rngState;
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            BLEND(group->rngState, state, TO_ROWS(bytes));
+            LaneBytes random = __builtin_convertvector((state * 0x2545F4914F6CDD1DULL) >> 56, LaneBytes);
+            BLEND(V[x], random & nn, bytes);
+            return 0;
+        }
+
+        case 0xD000:
+            drawLanes(group, exec, x, y, n);
+            return leave;
+
+        case 0xE000: {
+            if (nn != 0x9E && nn != 0xA1) {
+                return 0;
+            }
+            LaneWords held = (group->keys >> __builtin_convertvector(V[x], LaneWords)) & 1;
+            LaneBytes pressed = TO_BYTES(NONZERO16(held));
+            skip = (nn == 0x9E ? pressed : ~pressed) & bytes;
+            skipLanes(group, exec, &skip);
+            return leave;
+        }
+
+        case 0xF000:
+            switch (nn) {
+                case 0x07:
+                    BLEND(V[x], group->delayTimer, bytes);
+                    return 0;
+                case 0x0A: {
+                    LaneBytes waiting = TO_BYTES(~NONZERO16(group->keys)) & bytes;
+                    for (uint32_t lanes = exec->bits & ~laneBits(&waiting); lanes; lanes &= lanes - 1) {
+                        int lane = __builtin_ctz(lanes);
+                        V[x][lane] = (uint8_t)__builtin_ctz(group->keys[lane]);
+                    }
+                    // No key yet, wait on this instruction for the rest of the step
+                    LaneWords wait = TO_WORDS(waiting);
+                    BLEND(group->PC, group->PC - 2, wait);
+                    finishLanes(group, &wait);
+                    exec->split = true;
+                    return 0;
+                }
+                case 0x15:
+                    BLEND(group->delayTimer, V[x], bytes);
+                    return 0;
+                case 0x18:
+                    BLEND(group->soundTimer, V[x], bytes);
+                    return 0;
+                case 0x1E:
+                    BLEND(group->I, group->I + (__builtin_convertvector(V[x], LaneWords)), words);
+                    return 0;
+                case 0x29:
+                    BLEND(group->I, FONT_OFFSET + __builtin_convertvector(V[x] & 0xF, LaneWords) * 5, words);
+                    return 0;
+                case 0x30:
+                    BLEND(group->I, BIG_FONT_OFFSET + __builtin_convertvector(V[x] & 0xF, LaneWords) * 10, words);
+                    return 0;
+                case 0x33:
+                    for (uint32_t lanes = exec->bits; lanes; lanes &= lanes - 1) {
+                        int lane = __builtin_ctz(lanes);
+                        uint8_t value = V[x][lane];
+                        writeLane(group, lane, group->I[lane], value / 100);
+                        writeLane(group, lane, group->I[lane] + 1, (value / 10) % 10);
+                        writeLane(group, lane, group->I[lane] + 2, value % 10);
+                    }
+                    checkWrites(group, exec, 3);
+                    return leave;
+                case 0x55:
+                    for (uint32_t lanes = exec->bits; lanes; lanes &= lanes - 1) {
+                        int lane = __builtin_ctz(lanes);
+                        for (int i = 0; i <= x; i++) {
+                            writeLane(group, lane, group->I[lane] + i, V[i][lane]);
+                        }
+                    }
+                    checkWrites(group, exec, x + 1);
+                    BLEND(group->I, group->I + (uint16_t)(x + 1), words);
+                    return leave;
+                case 0x65:
+                    if (sameWords(&group->I, exec) && !(group->codeDiffers & pagesOf(group->I[exec->leader], x + 1))) {
+                        const uint8_t *memory = group->memory[exec->leader];
+                        uint16_t address = group->I[exec->leader];
+                        for (int i = 0; i <= x; i++) {
+                            BLEND(V[i], (LaneBytes){0} + memory[(address + i) & LOCKSTEP_MEMORY_MASK], bytes);
+                        }
+                    } else {
+                        for (uint32_t lanes = exec->bits; lanes; lanes &= lanes - 1) {
+                            int lane = __builtin_ctz(lanes);
+                            for (int i = 0; i <= x; i++) {
+                                V[i][lane] = group->memory[lane][(group->I[lane] + i) & LOCKSTEP_MEMORY_MASK];
+                            }
+                        }
+                    }
+                    BLEND(group->I, group->I + (uint16_t)(x + 1), words);
+                    return leave;
+            }
+    }
+    return 0;
+}
+
+// Running lane with the lowest PC
+static int lowestLane(const LockstepGroup *group, uint32_t running)
+{
+    int lowest = __builtin_ctz(running);
+    for (running &= running - 1; running; running &= running - 1) {
+        int lane = __builtin_ctz(running);
+        if (group->PC[lane] < group->PC[lowest]) {
+            lowest = lane;
+        }
+    }
+    return lowest;
+}
+
+/**
+ * Run the selected lanes, which share a PC, for up to steps instructions. They stop
+ * early as soon as they may have come apart, or once they get to or past until, where
+ * the next lanes are waiting to join them.
+ */
+static void runLanes(LockstepGroup *group, LaneSelect *exec, uint16_t steps, uint32_t until, uint32_t pending)
+{
+    exec->split = false;
+    while (steps-- > 0 && !exec->split && group->PC[exec->leader] < until) {
+        uint16_t address = group->PC[exec->leader] & LOCKSTEP_MEMORY_MASK;
+        if (address & 1) {
+            // Odd addresses only run on the interpreter
+            ejectLanes(group, exec->bits, pending);
+            return;
+        }
+        const uint8_t *code = group->memory[exec->leader];
+        uint16_t opcode = (uint16_t)((code[address] << 8) | code[(address + 1) & LOCKSTEP_MEMORY_MASK]);
+        if (group->codeDiffers & pagesOf(address, 2)) {
+            // Lanes that changed this code run it when they get their own turn
+            uint32_t same = 0;
+            for (uint32_t lanes = exec->bits; lanes; lanes &= lanes - 1) {
+                int lane = __builtin_ctz(lanes);
+                const uint8_t *memory = group->memory[lane];
+                if (memory[address] == code[address]
+                    && memory[(address + 1) & LOCKSTEP_MEMORY_MASK] == code[(address + 1) & LOCKSTEP_MEMORY_MASK]) {
+                    same |= 1u << lane;
+                }
+            }
+            if (same != exec->bits) {
+                selectLanes(exec, same);
+                exec->split = true;
+            }
+        }
+
+        BLEND(group->PC, group->PC + 2, exec->words);
+        uint32_t leave = executeLanes(group, opcode, exec);
+        if (leave) {
+            LaneBytes lanes;
+            bitsToBytes(&lanes, leave);
+            LaneWords back = TO_WORDS(lanes);
+            BLEND(group->PC, group->PC - 2, back);
+            ejectLanes(group, leave, pending);
+            if (exec->bits & leave) {
+                selectLanes(exec, exec->bits & ~leave);
+            }
+            exec->split = true;
+        }
+        group->left -= exec->words & 1;
+    }
+}
+
+/**
+ * Run n instructions on every active lane. Lanes at the lowest PC go first, which
+ * lets lanes that fell behind on a branch catch up with the rest, and lanes sharing
+ * a PC run on without comparing lanes after each instruction.
+ */
+static void runChunk(LockstepGroup *group, uint16_t n, uint32_t pending)
+{
+    LaneBytes lanes;
+    bitsToBytes(&lanes, n ? group->active : 0);
+    group->left = ((LaneWords){0} + n) & TO_WORDS(lanes);
+
+    for (;;) {
+        LaneWords running = NONZERO16(group->left);
+        lanes = TO_BYTES(running);
+        uint32_t bits = laneBits(&lanes);
+        if (!bits) {
+            break;
+        }
+
+        LaneSelect exec;
+        uint16_t pc = group->PC[lowestLane(group, bits)];
+        lanes = TO_BYTES(~NONZERO16(group->PC ^ pc) & running);
+        selectLanes(&exec, laneBits(&lanes));
+
+        uint32_t until = UINT16_MAX + 1;
+        for (uint32_t rest = bits & ~exec.bits; rest; rest &= rest - 1) {
+            uint16_t other = group->PC[__builtin_ctz(rest)];
+            until = other < until ? other : until;
+        }
+        uint16_t steps = UINT16_MAX;
+        for (uint32_t here = exec.bits; here; here &= here - 1) {
+            uint16_t left = group->left[__builtin_ctz(here)];
+            steps = left < steps ? left : steps;
+        }
+        runLanes(group, &exec, steps, until, pending);
+    }
+}
+
+/**
+ * Execute n instructions on every lane, like cpuStep on each CPU
+ *
+ * @return Number of instructions actually executed, summed over all lanes
+ */
+uint64_t lockstepStep(LockstepGroup *group, uint32_t n)
+{
+    uint32_t all = group->count == LOCKSTEP_LANES ? UINT32_MAX : (1u << group->count) - 1;
+    uint64_t executed = (uint64_t)n * (uint32_t)__builtin_popcount(group->active);
+
+    for (uint32_t bits = all & ~group->active; bits; bits &= bits - 1) {
+        executed += cpuStep(group->cpus[__builtin_ctz(bits)], n);
+    }
+    group->skipped = 0;
+    do {
+        uint16_t chunk = n > LOCKSTEP_CHUNK ? LOCKSTEP_CHUNK : (uint16_t)n;
+        n -= chunk;
+        runChunk(group, chunk, n);
+    } while (n > 0);
+    return executed - group->skipped;
+}
+
+/**
+ * One 60Hz frame on every lane, like cpuRunFrame on each CPU
+ *
+ * @return Number of instructions actually executed, summed over all lanes
+ */
+uint64_t lockstepRunFrame(LockstepGroup *group, uint32_t cyclesPerFrame)
+{
+    uint32_t all = group->count == LOCKSTEP_LANES ? UINT32_MAX : (1u << group->count) - 1;
+    uint32_t scalar = all & ~group->active;
+    uint64_t executed = (uint64_t)cyclesPerFrame * (uint32_t)__builtin_popcount(group->active);
+
+    for (uint32_t bits = scalar; bits; bits &= bits - 1) {
+        executed += cpuRunFrame(group->cpus[__builtin_ctz(bits)], cyclesPerFrame);
+    }
+    // Lanes leaving during this frame still need their tick
+    uint32_t before = group->active;
+    group->skipped = 0;
+    do {
+        uint16_t chunk = cyclesPerFrame > LOCKSTEP_CHUNK ? LOCKSTEP_CHUNK : (uint16_t)cyclesPerFrame;
+        cyclesPerFrame -= chunk;
+        runChunk(group, chunk, cyclesPerFrame);
+    } while (cyclesPerFrame > 0);
+    for (uint32_t bits = before & ~group->active; bits; bits &= bits - 1) {
+        cpuTickTimers(group->cpus[__builtin_ctz(bits)]);
+    }
+
+    group->delayTimer -= NONZERO8(group->delayTimer) & 1;
+    group->soundTimer -= NONZERO8(group->soundTimer) & 1;
+    return executed - group->skipped;
+}
@@ -0,0 +1,62 @@
+//
+// Lockstep execution of many instances of the same ROM: register state is kept in
+// structure-of-arrays form and every instruction runs on all lanes that agree on PC
+// at once, in SIMD where the target has it
+//
+
+#ifndef CHIP8_LOCKSTEP_H
+#define CHIP8_LOCKSTEP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "ChipCPU.h"
+
+#define LOCKSTEP_LANES 32
+
+// One value per lane. Generic vectors compile to AVX2 or SSE2 where available and
+// to plain scalar code elsewhere.
+typedef uint8_t LaneBytes __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef uint16_t LaneWords __attribute__((vector_size(LOCKSTEP_LANES * 2)));
+typedef uint64_t LaneRows __attribute__((vector_size(LOCKSTEP_LANES * 8)));
+
+/**
+ * Up to LOCKSTEP_LANES CPUs stepped together. Between lockstepLoad and lockstepStore
+ * the group owns the CPUs: registers, timers, keys, the RNG and the lores display
+ * live here, memory stays in each CPU and is accessed in place.
+ *
+ * Only classic CHIP-8 runs in lockstep (lores, 4 KiB, the modern quirks profile).
+ * A lane reaching anything else is handed back to its CPU and runs on the scalar
+ * interpreter from then on, so results never depend on how a lane was run.
+ */
+typedef struct LockstepGroup {
+    LaneBytes V[V_REGISTER_COUNT];
+    LaneWords I;
+    LaneWords PC;
+    LaneWords stack[STACK_DEPTH];
+    LaneBytes stackPointer;
+    LaneBytes delayTimer;
+    LaneBytes soundTimer;
+    LaneWords keys;                    // Held keys, bit n is key n
+    LaneRows rngState;
+    LaneRows display[DISPLAY_HEIGHT];  // Row y of every lane's plane 0, side by side
+    LaneBytes drew;                    // Lanes that drew since the last store
+    LaneWords left;                    // Instructions left in the current chunk of a step
+    uint64_t skipped;                  // Instructions the idle fast-forward saved this step
+    uint8_t *memory[LOCKSTEP_LANES];   // Each lane's own CPU memory
+    uint16_t written[LOCKSTEP_LANES];  // Memory pages each lane wrote since the load
+    uint16_t codeDiffers;              // Pages where lanes' memory may differ
+    ChipCPU *cpus[LOCKSTEP_LANES];
+    uint32_t count;                    // Lanes in use
+    uint32_t active;                   // Lanes still run in lockstep, bit n is lane n
+} LockstepGroup;
+
+LockstepGroup *lockstepCreate(void);
+void lockstepDestroy(LockstepGroup *group);
+void lockstepLoad(LockstepGroup *group, ChipCPU *const *cpus, uint32_t count);
+void lockstepStore(LockstepGroup *group);
+void lockstepSetKeyMask(LockstepGroup *group, uint32_t lane, uint16_t mask);
+uint64_t lockstepStep(LockstepGroup *group, uint32_t n);
+uint64_t lockstepRunFrame(LockstepGroup *group, uint32_t cyclesPerFrame);
+uint32_t lockstepActiveLanes(const LockstepGroup *group);
+
+#endif //CHIP8_LOCKSTEP_H
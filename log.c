@@ -0,0 +1,228 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "log.h"
+//
+// Each producing thread owns one single-producer/single-consumer ring, so logging
+// never takes a lock. The drainer is the only consumer and only sleeps on a condition
+// variable once every ring is empty; producers just check a flag to wake it.
+//
+
+typedef struct LogEntry {
+    uint8_t level;
+    uint32_t suppressed;
+    char text[LOG_MESSAGE_SIZE];
+} LogEntry;
+
+typedef struct LogRing {
+    LogEntry entries[LOG_RING_SIZE];
+    _Atomic uint32_t head;  // Next slot to write, only advanced by the owning thread
+    _Atomic uint32_t tail;  // Next slot to print, only advanced by the drainer
+    struct LogRing *next;
+} LogRing;
+
+_Atomic int logRuntimeLevel = LOG_LEVEL_INFO;
+
+static const char *levelNames[] = { "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "OFF" };
+
+static _Atomic(LogRing *) rings = NULL;
+static _Thread_local LogRing *threadRing = NULL;
+static _Atomic uint64_t dropped = 0;
+static _Atomic bool drainerSleeping = false;
+static bool drainerRunning = false;
+
+static pthread_once_t startOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t drainLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t wakeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+
+void logSetLevel(int level)
+{
+    atomic_store(&logRuntimeLevel, level);
+}
+
+/**
+ * Level for a name such as "warn", or a number
+ *
+ * @return -1 if the name is not a level
+ */
+int logParseLevel(const char *name)
+{
+    for (int level = LOG_LEVEL_TRACE; level <= LOG_LEVEL_OFF; level++) {
+        if (strcasecmp(name, levelNames[level]) == 0) {
+            return level;
+        }
+    }
+    if (name[0] >= '0' && name[0] <= '0' + LOG_LEVEL_OFF && name[1] == '\0') {
+        return name[0] - '0';
+    }
+    return -1;
+}
+
+uint64_t logDropped(void)
+{
+    return atomic_load(&dropped);
+}
+
+static bool ringPending(LogRing *ring)
+{
+    return atomic_load_explicit(&ring->head, memory_order_acquire)
+           != atomic_load_explicit(&ring->tail, memory_order_relaxed);
+}
+
+static bool anyPending(void)
+{
+    for (LogRing *ring = atomic_load(&rings); ring; ring = ring->next) {
+        if (ringPending(ring)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void drainRing(LogRing *ring)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    for (; tail != head; tail++) {
+        const LogEntry *entry = &ring->entries[tail & (LOG_RING_SIZE - 1)];
+        if (entry->suppressed) {
+            fprintf(stderr, "[%s] %s (%u similar messages suppressed)\n", levelNames[entry->level], entry->text,
+                    entry->suppressed);
+        } else {
+            fprintf(stderr, "[%s] %s\n", levelNames[entry->level], entry->text);
+        }
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+}
+
+/**
+ * Print everything buffered so far. Safe to call from any thread.
+ */
+void logFlush(void)
+{
+    pthread_mutex_lock(&drainLock);
+    for (LogRing *ring = atomic_load(&rings); ring; ring = ring->next) {
+        drainRing(ring);
+    }
+    fflush(stderr);
+    pthread_mutex_unlock(&drainLock);
+}
+
+static void *drainerMain(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        logFlush();
+
+        pthread_mutex_lock(&wakeLock);
+        atomic_store(&drainerSleeping, true);
+        atomic_thread_fence(memory_order_seq_cst);
+        // Checked after raising the flag, a producer that missed it will signal
+        if (!anyPending()) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&wake, &wakeLock, &deadline);
+        }
+        atomic_store(&drainerSleeping, false);
+        pthread_mutex_unlock(&wakeLock);
+    }
+    return NULL;
+}
+
+static void startDrainer(void)
+{
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, drainerMain, NULL) == 0) {
+        pthread_detach(thread);
+        drainerRunning = true;
+    }
+    atexit(logFlush);
+}
+
+static LogRing *attachRing(void)
+{
+    pthread_once(&startOnce, startDrainer);
+
+    LogRing *ring = calloc(1, sizeof(LogRing));
+    if (!ring) {
+        return NULL;
+    }
+    // Rings are never unlinked, the drainer can walk the list without locking
+    ring->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &ring->next, ring)) {
+    }
+    threadRing = ring;
+    return ring;
+}
+
+/**
+ * Let at most LOG_RATE_LIMIT messages per second through a call site
+ *
+ * @param suppressed Set to how many were held back since the last one let through
+ */
+static bool rateLimit(LogSite *site, uint32_t *suppressed)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t second = (uint64_t)now.tv_sec;
+
+    uint64_t window = atomic_load_explicit(&site->window, memory_order_relaxed);
+    if (window != second && atomic_compare_exchange_strong(&site->window, &window, second)) {
+        atomic_store_explicit(&site->count, 0, memory_order_relaxed);
+    }
+    if (atomic_fetch_add_explicit(&site->count, 1, memory_order_relaxed) >= LOG_RATE_LIMIT) {
+        atomic_fetch_add_explicit(&site->suppressed, 1, memory_order_relaxed);
+        return false;
+    }
+    *suppressed = atomic_exchange_explicit(&site->suppressed, 0, memory_order_relaxed);
+    return true;
+}
+
+/**
+ * Queue a message, use the LOG_* macros rather than calling this directly.
+ * Messages are dropped, not waited for, when this thread's ring is full.
+ */
+void logWrite(int level, LogSite *site, const char *format, ...)
+{
+    uint32_t suppressed;
+    if (!rateLimit(site, &suppressed)) {
+        return;
+    }
+
+    LogRing *ring = threadRing ? threadRing : attachRing();
+    if (!ring) {
+        atomic_fetch_add(&dropped, 1);
+        return;
+    }
+
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == LOG_RING_SIZE) {
+        atomic_fetch_add(&dropped, 1);
+        return;
+    }
+
+    LogEntry *entry = &ring->entries[head & (LOG_RING_SIZE - 1)];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(entry->text, sizeof(entry->text), format, args);
+    va_end(args);
+    entry->level = (uint8_t)level;
+    entry->suppressed = suppressed;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (!drainerRunning) {
+        logFlush();
+    } else if (atomic_load(&drainerSleeping)) {
+        pthread_mutex_lock(&wakeLock);
+        pthread_cond_signal(&wake);
+        pthread_mutex_unlock(&wakeLock);
+    }
+}
@@ -0,0 +1,63 @@
+//
+// Leveled diagnostics. Messages are formatted by the caller into a per-thread
+// lock-free ring and written to stderr by a background thread, so the emulation
+// loop never blocks on terminal I/O.
+//
+
+#ifndef CHIP8_LOG_H
+#define CHIP8_LOG_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_WARN  3
+#define LOG_LEVEL_ERROR 4
+#define LOG_LEVEL_OFF   5
+
+// Anything below this is compiled out entirely
+#ifndef CHIP8_LOG_LEVEL
+#define CHIP8_LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_RING_SIZE 256       // Messages buffered per producing thread, power of two
+#define LOG_MESSAGE_SIZE 120
+#define LOG_RATE_LIMIT 10       // Messages per call site per second before suppressing
+
+/**
+ * Per call-site state for rate limiting, one static instance per LOG_* use
+ */
+typedef struct LogSite {
+    _Atomic uint64_t window;      // Second the current count belongs to
+    _Atomic uint32_t count;
+    _Atomic uint32_t suppressed;
+} LogSite;
+
+extern _Atomic int logRuntimeLevel;
+
+void logSetLevel(int level);
+int logParseLevel(const char *name);
+void logWrite(int level, LogSite *site, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+void logFlush(void);
+uint64_t logDropped(void);
+
+#define LOG_AT(level, ...) \
+    do { \
+        if ((level) >= CHIP8_LOG_LEVEL \
+            && (level) >= atomic_load_explicit(&logRuntimeLevel, memory_order_relaxed)) { \
+            static LogSite logSite_; \
+            logWrite((level), &logSite_, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...)  LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...)  LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#endif //CHIP8_LOG_H
@@ -1,56 +1,87 @@
+#include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <SDL.h>
 #include "ChipCPU.h"
+#include "log.h"
+#include "native.h"
+#include "pipeline.h"
+#include "profile.h"
 #include "renderer.h"
+#include "replay.h"
+#include "romcache.h"
+#include "savestate.h"
+#include "scheduler.h"
 
+// CHIP-8 typically runs at 500-700Hz, 700Hz / 60Hz frames
+#define DEFAULT_CYCLES_PER_FRAME 11
+// Seconds of history kept for rewinding
+#define REWIND_SECONDS 10
+// Longest sleep while the ROM waits for input, bounds how late a profile dump can be
+#define IDLE_WAIT_MS 250
 
-bool load_rom(ChipCPU *cpu, const char *filename) {
-    FILE *rom = fopen(filename, "rb");
-    if (!rom) {
-        printf("Error: Could not open ROM file: %s\n", filename);
-        return false;
-    }
+static char statePath[4096];
+// Set while a session is being recorded, rewinding and state loads are disabled then.
+// Only touched by the emulation thread.
+static Recording *activeRecording = NULL;
+// Raised by SIGUSR1 to dump the profile without stopping the emulator
+static volatile sig_atomic_t profileDumpRequested = 0;
 
-    // Get file size
-    fseek(rom, 0, SEEK_END);
-    long rom_size = ftell(rom);
-    rewind(rom);
 
-    // Check if ROM fits in memory
-    if (rom_size > (MEMORY_SIZE - PROGRAM_OFFSET)) {
-        printf("Error: ROM too large to fit in memory\n");
-        fclose(rom);
+/**
+ * Start cpu on a ROM through the ROM cache: the file is mapped and hashed, and the
+ * CPU is copied from the cached post-init template
+ */
+bool load_rom(ChipCPU *cpu, const char *filename, uint64_t seed, uint64_t *romHash) {
+    static RomCache cache;
+    const RomImage *image = romCacheOpen(&cache, filename);
+    if (!image) {
+        printf("Error: Could not load ROM file: %s\n", filename);
         return false;
     }
 
-    // Load ROM into memory starting at PROGRAM_OFFSET (0x200)
-    size_t bytes_read = fread(&cpu->memory[PROGRAM_OFFSET], 1, rom_size, rom);
-
-    if (bytes_read != rom_size) {
-        printf("Error: Failed to read entire ROM\n");
-        fclose(rom);
+    if (!romCacheInstantiate(image, cpu, seed)) {
+        printf("Error: Out of memory for ROM file: %s\n", filename);
         return false;
     }
-
-    printf("Loaded %ld bytes into memory\n", rom_size);
-    fclose(rom);
+    *romHash = image->hash;
+    printf("Loaded %zu bytes into memory\n", image->size);
     return true;
 }
 
-// Fetch the next opcode from memory
-uint16_t fetch(ChipCPU *cpu) {
-    // CHIP-8 opcodes are 2 bytes, stored big-endian
-    uint16_t opcode = (cpu->memory[cpu->PC] << 8) | cpu->memory[cpu->PC + 1];
-    return opcode;
-}
+typedef struct EmulatorOptions {
+    uint32_t cyclesPerFrame;  // Instructions executed per 60Hz frame
+    bool turbo;               // Run frames back to back instead of at 60Hz
+    uint64_t seed;            // RNG seed the CPU was initialised with
+    uint64_t romHash;         // Hash of the loaded ROM image
+    ChipQuirks quirks;        // Opcode behaviour profile the ROM was written for
+    const char *recordPath;   // Record the session's input here when set
+    const char *profilePath;  // Collect instrumentation and dump it here when set
+} EmulatorOptions;
 
-// Update timers (should be called at 60Hz)
-void update_timers(ChipCPU *cpu) {
-    if (cpu->delayTimer > 0) {
-        cpu->delayTimer--;
-    }
-}
+/**
+ * State shared by the main thread, which owns SDL events and rendering, and the
+ * emulation thread, which owns the CPU. Everything crossing over is atomic or goes
+ * through the frame mailbox, so neither thread ever blocks on the other.
+ */
+typedef struct Pipeline {
+    ChipCPU *cpu;
+    const EmulatorOptions *options;
+    FrameMailbox mailbox;       // Finished frames, emulation -> render
+    KeyState keys;              // Held CHIP-8 keys, events -> emulation
+    SDL_atomic_t running;
+    SDL_atomic_t rewindHeld;
+    SDL_atomic_t fastForward;
+    SDL_atomic_t saveRequested;
+    SDL_atomic_t loadRequested;
+    SDL_atomic_t framePosted;   // A frame event is queued and not handled yet
+    Uint32 frameEvent;          // User event type that wakes the main thread for a frame
+    SDL_sem *wake;              // Posted on input, cuts the emulation thread's sleep short
+} Pipeline;
 
 /**
  * Handle SDL keyboard input and map to CHIP-8 keys
@@ -60,13 +91,38 @@ void update_timers(ChipCPU *cpu) {
  * 4 5 6 D               Q W E R
  * 7 8 9 E               A S D F
  * A 0 B F               Z X C V
+ *
+ * Backspace (hold) rewinds, Tab (hold) fast-forwards, F5 saves a state next to the
+ * ROM, F9 loads it. Runs on the main thread, the emulation thread picks everything
+ * up at its next frame.
  */
-void handle_input(ChipCPU *cpu, SDL_Event *event)
+void handle_input(Pipeline *pipeline, SDL_Event *event)
 {
     // Map of SDL keys to CHIP-8 key indices
     int key = -1;
 
     if (event->type == SDL_KEYDOWN || event->type == SDL_KEYUP) {
+        bool down = event->type == SDL_KEYDOWN;
+
+        switch (event->key.keysym.sym) {
+            case SDLK_BACKSPACE:
+                SDL_AtomicSet(&pipeline->rewindHeld, down);
+                break;
+            case SDLK_TAB:
+                SDL_AtomicSet(&pipeline->fastForward, down);
+                break;
+            case SDLK_F5:
+                if (down) {
+                    SDL_AtomicSet(&pipeline->saveRequested, 1);
+                }
+                break;
+            case SDLK_F9:
+                if (down) {
+                    SDL_AtomicSet(&pipeline->loadRequested, 1);
+                }
+                break;
+        }
+
         switch (event->key.keysym.sym) {
             case SDLK_1: key = 0x1; break;
             case SDLK_2: key = 0x2; break;
@@ -91,77 +147,394 @@ void handle_input(ChipCPU *cpu, SDL_Event *event)
 
         // Update key state
         if (key != -1) {
-            if (event->type == SDL_KEYDOWN) {
-                cpu->keys[key] = 1;
-            } else {
-                cpu->keys[key] = 0;
+            keyStateSet(&pipeline->keys, key, down);
+        }
+        SDL_SemPost(pipeline->wake);
+    }
+}
+
+static void request_profile_dump(int signal)
+{
+    (void)signal;
+    profileDumpRequested = 1;
+}
+
+/**
+ * Charge the wall time since *mark to a profile phase and move the mark to now
+ */
+static void profile_phase(ChipCPU *cpu, ProfilePhase phase, Uint64 *mark)
+{
+#ifdef CHIP8_PROFILE
+    if (cpu->profile) {
+        Uint64 now = SDL_GetPerformanceCounter();
+        uint64_t ns = (uint64_t)((double)(now - *mark) * 1e9 / (double)SDL_GetPerformanceFrequency());
+        atomic_fetch_add_explicit(&cpu->profile->phaseNs[phase], ns, memory_order_relaxed);
+        *mark = now;
+    }
+#else
+    (void)cpu;
+    (void)phase;
+    (void)mark;
+#endif
+}
+
+/**
+ * Emulate one frame, or step one frame back in time while rewind is held. Rewind
+ * is ignored while recording so the recording stays replayable.
+ *
+ * @return Whether the ROM ended the frame idling, see ChipIdle
+ */
+ChipIdle emulate_frame(Pipeline *pipeline, RewindBuffer *history)
+{
+    ChipCPU *cpu = pipeline->cpu;
+
+    if (SDL_AtomicGet(&pipeline->rewindHeld) && !activeRecording) {
+        rewindPop(history, cpu);
+        // Keep the keys that are physically held right now
+        cpuSetKeyMask(cpu, keyStateGet(&pipeline->keys));
+        return CHIP_IDLE_NONE;
+    }
+    cpuSetKeyMask(cpu, keyStateGet(&pipeline->keys));
+    rewindPush(history, cpu);
+    if (activeRecording) {
+        recordingFrame(activeRecording, cpu);
+    }
+    cpuRunFrame(cpu, pipeline->options->cyclesPerFrame);
+    return cpu->idle;
+}
+
+/**
+ * True when nothing can happen until a key event: the ROM is blocked on FX0A or
+ * halted, and no timer is left to count down
+ */
+static bool waiting_on_input(const ChipCPU *cpu, ChipIdle idle)
+{
+    return (idle == CHIP_IDLE_KEY || idle == CHIP_IDLE_HALT) && cpu->delayTimer == 0 && cpu->soundTimer == 0;
+}
+
+/**
+ * Hand the display to the render thread if it changed, and the sound timer to the
+ * audio thread. Only one frame event is kept in flight, the render thread always
+ * takes the newest frame anyway.
+ */
+static void publish_frame(Pipeline *pipeline)
+{
+    ChipCPU *cpu = pipeline->cpu;
+
+    if (cpu->drawFlag) {
+        VideoFrame *frame = mailboxBack(&pipeline->mailbox);
+        frame->display = cpu->display;
+        frame->hires = cpu->hires;
+        mailboxPublish(&pipeline->mailbox);
+        cpu->drawFlag = 0;
+
+        if (SDL_AtomicCAS(&pipeline->framePosted, 0, 1)) {
+            SDL_Event event;
+            SDL_zero(event);
+            event.type = pipeline->frameEvent;
+            SDL_PushEvent(&event);
+        }
+    }
+    rndr_play_audio(cpu->soundTimer);
+}
+
+/**
+ * Save and load requests are served between frames, where the CPU is consistent
+ *
+ * @return Whether the CPU state was replaced
+ */
+static bool serve_state_requests(Pipeline *pipeline)
+{
+    ChipCPU *cpu = pipeline->cpu;
+
+    if (SDL_AtomicSet(&pipeline->saveRequested, 0) && stateSaveFile(cpu, statePath)) {
+        printf("Saved state to %s\n", statePath);
+    }
+    if (SDL_AtomicSet(&pipeline->loadRequested, 0)) {
+        if (activeRecording) {
+            printf("Loading states is disabled while recording\n");
+        } else if (stateLoadFile(cpu, statePath)) {
+            printf("Loaded state from %s\n", statePath);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Emulation thread: runs frames on the 60Hz clock and publishes them, never waits
+ * for the display. Between frames it sleeps on the wake semaphore so input still
+ * gets a response within the frame.
+ */
+static int emulation_thread(void *data)
+{
+    Pipeline *pipeline = data;
+    ChipCPU *cpu = pipeline->cpu;
+    const EmulatorOptions *options = pipeline->options;
+    ChipIdle idle = CHIP_IDLE_NONE;
+
+    const Uint64 frequency = SDL_GetPerformanceFrequency();
+    FrameScheduler sched;
+    schedInit(&sched, SDL_GetPerformanceCounter(), frequency, MAX_CATCH_UP_FRAMES);
+
+    static RewindBuffer history;
+    if (!rewindInit(&history, REWIND_SECONDS * FRAME_HZ)) {
+        printf("Error: Could not allocate rewind buffer\n");
+    }
+
+    static Recording recording;
+    if (options->recordPath) {
+        recordingInit(&recording, options->seed, options->romHash, options->cyclesPerFrame, options->quirks);
+        activeRecording = &recording;
+    }
+
+    // Show the initial screen before the first frame changes anything
+    cpu->drawFlag = 1;
+    publish_frame(pipeline);
+    Uint64 mark = SDL_GetPerformanceCounter();
+
+    while (SDL_AtomicGet(&pipeline->running)) {
+        if (profileDumpRequested) {
+            profileDumpRequested = 0;
+            profileSave(cpu->profile, options->profilePath);
+        }
+        if (serve_state_requests(pipeline)) {
+            idle = CHIP_IDLE_NONE;
+            publish_frame(pipeline);
+        }
+
+        Uint64 now = SDL_GetPerformanceCounter();
+        uint32_t frames;
+        profile_phase(cpu, PROFILE_IDLE, &mark);
+
+        if (options->turbo || SDL_AtomicGet(&pipeline->fastForward)) {
+            // Emulate for one frame's worth of wall time, then publish once. A ROM
+            // waiting for input would only spin, so the slice ends early then.
+            Uint64 sliceEnd = now + sched.frameTicks;
+            frames = 0;
+            do {
+                idle = emulate_frame(pipeline, &history);
+                frames++;
+            } while (!waiting_on_input(cpu, idle) && SDL_GetPerformanceCounter() < sliceEnd);
+            schedResync(&sched, SDL_GetPerformanceCounter());
+        } else {
+            frames = schedFramesDue(&sched, now);
+            for (uint32_t i = 0; i < frames; i++) {
+                idle = emulate_frame(pipeline, &history);
             }
         }
+
+        profile_phase(cpu, PROFILE_EMULATE, &mark);
+
+        if (frames > 0) {
+            publish_frame(pipeline);
+            continue;
+        }
+
+        if (waiting_on_input(cpu, idle) && !SDL_AtomicGet(&pipeline->rewindHeld)) {
+            // Frames would change nothing, so sleep until input arrives instead of
+            // running them, then pick up the frame clock from there
+            SDL_SemWaitTimeout(pipeline->wake, IDLE_WAIT_MS);
+            schedResync(&sched, SDL_GetPerformanceCounter());
+            idle = CHIP_IDLE_NONE;
+            continue;
+        }
+
+        // Sleep until shortly before the next frame is due, a key event ends it early
+        Uint64 waitMs = schedTicksUntilNextFrame(&sched, now) * 1000 / frequency;
+        if (waitMs > 1) {
+            SDL_SemWaitTimeout(pipeline->wake, (Uint32)(waitMs - 1));
+        }
     }
+
+    rewindFree(&history);
+    if (activeRecording) {
+        if (recordingSave(activeRecording, options->recordPath)) {
+            printf("Recorded %u frames to %s\n", activeRecording->frameCount, options->recordPath);
+        }
+        recordingFree(activeRecording);
+        activeRecording = NULL;
+    }
+    return 0;
 }
 
-void runEmulation(ChipCPU *cpu) {
-    // CPU cycle timing
-    const int CYCLES_PER_SECOND = 700;  // CHIP-8 typically runs at 500-700Hz
-    const int TIMER_HZ = 60;            // Timers update at 60Hz
+/**
+ * Start the emulation thread and run the event and render loop on this (main)
+ * thread, as SDL requires. A slow present only delays the picture; the emulation
+ * keeps its own clock and the render side just picks up the newest frame.
+ *
+ * @return false if the emulation thread could not be started
+ */
+bool runEmulation(ChipCPU *cpu, const EmulatorOptions *options) {
     rndr_startupBeep();
 
     rndr_initialize_graphics();
 
-    int cycles = 0;
-    SDL_bool loop = SDL_TRUE;
+    static Pipeline pipeline;
+    pipeline.cpu = cpu;
+    pipeline.options = options;
+    mailboxInit(&pipeline.mailbox);
+    SDL_AtomicSet(&pipeline.keys.mask, cpuGetKeyMask(cpu));
+    SDL_AtomicSet(&pipeline.running, 1);
+    pipeline.wake = SDL_CreateSemaphore(0);
+    pipeline.frameEvent = SDL_RegisterEvents(1);
+    if (pipeline.frameEvent == (Uint32)-1) {
+        pipeline.frameEvent = SDL_USEREVENT;
+    }
+
+    static ChipProfile profile;
+    if (options->profilePath) {
+        profileReset(&profile);
+        cpu->profile = &profile;
+#ifdef SIGUSR1
+        signal(SIGUSR1, request_profile_dump);
+#endif
+    }
+
+    SDL_Thread *emulation = SDL_CreateThread(emulation_thread, "emulation", &pipeline);
+    if (!emulation) {
+        printf("Error: Could not start the emulation thread: %s\n", SDL_GetError());
+        SDL_DestroySemaphore(pipeline.wake);
+        cpu->profile = NULL;
+        rndr_destroy();
+        return false;
+    }
+
     SDL_Event event;
+    int presentWaitMs = -1;
 
-    while (loop) {
-        // Fetch
-        while (SDL_PollEvent(&event)) {
+    while (SDL_AtomicGet(&pipeline.running)) {
+        // Sleep until input or a frame arrives, or until a deferred present is due
+        int got = presentWaitMs >= 0 ? SDL_WaitEventTimeout(&event, presentWaitMs) : SDL_WaitEvent(&event);
+        while (got) {
             if (event.type == SDL_QUIT) {
-                loop = SDL_FALSE;
-            } else if (event.type == SDL_KEYDOWN) {
-                if (event.key.keysym.sym == SDLK_ESCAPE) {
-                    loop = SDL_FALSE;
-                }
+                SDL_AtomicSet(&pipeline.running, 0);
+            } else if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE) {
+                SDL_AtomicSet(&pipeline.running, 0);
+            } else if (event.type == pipeline.frameEvent) {
+                // Cleared before taking the frame, so a newer one posts a new event
+                SDL_AtomicSet(&pipeline.framePosted, 0);
             }
-            handle_input(cpu, &event);
+            handle_input(&pipeline, &event);
+            got = SDL_PollEvent(&event);
         }
 
-        uint16_t opcode = fetch(cpu);
-
-        // Increment PC before decode (most instructions will use this)
-        cpu->PC += 2;
+        Uint64 mark = SDL_GetPerformanceCounter();
+        const VideoFrame *frame = mailboxAcquire(&pipeline.mailbox);
+        presentWaitMs = frame ? rndr_update_screen(&frame->display, frame->hires) : rndr_update_screen(NULL, false);
+        profile_phase(cpu, PROFILE_RENDER, &mark);
+    }
 
-        // Decode & Execute
-        decodeOperation(opcode, cpu);
+    SDL_SemPost(pipeline.wake);
+    SDL_WaitThread(emulation, NULL);
+    SDL_DestroySemaphore(pipeline.wake);
 
-        // Update timers at 60Hz (every ~12 cycles if running at 700Hz)
-        cycles++;
-        if (cycles >= (CYCLES_PER_SECOND / TIMER_HZ)) {
-            update_timers(cpu);
-            cycles = 0;
+    if (cpu->profile) {
+        if (profileSave(cpu->profile, options->profilePath)) {
+            printf("Wrote profile to %s\n", options->profilePath);
         }
-
-        rndr_update_screen(cpu);
-        rndr_play_audio(cpu);
-        // Simple delay to control emulation speed
-        SDL_Delay(1);
+        cpu->profile = NULL;
     }
     rndr_destroy();
-
+    return true;
 }
 
 int main(int argc, char *argv[]) {
     if (argc < 2) {
-        printf("Error: Missing Argument: ./<rom_file>\n");
+        printf("Error: Missing Argument: ./<rom_file> [--engine=interpreter|block] [--native=FILE.so] [--quirks=modern|vip|chip48|schip] [--ipf=N] [--seed=N] [--turbo] [--record=FILE] [--filter=LIST] [--profile=FILE.json|FILE.csv] [--log=trace|debug|info|warn|error|off]\n");
         return 1;
     }
 
-    ChipCPU cpu;
-    cpuInit(&cpu);
+    static ChipCPU cpu;
+    ChipEngine engine = CHIP_ENGINE_INTERPRETER;
+    const char *nativePath = NULL;
+
+    EmulatorOptions options = {
+        .cyclesPerFrame = DEFAULT_CYCLES_PER_FRAME,
+        .turbo = false,
+        .seed = (uint64_t)time(NULL),
+        .quirks = CHIP_QUIRKS_MODERN,
+        .recordPath = NULL,
+        .profilePath = NULL,
+    };
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--engine=block") == 0) {
+            engine = CHIP_ENGINE_BLOCK;
+        } else if (strcmp(argv[i], "--engine=interpreter") == 0) {
+            engine = CHIP_ENGINE_INTERPRETER;
+        } else if (strncmp(argv[i], "--native=", 9) == 0) {
+            nativePath = argv[i] + 9;
+        } else if (strncmp(argv[i], "--quirks=", 9) == 0) {
+            int quirks = cpuParseQuirks(argv[i] + 9);
+            if (quirks < 0) {
+                printf("Error: Unknown quirks profile: %s\n", argv[i] + 9);
+                return 1;
+            }
+            options.quirks = (ChipQuirks)quirks;
+        } else if (strncmp(argv[i], "--ipf=", 6) == 0) {
+            char *end;
+            unsigned long ipf = strtoul(argv[i] + 6, &end, 10);
+            if (end == argv[i] + 6 || *end != '\0' || ipf == 0 || ipf > UINT32_MAX) {
+                printf("Error: Instructions per frame must be a positive number: %s\n", argv[i] + 6);
+                return 1;
+            }
+            options.cyclesPerFrame = (uint32_t)ipf;
+        } else if (strncmp(argv[i], "--seed=", 7) == 0) {
+            // strtoull would skip spaces and take a sign, wrapping -1 around
+            const char *digits = argv[i] + 7;
+            char *end;
+            errno = 0;
+            unsigned long long seed = strtoull(digits, &end, 10);
+            if (*digits < '0' || *digits > '9' || *end != '\0' || errno == ERANGE) {
+                printf("Error: Seed must be a number from 0 to %llu: %s\n", (unsigned long long)UINT64_MAX, digits);
+                return 1;
+            }
+            options.seed = (uint64_t)seed;
+        } else if (strcmp(argv[i], "--turbo") == 0) {
+            options.turbo = true;
+        } else if (strncmp(argv[i], "--record=", 9) == 0) {
+            options.recordPath = argv[i] + 9;
+        } else if (strncmp(argv[i], "--filter=", 9) == 0) {
+            // e.g. scale2x,nearest:5,scanlines or phosphor:4, see filterChainParse
+            if (!rndr_set_filters(argv[i] + 9)) {
+                printf("Error: Invalid display filters: %s\n", argv[i] + 9);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--log=", 6) == 0) {
+            int level = logParseLevel(argv[i] + 6);
+            if (level < 0) {
+                printf("Error: Unknown log level: %s\n", argv[i] + 6);
+                return 1;
+            }
+            logSetLevel(level);
+        } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+#ifdef CHIP8_PROFILE
+            options.profilePath = argv[i] + 10;
+#else
+            printf("Error: --profile needs a build configured with -DCHIP8_PROFILE=ON\n");
+            return 1;
+#endif
+        } else {
+            printf("Error: Unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
 
     // Load ROM
-    if (!load_rom(&cpu, argv[1])) {
+    if (!load_rom(&cpu, argv[1], options.seed, &options.romHash)) {
         return 1;
     }
-    runEmulation(&cpu);
-    return 0;
-}
\ No newline at end of file
+    if (nativePath) {
+        ChipNative *native = nativeLoad(nativePath);
+        if (!native) {
+            return 1;
+        }
+        cpuSetNative(&cpu, native);
+    } else {
+        cpuSetEngine(&cpu, engine);
+    }
+    cpuSetQuirks(&cpu, options.quirks);
+    snprintf(statePath, sizeof(statePath), "%s.state", argv[1]);
+    return runEmulation(&cpu, &options) ? 0 : 1;
+}
@@ -0,0 +1,102 @@
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+#include "log.h"
+#include "native.h"
+//
+// A module only ever runs a block while the CPU's memory holds exactly the bytes it
+// was translated from, so loading one for the wrong ROM or a ROM that rewrites its
+// own code is safe: the blocks that don't match are left to the interpreter.
+//
+
+/**
+ * dlopen a module built by chip8_aot
+ *
+ * @return NULL if it can't be loaded or was built for a different core
+ */
+ChipNative *nativeLoad(const char *path)
+{
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        LOG_ERROR("Could not load native module %s: %s", path, dlerror());
+        return NULL;
+    }
+
+    const ChipNativeModule *module = dlsym(handle, CHIP_NATIVE_SYMBOL);
+    if (!module || module->abi != CHIP_NATIVE_ABI || module->cpuSize != sizeof(ChipCPU)
+        || module->quirks >= CHIP_QUIRKS_COUNT) {
+        LOG_ERROR("Not a native module for this build: %s", path);
+        dlclose(handle);
+        return NULL;
+    }
+
+    ChipNative *native = calloc(1, sizeof(ChipNative));
+    if (!native) {
+        dlclose(handle);
+        return NULL;
+    }
+    native->handle = handle;
+    native->module = module;
+    for (uint32_t i = 0; i < module->blockCount; i++) {
+        const ChipNativeBlock *block = &module->blocks[i];
+        // Blocks past the image couldn't be checked against it
+        if ((block->address & 1) == 0 && block->address >= PROGRAM_OFFSET && block->words > 0
+            && block->words <= BLOCK_MAX_LENGTH && block->count > 0
+            && (uint32_t)(block->address + block->words * 2) <= PROGRAM_OFFSET + module->size) {
+            native->entries[block->address >> 1] = block;
+        }
+    }
+    LOG_INFO("Loaded %u native blocks (%s) from %s", module->blockCount, cpuQuirksName(module->quirks), path);
+    return native;
+}
+
+void nativeFree(ChipNative *native)
+{
+    if (native) {
+        dlclose(native->handle);
+        free(native);
+    }
+}
+
+/**
+ * Run cpu on the native engine with blocks from native. Blocks are attached again
+ * whenever memory is replaced wholesale or the quirks change, see nativeAttach.
+ */
+void cpuSetNative(ChipCPU *cpu, const ChipNative *native)
+{
+    cpu->native = native;
+    cpuSetEngine(cpu, CHIP_ENGINE_NATIVE);
+}
+
+/**
+ * Mark the blocks whose code is still in memory as runnable, by setting their
+ * blockLength to the words they cover. Writes into those words clear it again, the
+ * same way they drop interpreter blocks. Nothing is attached if the CPU's quirks
+ * differ from the ones the module was translated for.
+ *
+ * @return Number of blocks attached
+ */
+uint32_t nativeAttach(ChipCPU *cpu)
+{
+    const ChipNative *native = cpu->native;
+    uint32_t attached = 0;
+
+    if (!native || cpu->quirks != native->module->quirks) {
+        return 0;
+    }
+    const ChipNativeModule *module = native->module;
+    for (uint32_t i = 0; i < module->blockCount; i++) {
+        const ChipNativeBlock *block = &module->blocks[i];
+        if (native->entries[block->address >> 1] != block
+            || block->address + block->words * 2 > cpu->memoryMask + 1) {
+            continue;
+        }
+        if (memcmp(&cpuMemory(cpu)[block->address], &module->image[block->address - PROGRAM_OFFSET],
+                   block->words * 2) == 0) {
+            cpuBlockLength(cpu)[block->address >> 1] = block->words;
+            cpuMarkBlockPages(cpu, block->address >> 1, block->words);
+            attached++;
+        }
+    }
+    return attached;
+}
@@ -0,0 +1,64 @@
+//
+// Native code for a ROM, compiled ahead of time by chip8_aot into a shared object
+// and run by CHIP_ENGINE_NATIVE in place of the interpreter's dispatch
+//
+
+#ifndef CHIP8_NATIVE_H
+#define CHIP8_NATIVE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "ChipCPU.h"
+
+// Bumped whenever the layout below or the contract of a block function changes
+#define CHIP_NATIVE_ABI 3
+// The one symbol a native module exports, a ChipNativeModule
+#define CHIP_NATIVE_SYMBOL "chip8NativeModule"
+
+/**
+ * What generated code calls back into. Instructions not worth translating (drawing,
+ * scrolling, memory writes, ...) are handed to execute, which runs the instruction
+ * at address on the interpreter, through its decode cache.
+ */
+typedef struct ChipNativeHost {
+    void (*execute)(ChipCPU *cpu, uint16_t address);
+} ChipNativeHost;
+
+/**
+ * One basic block translated to a C function. It runs count instructions exactly
+ * as the interpreter would and leaves PC at the next one to execute. The block was
+ * translated from the ROM bytes at address .. address + 2 * words, it is only used
+ * while memory still holds them.
+ */
+typedef struct ChipNativeBlock {
+    uint16_t address;
+    uint8_t words;   // Code words the translation depends on, at most BLOCK_MAX_LENGTH
+    uint8_t count;   // Instructions executed
+    void (*run)(ChipCPU *cpu, const ChipNativeHost *host);
+} ChipNativeBlock;
+
+typedef struct ChipNativeModule {
+    uint32_t abi;        // CHIP_NATIVE_ABI the module was generated for
+    uint32_t cpuSize;    // sizeof(ChipCPU) it was compiled against
+    uint8_t quirks;      // ChipQuirks baked into the translation
+    uint32_t size;       // ROM image the blocks were translated from, at PROGRAM_OFFSET
+    const uint8_t *image;
+    uint32_t blockCount;
+    const ChipNativeBlock *blocks;
+} ChipNativeModule;
+
+/**
+ * A loaded module. Read-only once loaded, any number of CPUs on any thread can use it.
+ */
+typedef struct ChipNative {
+    void *handle;
+    const ChipNativeModule *module;
+    const ChipNativeBlock *entries[DECODE_CACHE_SIZE];  // Block starting at each even address
+} ChipNative;
+
+ChipNative *nativeLoad(const char *path);
+void nativeFree(ChipNative *native);
+void cpuSetNative(ChipCPU *cpu, const ChipNative *native);
+uint32_t nativeAttach(ChipCPU *cpu);
+
+#endif //CHIP8_NATIVE_H
@@ -0,0 +1,69 @@
+#include <string.h>
+#include "pipeline.h"
+
+// Set in the middle index while it holds a frame the consumer has not taken yet
+#define MAILBOX_FRESH 4
+
+void mailboxInit(FrameMailbox *mailbox)
+{
+    memset(mailbox->frames, 0, sizeof(mailbox->frames));
+    mailbox->back = 0;
+    SDL_AtomicSet(&mailbox->middle, 1);
+    mailbox->front = 2;
+}
+
+/**
+ * The frame the producer fills next, it is not visible to the consumer until published
+ */
+VideoFrame *mailboxBack(FrameMailbox *mailbox)
+{
+    return &mailbox->frames[mailbox->back];
+}
+
+/**
+ * Hand the back frame over. If the consumer has not taken the previous one yet that
+ * frame is recycled as the new back frame, so a slow consumer just skips frames.
+ */
+void mailboxPublish(FrameMailbox *mailbox)
+{
+    // SDL_AtomicSet is only an acquire barrier on GCC, the release barrier makes the
+    // frame's contents visible before its index
+    SDL_MemoryBarrierRelease();
+    mailbox->back = SDL_AtomicSet(&mailbox->middle, mailbox->back | MAILBOX_FRESH) & ~MAILBOX_FRESH;
+    // Whatever the consumer read from the recycled frame happened before we write it
+    SDL_MemoryBarrierAcquire();
+}
+
+/**
+ * Take the newest published frame
+ *
+ * @return The frame, or NULL when nothing was published since the last call
+ */
+const VideoFrame *mailboxAcquire(FrameMailbox *mailbox)
+{
+    if (!(SDL_AtomicGet(&mailbox->middle) & MAILBOX_FRESH)) {
+        return NULL;
+    }
+    // Only this thread clears the fresh bit, so it is still set here. The barriers
+    // pair with mailboxPublish's: reads of the old front finish before it is handed
+    // back, and the new front's contents are visible once its index is.
+    SDL_MemoryBarrierRelease();
+    mailbox->front = SDL_AtomicSet(&mailbox->middle, mailbox->front) & ~MAILBOX_FRESH;
+    SDL_MemoryBarrierAcquire();
+    return &mailbox->frames[mailbox->front];
+}
+
+void keyStateSet(KeyState *keys, int key, bool down)
+{
+    int mask;
+    int updated;
+    do {
+        mask = SDL_AtomicGet(&keys->mask);
+        updated = down ? mask | (1 << key) : mask & ~(1 << key);
+    } while (!SDL_AtomicCAS(&keys->mask, mask, updated));
+}
+
+uint16_t keyStateGet(KeyState *keys)
+{
+    return (uint16_t)SDL_AtomicGet(&keys->mask);
+}
@@ -0,0 +1,48 @@
+//
+// Lock-free handoff between the emulation thread and the render thread: a triple
+// buffered framebuffer and the host key state as an atomic bitmask
+//
+
+#ifndef CHIP8_PIPELINE_H
+#define CHIP8_PIPELINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <SDL.h>
+#include "ChipCPU.h"
+
+typedef struct VideoFrame {
+    ChipDisplay display;
+    bool hires;
+} VideoFrame;
+
+/**
+ * Three frames owned in turn by the producer (back), the consumer (front) and
+ * neither (middle). Publishing swaps back with middle, acquiring swaps middle with
+ * front, so neither side ever waits for the other and the consumer always gets the
+ * newest finished frame.
+ */
+typedef struct FrameMailbox {
+    VideoFrame frames[3];
+    SDL_atomic_t middle;  // Index of the middle frame, MAILBOX_FRESH once published
+    int back;             // Producer only
+    int front;            // Consumer only
+} FrameMailbox;
+
+void mailboxInit(FrameMailbox *mailbox);
+VideoFrame *mailboxBack(FrameMailbox *mailbox);
+void mailboxPublish(FrameMailbox *mailbox);
+const VideoFrame *mailboxAcquire(FrameMailbox *mailbox);
+
+/**
+ * CHIP-8 keys held on the host, bit n is key n. Written by the event thread and
+ * applied to the CPU by the emulation thread at the start of each frame.
+ */
+typedef struct KeyState {
+    SDL_atomic_t mask;
+} KeyState;
+
+void keyStateSet(KeyState *keys, int key, bool down);
+uint16_t keyStateGet(KeyState *keys);
+
+#endif //CHIP8_PIPELINE_H
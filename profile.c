@@ -0,0 +1,114 @@
+#include <string.h>
+#include "log.h"
+#include "profile.h"
+
+static const char *phaseNames[PROFILE_PHASE_COUNT] = { "emulate", "render", "idle" };
+
+void profileReset(ChipProfile *profile)
+{
+    memset(profile, 0, sizeof(*profile));
+    profile->minFrameCycles = UINT32_MAX;
+}
+
+void profileFrame(ChipProfile *profile, uint32_t cycles)
+{
+    profile->frames++;
+    profile->cycles += cycles;
+    if (cycles < profile->minFrameCycles) {
+        profile->minFrameCycles = cycles;
+    }
+    if (cycles > profile->maxFrameCycles) {
+        profile->maxFrameCycles = cycles;
+    }
+}
+
+static uint32_t minFrameCycles(const ChipProfile *profile)
+{
+    return profile->frames ? profile->minFrameCycles : 0;
+}
+
+/**
+ * Dump as a single JSON object. Only opcodes and addresses that were hit are listed.
+ */
+void profileWriteJson(const ChipProfile *profile, FILE *out)
+{
+    bool first = true;
+
+    fprintf(out, "{\n  \"frames\": %llu,\n  \"cycles\": %llu,\n", (unsigned long long)profile->frames,
+            (unsigned long long)profile->cycles);
+    fprintf(out, "  \"frame_cycles\": {\"min\": %u, \"max\": %u, \"mean\": %.2f},\n", minFrameCycles(profile),
+            profile->maxFrameCycles, profile->frames ? (double)profile->cycles / (double)profile->frames : 0.0);
+
+    fprintf(out, "  \"phase_ns\": {");
+    for (int phase = 0; phase < PROFILE_PHASE_COUNT; phase++) {
+        fprintf(out, "%s\"%s\": %llu", phase ? ", " : "", phaseNames[phase],
+                (unsigned long long)atomic_load_explicit(&profile->phaseNs[phase], memory_order_relaxed));
+    }
+
+    fprintf(out, "},\n  \"opcodes\": {");
+    for (int handler = 0; handler < PROFILE_OPCODE_SLOTS; handler++) {
+        if (profile->opcodeCounts[handler]) {
+            fprintf(out, "%s\n    \"%s\": %llu", first ? "" : ",", cpuHandlerName(handler),
+                    (unsigned long long)profile->opcodeCounts[handler]);
+            first = false;
+        }
+    }
+
+    first = true;
+    fprintf(out, "\n  },\n  \"pc_hits\": {");
+    for (int address = 0; address < MEMORY_SIZE; address++) {
+        if (profile->pcHits[address]) {
+            fprintf(out, "%s\n    \"0x%03X\": %llu", first ? "" : ",", address,
+                    (unsigned long long)profile->pcHits[address]);
+            first = false;
+        }
+    }
+    fprintf(out, "\n  }\n}\n");
+}
+
+/**
+ * Dump as section,key,value rows so the heatmap can go straight into a spreadsheet
+ */
+void profileWriteCsv(const ChipProfile *profile, FILE *out)
+{
+    fprintf(out, "section,key,value\n");
+    fprintf(out, "frame,frames,%llu\n", (unsigned long long)profile->frames);
+    fprintf(out, "frame,cycles,%llu\n", (unsigned long long)profile->cycles);
+    fprintf(out, "frame,min_cycles,%u\n", minFrameCycles(profile));
+    fprintf(out, "frame,max_cycles,%u\n", profile->maxFrameCycles);
+    for (int phase = 0; phase < PROFILE_PHASE_COUNT; phase++) {
+        fprintf(out, "phase_ns,%s,%llu\n", phaseNames[phase],
+                (unsigned long long)atomic_load_explicit(&profile->phaseNs[phase], memory_order_relaxed));
+    }
+    for (int handler = 0; handler < PROFILE_OPCODE_SLOTS; handler++) {
+        if (profile->opcodeCounts[handler]) {
+            fprintf(out, "opcode,%s,%llu\n", cpuHandlerName(handler),
+                    (unsigned long long)profile->opcodeCounts[handler]);
+        }
+    }
+    for (int address = 0; address < MEMORY_SIZE; address++) {
+        if (profile->pcHits[address]) {
+            fprintf(out, "pc,0x%03X,%llu\n", address, (unsigned long long)profile->pcHits[address]);
+        }
+    }
+}
+
+/**
+ * Write the profile to filename, as CSV if it ends in .csv and JSON otherwise
+ */
+bool profileSave(const ChipProfile *profile, const char *filename)
+{
+    FILE *out = fopen(filename, "w");
+    if (!out) {
+        LOG_ERROR("Could not write profile: %s", filename);
+        return false;
+    }
+
+    size_t length = strlen(filename);
+    if (length >= 4 && strcmp(filename + length - 4, ".csv") == 0) {
+        profileWriteCsv(profile, out);
+    } else {
+        profileWriteJson(profile, out);
+    }
+    return fclose(out) == 0;
+}
@@ -0,0 +1,89 @@
+//
+// Opt-in instrumentation: opcode histogram, PC heatmap, cycles per frame, a
+// breakdown of where the frontend spends wall time, and edge coverage for fuzzing
+//
+
+#ifndef CHIP8_PROFILE_H
+#define CHIP8_PROFILE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "ChipCPU.h"
+
+#define PROFILE_OPCODE_SLOTS 64
+#define COVERAGE_MAP_SIZE 16384
+
+typedef enum ProfilePhase {
+    PROFILE_EMULATE = 0,
+    PROFILE_RENDER,
+    PROFILE_IDLE,
+    PROFILE_PHASE_COUNT
+} ProfilePhase;
+
+/**
+ * Counters filled in while cpu->profile points at one of these. The core only
+ * records anything when built with CHIP8_PROFILE, the phase times are filled in by
+ * the frontend from more than one thread.
+ */
+typedef struct ChipProfile {
+    uint64_t opcodeCounts[PROFILE_OPCODE_SLOTS];  // Per handler, slot 0 counts decode cache misses
+    uint64_t pcHits[MEMORY_SIZE];
+    uint64_t frames;
+    uint64_t cycles;  // Instructions that ran, what the idle fast-forward skipped doesn't count
+    uint32_t minFrameCycles;
+    uint32_t maxFrameCycles;
+    // The render thread charges its phase while the emulation thread charges and saves them
+    _Atomic uint64_t phaseNs[PROFILE_PHASE_COUNT];
+} ChipProfile;
+
+/**
+ * AFL-style edge coverage, filled in while cpu->coverage points at one of these and
+ * the core was built with CHIP8_COVERAGE. Every executed instruction bumps the
+ * counter for the (previous PC, PC) pair, hashed into the map.
+ */
+typedef struct ChipCoverage {
+    uint8_t *counters;  // COVERAGE_MAP_SIZE of them, e.g. libFuzzer's extra counters
+    uint16_t previous;  // Hash of the last PC, shifted, so A -> B and B -> A differ
+    // Counters bumped from 0, so a reader can skip the rest of the map. A counter
+    // that wraps is listed again; once the list is full the reader has to scan.
+    uint32_t touchedCount;
+    uint16_t touched[COVERAGE_MAP_SIZE];
+} ChipCoverage;
+
+static inline void coverageEdge(ChipCoverage *coverage, uint16_t address)
+{
+    // Multiplying by an odd constant is a bijection, it just spreads nearby PCs
+    uint16_t location = (uint16_t)(address * 0x9E37u);
+    uint16_t index = (location ^ coverage->previous) & (COVERAGE_MAP_SIZE - 1);
+    if (coverage->counters[index]++ == 0 && coverage->touchedCount < COVERAGE_MAP_SIZE) {
+        coverage->touched[coverage->touchedCount++] = index;
+    }
+    coverage->previous = location >> 1;
+}
+
+#ifdef CHIP8_PROFILE
+#define PROFILE_OP(cpu, handler) \
+    do { if ((cpu)->profile) (cpu)->profile->opcodeCounts[handler]++; } while (0)
+#define PROFILE_PC(cpu, address) \
+    do { if ((cpu)->profile) (cpu)->profile->pcHits[(address) & (MEMORY_SIZE - 1)]++; } while (0)
+#else
+#define PROFILE_OP(cpu, handler) do { } while (0)
+#define PROFILE_PC(cpu, address) do { } while (0)
+#endif
+
+#ifdef CHIP8_COVERAGE
+#define COVERAGE_PC(cpu, address) \
+    do { if ((cpu)->coverage) coverageEdge((cpu)->coverage, (uint16_t)(address)); } while (0)
+#else
+#define COVERAGE_PC(cpu, address) do { } while (0)
+#endif
+
+void profileReset(ChipProfile *profile);
+void profileFrame(ChipProfile *profile, uint32_t cycles);
+void profileWriteJson(const ChipProfile *profile, FILE *out);
+void profileWriteCsv(const ChipProfile *profile, FILE *out);
+bool profileSave(const ChipProfile *profile, const char *filename);
+
+#endif //CHIP8_PROFILE_H
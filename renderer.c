@@ -1,63 +1,118 @@
 #include <printf.h>
 #include <SDL.h>
-#include <SDL_mixer.h>
 #include "ChipCPU.h"
+#include "filters.h"
+#include "log.h"
+#include "renderer.h"
 #include <SDL_audio.h>
 
 SDL_Window *_window;
 SDL_Renderer *_renderer;
+SDL_Texture *_screen;
+// Resolution of _screen: the display's native resolution, follows it between lores
+// and hires, times the filter chain's scale
+int _screenWidth;
+int _screenHeight;
 
-Mix_Chunk *_tone = NULL;
+// Post-processing between the display and _screen, none unless rndr_set_filters
+// was given a chain. The display is expanded into _frame first when there is one.
+FilterChain _filters;
+Uint32 _frame[DISPLAY_HIRES_WIDTH * DISPLAY_HIRES_HEIGHT];
 
+// 1bpp -> ARGB expansion, one entry of 8 pixels per possible display byte
+Uint32 _pixelLUT[256][8];
+// Spreads the 8 pixels of a display byte over the bytes of a word, leftmost pixel in
+// the lowest byte, so the planes of 8 pixels combine into palette indices with shifts
+Uint64 _planeSpread[256];
+
+// Presents are throttled to the host refresh rate
+Uint64 _presentInterval;
+Uint64 _lastPresent;
+SDL_bool _framePending = SDL_FALSE;
+
+// Audio is synthesized on SDL's callback thread. The emulation side only publishes
+// how many samples of tone are left, the callback counts that down as it plays.
+#define AUDIO_SAMPLE_RATE 44100
+#define AUDIO_BUFFER_SAMPLES 512
+#define TONE_HZ 440
+#define STARTUP_BEEP_MS 100
 
 const int AMPLITUDE = 20000;
-const int FREQUENCY = 44100;
-Sint16 *toneSamples;
 
-void generateTone() {
-    const int duration = 100; // ms
-    const int sample_count = FREQUENCY * duration / 1000;
+SDL_AudioDeviceID _audioDevice = 0;
+int _audioRate = AUDIO_SAMPLE_RATE;
+SDL_atomic_t _toneSamplesLeft;
+// Only touched by the callback thread
+Uint32 _tonePhase = 0;
+Uint32 _tonePhaseStep = 0;
+
+/**
+ * Fill one buffer: square wave while tone samples are left, then silence. The phase
+ * accumulator's top bit is the square wave, so the pitch is exact at any rate.
+ */
+static void audio_callback(void *userdata, Uint8 *stream, int len)
+{
+    (void)userdata;
+    Sint16 *out = (Sint16 *)stream;
+    int count = len / (int)sizeof(Sint16);
+    int left;
+    int tone;
 
-    toneSamples = malloc(sizeof(Sint16) * sample_count);
-    if (!toneSamples) return;
+    // Claim up to a buffer's worth of the countdown, racing the emulation thread
+    do {
+        left = SDL_AtomicGet(&_toneSamplesLeft);
+        tone = left < count ? left : count;
+    } while (tone > 0 && !SDL_AtomicCAS(&_toneSamplesLeft, left, left - tone));
 
-    for (int i = 0; i < sample_count; i++) {
-        double t = (double)i / FREQUENCY;
-        toneSamples[i] = (sin(2.0 * M_PI * 440.0 * t) >= 0) ? AMPLITUDE : -AMPLITUDE;
+    for (int i = 0; i < tone; i++) {
+        out[i] = (_tonePhase & 0x80000000u) ? AMPLITUDE : -AMPLITUDE;
+        _tonePhase += _tonePhaseStep;
+    }
+    for (int i = tone; i < count; i++) {
+        out[i] = 0;
+    }
+    if (tone < count) {
+        // Every beep starts on the same edge
+        _tonePhase = 0;
     }
-
-    _tone = Mix_QuickLoad_RAW((Uint8 *)toneSamples, sample_count * sizeof(Sint16));
-    // do NOT free toneSamples yet; SDL_mixer uses it
 }
-void rndr_startupBeep() {
-    if (SDL_Init(SDL_INIT_AUDIO) < 0) {
-        printf("SDL could not initialize! %s\n", SDL_GetError());
+
+/**
+ * Open the output device and start the callback, once
+ */
+static void open_audio(void)
+{
+    if (_audioDevice) {
         return;
     }
-
-    if (Mix_OpenAudio(FREQUENCY, MIX_DEFAULT_FORMAT, 1, 4096) != 0) { // mono
-        printf("SDL_mixer could not initialize! %s\n", Mix_GetError());
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0) {
+        LOG_ERROR("SDL could not initialize! %s", SDL_GetError());
         return;
     }
 
-    generateTone();
+    SDL_AudioSpec want;
+    SDL_AudioSpec have;
+    SDL_zero(want);
+    want.freq = AUDIO_SAMPLE_RATE;
+    want.format = AUDIO_S16SYS;
+    want.channels = 1;
+    want.samples = AUDIO_BUFFER_SAMPLES;
+    want.callback = audio_callback;
 
-    if (!_tone) {
-        printf("Tone not generated\n");
+    _audioDevice = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if (!_audioDevice) {
+        LOG_ERROR("Error Initialising Audio : %s", SDL_GetError());
         return;
     }
+    _audioRate = have.freq;
+    _tonePhaseStep = (Uint32)(((Uint64)TONE_HZ << 32) / (Uint64)have.freq);
+    SDL_PauseAudioDevice(_audioDevice, 0);
+    LOG_INFO("Audio Initialised");
+}
 
-    // Play the tone
-    Mix_PlayChannel(0, _tone, 0);
-
-    // Wait long enough for it to play
-    SDL_Delay(400);
-
-    // Clean up
-    Mix_HaltChannel(0);
-    Mix_CloseAudio();
-    SDL_Quit();
-    if (toneSamples) free(toneSamples);
+void rndr_startupBeep() {
+    open_audio();
+    SDL_AtomicSet(&_toneSamplesLeft, _audioRate * STARTUP_BEEP_MS / 1000);
 }
 /**
  * Initialise SDL2 and output some useful display info
@@ -65,105 +120,233 @@ void rndr_startupBeep() {
 void initSDL()
 {
     if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
-        printf("[Error] SDL Init : %s \n", SDL_GetError());
+        LOG_ERROR("SDL Init : %s", SDL_GetError());
     } else {
-        printf("SDL INITIALISED\n");
+        LOG_INFO("SDL INITIALISED");
         SDL_DisplayMode dm;
-        SDL_GetCurrentDisplayMode(0, &dm);
+        int refreshRate = 60;
+        if (SDL_GetCurrentDisplayMode(0, &dm) == 0 && dm.refresh_rate > 0) {
+            refreshRate = dm.refresh_rate;
+        }
         SDL_SetWindowBordered(_window, SDL_FALSE);
-        printf("Display mode is %dx%dpx @ %dhz\n", dm.w, dm.h, dm.refresh_rate);
+        LOG_INFO("Display mode is %dx%dpx @ %dhz", dm.w, dm.h, dm.refresh_rate);
+        _presentInterval = SDL_GetPerformanceFrequency() / refreshRate;
     }
-    if (Mix_OpenAudio(FREQUENCY, MIX_DEFAULT_FORMAT, 1, 4096) != 0) {
-        printf("[Error] Error Initialising Audio : %s\n", SDL_GetError());
-    } else {
-        generateTone();
-        printf("Audio Initialised\n");
+    open_audio();
+}
+
+/**
+ * Build the tables that expand one display byte (8 pixels) into 8 ARGB pixels
+ */
+void build_pixel_lut()
+{
+    for (int byte = 0; byte < 256; byte++) {
+        _planeSpread[byte] = 0;
+        for (int bit = 0; bit < 8; bit++) {
+            _pixelLUT[byte][bit] = (byte & (0x80 >> bit)) ? cpuPalette[1] : cpuPalette[0];
+            if (byte & (0x80 >> bit)) {
+                _planeSpread[byte] |= 1ULL << (bit * 8);
+            }
+        }
+    }
+}
+
+/**
+ * Make the screen texture match the display's native resolution, it is only
+ * recreated when the mode changes
+ */
+static void resize_screen(int width, int height)
+{
+    if (_screen && width == _screenWidth && height == _screenHeight) {
+        return;
+    }
+    if (_screen) {
+        SDL_DestroyTexture(_screen);
+    }
+    _screen = SDL_CreateTexture(_renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                                width, height);
+    if (!_screen) {
+        LOG_ERROR("Could not create screen texture : %s", SDL_GetError());
     }
+    _screenWidth = width;
+    _screenHeight = height;
 }
 
 /**
  * Initialise an SDL Window and Renderer
  *
- * This uses SDL_CreateWindowAndRenderer. They can alternatively be created separately. See SDL2 Docs
+ * The Chip8 display lives in a single streaming texture at native resolution,
+ * the GPU scales it up to the window when it is copied. Hires is exactly twice
+ * lores, so the window keeps its size across mode switches.
  */
 void init_window_and_renderer()
 {
-    _window = SDL_CreateWindow("",0,0,DISPLAY_WIDTH * DISPLAY_SCALE,DISPLAY_HEIGHT * DISPLAY_SCALE, SDL_WINDOW_SHOWN);
+    // A whole number of filtered hires frames, at least as big as DISPLAY_SCALE makes a lores one
+    int scale = filterChainScale(&_filters);
+    int windowScale = (DISPLAY_WIDTH * DISPLAY_SCALE + DISPLAY_HIRES_WIDTH * scale - 1) / (DISPLAY_HIRES_WIDTH * scale);
+    _window = SDL_CreateWindow("",0,0,DISPLAY_HIRES_WIDTH * scale * windowScale,DISPLAY_HIRES_HEIGHT * scale * windowScale, SDL_WINDOW_SHOWN);
     _renderer = SDL_CreateRenderer(_window,-1, SDL_RENDERER_ACCELERATED);
+
+    // Nearest-neighbour scaling keeps the pixels sharp
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0");
+    resize_screen(DISPLAY_WIDTH * scale, DISPLAY_HEIGHT * scale);
+    build_pixel_lut();
+}
+
+
+
+/**
+ * Publish the sound timer to the audio thread as a sample countdown, one 60Hz tick
+ * is _audioRate / 60 samples. Called by the emulation thread after each batch of
+ * frames; nothing is published while the timer is unchanged, so a running startup
+ * beep is left alone.
+ */
+void rndr_play_audio(uint8_t soundTimer)
+{
+    static Uint8 published = 0;
+    if (soundTimer != published) {
+        SDL_AtomicSet(&_toneSamplesLeft, soundTimer * _audioRate / 60);
+        published = soundTimer;
+    }
 }
 
 
 
 /**
- * Play a sample audio file
+ * True if anything is drawn on planes other than plane 0
  */
-void rndr_play_audio(ChipCPU *cpu)
+static bool uses_color(const ChipDisplay *display, int height)
 {
-    if (cpu->soundTimer > 0 && _tone != NULL) {
-        if (!Mix_Playing(-1)) { // -1 = first available channel
-            Mix_PlayChannel(-1, _tone, 0);
+    uint64_t bits = 0;
+    for (int plane = 1; plane < DISPLAY_PLANES; plane++) {
+        for (int y = 0; y < height; y++) {
+            bits |= display->planes[plane][y][0] | display->planes[plane][y][1];
         }
     }
+    return bits != 0;
 }
 
+/**
+ * Expand the display into ARGB pixels, pitch in bytes
+ */
+static void expand_display(const ChipDisplay *display, int width, int height, Uint32 *pixels, int pitch)
+{
+    bool color = uses_color(display, height);
+
+    for (int y = 0; y < height; y++) {
+        Uint32 *dst = (Uint32 *)((Uint8 *)pixels + y * pitch);
 
+        // Expand the row a byte (8 pixels) at a time
+        for (int byte = 0; byte < width / 8; byte++) {
+            int word = byte / 8;
+            int shift = 56 - (byte % 8) * 8;
+
+            if (!color) {
+                memcpy(dst + byte * 8, _pixelLUT[(display->planes[0][y][word] >> shift) & 0xFF],
+                       sizeof(_pixelLUT[0]));
+                continue;
+            }
+            Uint64 indices = 0;
+            for (int plane = 0; plane < DISPLAY_PLANES; plane++) {
+                indices |= _planeSpread[(display->planes[plane][y][word] >> shift) & 0xFF] << plane;
+            }
+            for (int pixel = 0; pixel < 8; pixel++) {
+                dst[byte * 8 + pixel] = cpuPalette[(indices >> (pixel * 8)) & 0xF];
+            }
+        }
+    }
+}
 
 /**
- * Update the screen based on Chip8 display buffer
+ * Upload a new frame and present it, at most once per host refresh interval
+ *
+ * The texture is refreshed for every frame passed in, but presenting is deferred
+ * while the last present is less than a refresh interval ago; call again with NULL
+ * once the returned time has passed to present the pending frame.
  *
- * @param cpu Pointer to the ChipCPU struct
- * @param scale Scale factor for pixels (e.g., 10 means each chip8 pixel = 10x10 SDL pixels)
+ * @param display New display, or NULL to only present a pending frame
+ * @param hires Whether display is in 128x64 mode
+ * @return Milliseconds until the pending frame can be presented, -1 if none is pending
  */
-void rndr_update_screen(ChipCPU *cpu)
+int rndr_update_screen(const ChipDisplay *display, bool hires)
 {
-    // Only update if drawFlag is set
-    if (!cpu->drawFlag) {
-        return;
-    }
+    int width = hires ? DISPLAY_HIRES_WIDTH : DISPLAY_WIDTH;
+    int height = hires ? DISPLAY_HIRES_HEIGHT : DISPLAY_HEIGHT;
+    int scale = filterChainScale(&_filters);
 
-    // Clear the screen with black
-    SDL_SetRenderDrawColor(_renderer, 0, 0, 0, 255);
-    SDL_RenderClear(_renderer);
+    if (display) {
+        resize_screen(width * scale, height * scale);
+    }
+    if (display && _screen) {
+        void *pixels;
+        int pitch;
 
-    // Set draw color to white for "on" pixels
-    SDL_SetRenderDrawColor(_renderer, 255, 255, 255, 255);
-
-    // Chip8 display is 64x32 pixels
-    for (int y = 0; y < 32; y++) {
-        for (int x = 0; x < 64; x++) {
-            // Check if pixel is on
-            if (cpu->display[y * 64 + x]) {
-                SDL_Rect rect = {
-                        x * DISPLAY_SCALE,      // x position
-                        y * DISPLAY_SCALE,      // y position
-                        DISPLAY_SCALE,          // width
-                        DISPLAY_SCALE           // height
-                };
-                SDL_RenderFillRect(_renderer, &rect);
+        if (SDL_LockTexture(_screen, NULL, &pixels, &pitch) == 0) {
+            if (_filters.count == 0) {
+                expand_display(display, width, height, pixels, pitch);
+            } else {
+                FilterImage frame = { _frame, width, height, width };
+                FilterImage screen = { pixels, width * scale, height * scale, pitch / (int)sizeof(Uint32) };
+                expand_display(display, width, height, _frame, width * (int)sizeof(Uint32));
+                filterChainApply(&_filters, &frame, &screen);
             }
+            SDL_UnlockTexture(_screen);
         }
+        _framePending = SDL_TRUE;
+    }
+
+    if (!_framePending) {
+        return -1;
+    }
+
+    Uint64 now = SDL_GetPerformanceCounter();
+    if (now - _lastPresent < _presentInterval) {
+        Uint64 left = _presentInterval - (now - _lastPresent);
+        return (int)(left * 1000 / SDL_GetPerformanceFrequency()) + 1;
     }
 
-    // Present the rendered frame
+    // One scaled copy of the whole display, then present. With vsync this blocks
+    // the render thread only, emulation carries on.
+    SDL_RenderClear(_renderer);
+    SDL_RenderCopy(_renderer, _screen, NULL, NULL);
     SDL_RenderPresent(_renderer);
 
-    // Reset the draw flag
-    cpu->drawFlag = 0;
+    _lastPresent = now;
+    _framePending = SDL_FALSE;
+    return -1;
 }
 
 void rndr_destroy()
 {
+    if (_audioDevice)
+        SDL_CloseAudioDevice(_audioDevice);
 
-    if (toneSamples)
-        free(toneSamples);
-
-    Mix_CloseAudio();
+    // Texture & Renderer
+    if (_screen)
+        SDL_DestroyTexture(_screen);
+    filterChainFree(&_filters);
+    SDL_DestroyRenderer(_renderer);
 
     // Window
     SDL_DestroyWindow(_window);
     // SDL
     SDL_Quit();
-    exit(0);
+}
+
+/**
+ * Choose the display filters, see filterChainParse. Call before rndr_initialize_graphics,
+ * the window is sized for the chain.
+ *
+ * @return false if spec is invalid
+ */
+bool rndr_set_filters(const char *spec)
+{
+    if (!filterChainParse(&_filters, spec)) {
+        return false;
+    }
+    LOG_INFO("Display filters: %s (x%d, %s kernels)", spec, filterChainScale(&_filters),
+             filterIsaName(_filters.isa));
+    return true;
 }
 
 void rndr_initialize_graphics(){
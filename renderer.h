@@ -7,10 +7,11 @@
 
 #include "ChipCPU.h"
 
-void rndr_play_audio(ChipCPU *cpu);
+void rndr_play_audio(uint8_t soundTimer);
 void rndr_startupBeep();
 void rndr_destroy();
 void rndr_initialize_graphics();
-void rndr_update_screen(const ChipCPU *cpu);
+int rndr_update_screen(const ChipDisplay *display, bool hires);
+bool rndr_set_filters(const char *spec);
 
 #endif //CHIP8_RENDERER_H
@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "log.h"
+#include "replay.h"
+//
+// File layout, all little-endian:
+//   "C8RP" u16 version u16 quirks u64 seed u64 romHash u32 cyclesPerFrame
+//   u32 frameCount u32 eventCount, then per event a varint frame delta and u16 keys
+//
+// The quirks field was reserved (always 0) before profiles existed, which is the
+// modern profile those recordings ran with.
+//
+
+void recordingInit(Recording *recording, uint64_t seed, uint64_t romHash, uint32_t cyclesPerFrame,
+                   ChipQuirks quirks)
+{
+    memset(recording, 0, sizeof(*recording));
+    recording->seed = seed;
+    recording->romHash = romHash;
+    recording->cyclesPerFrame = cyclesPerFrame;
+    recording->quirks = (uint8_t)quirks;
+}
+
+void recordingFree(Recording *recording)
+{
+    free(recording->events);
+    recording->events = NULL;
+    recording->eventCount = 0;
+    recording->eventCapacity = 0;
+}
+
+static bool appendEvent(Recording *recording, uint32_t frame, uint16_t keys)
+{
+    if (recording->eventCount == recording->eventCapacity) {
+        uint32_t capacity = recording->eventCapacity ? recording->eventCapacity * 2 : 256;
+        ReplayEvent *grown = realloc(recording->events, sizeof(ReplayEvent) * capacity);
+        if (!grown) {
+            return false;
+        }
+        recording->events = grown;
+        recording->eventCapacity = capacity;
+    }
+    recording->events[recording->eventCount++] = (ReplayEvent){ frame, keys };
+    return true;
+}
+
+/**
+ * Call once at the start of every emulated frame, before the CPU runs it.
+ * Only frames where the key state differs from the previous one are stored.
+ */
+void recordingFrame(Recording *recording, const ChipCPU *cpu)
+{
+    uint16_t keys = cpuGetKeyMask(cpu);
+    uint16_t previous = recording->eventCount ? recording->events[recording->eventCount - 1].keys : 0;
+
+    if (keys != previous) {
+        appendEvent(recording, recording->frameCount, keys);
+    }
+    recording->frameCount++;
+}
+
+static void putLE(FILE *file, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++) {
+        fputc((int)((value >> (i * 8)) & 0xFF), file);
+    }
+}
+
+static bool getLE(FILE *file, uint64_t *value, int bytes)
+{
+    *value = 0;
+    for (int i = 0; i < bytes; i++) {
+        int c = fgetc(file);
+        if (c == EOF) {
+            return false;
+        }
+        *value |= (uint64_t)c << (i * 8);
+    }
+    return true;
+}
+
+bool recordingSave(const Recording *recording, const char *filename)
+{
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        LOG_ERROR("Could not write recording: %s", filename);
+        return false;
+    }
+
+    fwrite(REPLAY_MAGIC, 1, 4, file);
+    putLE(file, REPLAY_VERSION, 2);
+    putLE(file, recording->quirks, 2);
+    putLE(file, recording->seed, 8);
+    putLE(file, recording->romHash, 8);
+    putLE(file, recording->cyclesPerFrame, 4);
+    putLE(file, recording->frameCount, 4);
+    putLE(file, recording->eventCount, 4);
+
+    uint32_t lastFrame = 0;
+    for (uint32_t i = 0; i < recording->eventCount; i++) {
+        uint32_t delta = recording->events[i].frame - lastFrame;
+        while (delta >= 0x80) {
+            fputc((int)((delta & 0x7F) | 0x80), file);
+            delta >>= 7;
+        }
+        fputc((int)delta, file);
+        putLE(file, recording->events[i].keys, 2);
+        lastFrame = recording->events[i].frame;
+    }
+
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+bool recordingLoad(Recording *recording, const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        LOG_ERROR("Could not open recording: %s", filename);
+        return false;
+    }
+
+    char magic[4];
+    uint64_t version, quirks, seed, romHash, cyclesPerFrame, frameCount, eventCount;
+    bool ok = fread(magic, 1, 4, file) == 4 && memcmp(magic, REPLAY_MAGIC, 4) == 0
+              && getLE(file, &version, 2) && version == REPLAY_VERSION
+              && getLE(file, &quirks, 2) && quirks < CHIP_QUIRKS_COUNT
+              && getLE(file, &seed, 8)
+              && getLE(file, &romHash, 8)
+              && getLE(file, &cyclesPerFrame, 4)
+              && getLE(file, &frameCount, 4)
+              && getLE(file, &eventCount, 4);
+
+    if (ok) {
+        recordingInit(recording, seed, romHash, (uint32_t)cyclesPerFrame, (ChipQuirks)quirks);
+        recording->frameCount = (uint32_t)frameCount;
+    }
+
+    uint32_t frame = 0;
+    for (uint64_t i = 0; ok && i < eventCount; i++) {
+        uint32_t delta = 0;
+        int shift = 0;
+        int c;
+        while ((c = fgetc(file)) != EOF && (c & 0x80) && shift < 28) {
+            delta |= (uint32_t)(c & 0x7F) << shift;
+            shift += 7;
+        }
+        uint64_t keys;
+        // A fifth byte may only carry the top 4 bits, and events can't run backwards
+        // (wrap around) or past the last recorded frame
+        ok = c != EOF && !(shift == 28 && (c & 0xF0)) && getLE(file, &keys, 2);
+        if (ok) {
+            uint64_t next = (uint64_t)frame + (delta | ((uint32_t)c << shift));
+            ok = next <= frameCount && appendEvent(recording, (uint32_t)next, (uint16_t)keys);
+            frame = (uint32_t)next;
+        }
+    }
+    fclose(file);
+
+    if (!ok) {
+        LOG_ERROR("Not a valid recording: %s", filename);
+        recordingFree(recording);
+    }
+    return ok;
+}
+
+/**
+ * Run every recorded frame back to back on a CPU that already has the ROM loaded
+ * and was seeded with recording->seed. The CPU is switched to the recorded quirks.
+ *
+ * @return Number of instructions executed
+ */
+uint64_t replayRun(const Recording *recording, ChipCPU *cpu)
+{
+    uint32_t next = 0;
+    uint64_t executed = 0;
+
+    cpuSetQuirks(cpu, (ChipQuirks)recording->quirks);
+
+    for (uint32_t frame = 0; frame < recording->frameCount; frame++) {
+        while (next < recording->eventCount && recording->events[next].frame == frame) {
+            cpuSetKeyMask(cpu, recording->events[next].keys);
+            next++;
+        }
+        executed += cpuRunFrame(cpu, recording->cyclesPerFrame);
+    }
+    return executed;
+}
+
+/**
+ * replayRun for every lane of a loaded lockstep group, all lanes get the same input.
+ * The group's CPUs have to be set to the recorded quirks before they are loaded.
+ *
+ * @return Number of instructions executed, summed over all lanes
+ */
+uint64_t replayRunLockstep(const Recording *recording, LockstepGroup *group)
+{
+    uint32_t next = 0;
+    uint64_t executed = 0;
+
+    for (uint32_t frame = 0; frame < recording->frameCount; frame++) {
+        while (next < recording->eventCount && recording->events[next].frame == frame) {
+            for (uint32_t lane = 0; lane < group->count; lane++) {
+                lockstepSetKeyMask(group, lane, recording->events[next].keys);
+            }
+            next++;
+        }
+        executed += lockstepRunFrame(group, recording->cyclesPerFrame);
+    }
+    return executed;
+}
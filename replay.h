@@ -0,0 +1,43 @@
+//
+// Input recordings: key-state changes keyed by frame number, plus everything needed
+// (RNG seed, ROM hash, instructions per frame, quirks profile) to replay a session deterministically
+//
+
+#ifndef CHIP8_REPLAY_H
+#define CHIP8_REPLAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "ChipCPU.h"
+#include "lockstep.h"
+
+#define REPLAY_MAGIC "C8RP"
+#define REPLAY_VERSION 1
+
+typedef struct ReplayEvent {
+    uint32_t frame;  // Keys take effect at the start of this frame
+    uint16_t keys;   // Bit i set when key i is held
+} ReplayEvent;
+
+typedef struct Recording {
+    uint64_t seed;
+    uint64_t romHash;
+    uint32_t cyclesPerFrame;
+    uint8_t quirks;  // ChipQuirks profile the session ran with
+    uint32_t frameCount;
+    ReplayEvent *events;
+    uint32_t eventCount;
+    uint32_t eventCapacity;
+} Recording;
+
+void recordingInit(Recording *recording, uint64_t seed, uint64_t romHash, uint32_t cyclesPerFrame,
+                   ChipQuirks quirks);
+void recordingFree(Recording *recording);
+void recordingFrame(Recording *recording, const ChipCPU *cpu);
+bool recordingSave(const Recording *recording, const char *filename);
+bool recordingLoad(Recording *recording, const char *filename);
+
+uint64_t replayRun(const Recording *recording, ChipCPU *cpu);
+uint64_t replayRunLockstep(const Recording *recording, LockstepGroup *group);
+
+#endif //CHIP8_REPLAY_H
@@ -0,0 +1,172 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "log.h"
+#include "romcache.h"
+//
+// Files with identical contents share one RomImage, whatever their path. Opening
+// is not thread-safe, instantiating is.
+//
+
+#define ROM_CACHE_INITIAL_CAPACITY 16
+
+void romCacheInit(RomCache *cache)
+{
+    memset(cache, 0, sizeof(*cache));
+}
+
+static void freeImage(RomImage *image)
+{
+    munmap((void *)image->data, image->size);
+    cpuFree(image->boot);
+    free(image->boot);
+    free(image);
+}
+
+void romCacheFree(RomCache *cache)
+{
+    for (uint32_t i = 0; i < cache->capacity; i++) {
+        if (cache->slots[i]) {
+            freeImage(cache->slots[i]);
+        }
+    }
+    free(cache->slots);
+    memset(cache, 0, sizeof(*cache));
+}
+
+/**
+ * The slot holding an image with these contents, or the empty slot they go in. Two
+ * ROMs can share a hash, so a match is only taken once the bytes agree too.
+ */
+static RomImage **findSlot(RomImage **slots, uint32_t capacity, uint64_t hash, const uint8_t *data, size_t size)
+{
+    uint32_t index = (uint32_t)hash & (capacity - 1);
+    while (slots[index]
+           && (slots[index]->hash != hash || slots[index]->size != size
+               || memcmp(slots[index]->data, data, size) != 0)) {
+        index = (index + 1) & (capacity - 1);
+    }
+    return &slots[index];
+}
+
+static bool grow(RomCache *cache)
+{
+    uint32_t capacity = cache->capacity ? cache->capacity * 2 : ROM_CACHE_INITIAL_CAPACITY;
+    RomImage **slots = calloc(capacity, sizeof(RomImage *));
+    if (!slots) {
+        return false;
+    }
+    for (uint32_t i = 0; i < cache->capacity; i++) {
+        RomImage *image = cache->slots[i];
+        if (image) {
+            *findSlot(slots, capacity, image->hash, image->data, image->size) = image;
+        }
+    }
+    free(cache->slots);
+    cache->slots = slots;
+    cache->capacity = capacity;
+    return true;
+}
+
+static const uint8_t *mapFile(const char *path, size_t *size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOG_ERROR("Could not open ROM file: %s", path);
+        return NULL;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+        LOG_ERROR("Failed to read ROM file: %s", path);
+        close(fd);
+        return NULL;
+    }
+    if (info.st_size > MEMORY_SIZE - PROGRAM_OFFSET) {
+        LOG_ERROR("ROM too large to fit in memory: %s", path);
+        close(fd);
+        return NULL;
+    }
+
+    void *data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        LOG_ERROR("Could not map ROM file: %s", path);
+        return NULL;
+    }
+    *size = (size_t)info.st_size;
+    return data;
+}
+
+/**
+ * Map and hash a ROM file, reusing the cached image if the same contents were
+ * opened before
+ *
+ * @return NULL if the file can't be read or doesn't fit in memory
+ */
+const RomImage *romCacheOpen(RomCache *cache, const char *path)
+{
+    size_t size;
+    const uint8_t *data = mapFile(path, &size);
+    if (!data) {
+        return NULL;
+    }
+
+    uint64_t hash = cpuHashBytes(data, size);
+    if (cache->capacity) {
+        RomImage *cached = *findSlot(cache->slots, cache->capacity, hash, data, size);
+        if (cached) {
+            munmap((void *)data, size);
+            return cached;
+        }
+    }
+    // Keep the load factor under 3/4
+    if ((cache->count + 1) * 4 > cache->capacity * 3 && !grow(cache)) {
+        munmap((void *)data, size);
+        return NULL;
+    }
+
+    RomImage *image = calloc(1, sizeof(RomImage));
+    ChipCPU *boot = malloc(sizeof(ChipCPU));
+    if (!image || !boot) {
+        free(image);
+        free(boot);
+        munmap((void *)data, size);
+        return NULL;
+    }
+    cpuInit(boot, 0);
+    if (!cpuLoadProgram(boot, data, size)) {
+        free(image);
+        free(boot);
+        munmap((void *)data, size);
+        return NULL;
+    }
+    cpuPredecode(boot);
+
+    image->data = data;
+    image->size = size;
+    image->hash = hash;
+    image->boot = boot;
+    *findSlot(cache->slots, cache->capacity, hash, data, size) = image;
+    cache->count++;
+    return image;
+}
+
+/**
+ * Start cpu from the image's boot template. The result is the same state as
+ * cpuInit(cpu, seed) followed by loading the ROM. cpu is overwritten like by
+ * cpuCopy, so it must be zeroed or have been set up before.
+ *
+ * @return false if out of memory, which only XO-CHIP ROMs need
+ */
+bool romCacheInstantiate(const RomImage *image, ChipCPU *cpu, uint64_t seed)
+{
+    if (!cpuCopy(cpu, image->boot)) {
+        return false;
+    }
+    cpuSeed(cpu, seed);
+    return true;
+}
@@ -0,0 +1,36 @@
+//
+// Content-addressed ROM cache. Each ROM file is memory-mapped and hashed once and
+// keeps a ready-to-run boot template, so new instances start with a single copy.
+//
+
+#ifndef CHIP8_ROMCACHE_H
+#define CHIP8_ROMCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "ChipCPU.h"
+
+/**
+ * One distinct ROM image. Read-only once opened, so instances can be created from it
+ * on any thread.
+ */
+typedef struct RomImage {
+    const uint8_t *data;  // Mapped file contents
+    size_t size;
+    uint64_t hash;        // cpuHashBytes of the image, the same hash recordings store
+    ChipCPU *boot;        // Post-cpuInit state with the program loaded and pre-decoded
+} RomImage;
+
+typedef struct RomCache {
+    RomImage **slots;     // Open addressing on the content hash
+    uint32_t capacity;    // Power of two
+    uint32_t count;
+} RomCache;
+
+void romCacheInit(RomCache *cache);
+void romCacheFree(RomCache *cache);
+const RomImage *romCacheOpen(RomCache *cache, const char *path);
+bool romCacheInstantiate(const RomImage *image, ChipCPU *cpu, uint64_t seed);
+
+#endif //CHIP8_ROMCACHE_H
@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "log.h"
+#include "savestate.h"
+//
+// All multi-byte fields are stored little-endian so states move between hosts.
+//
+
+// memoryMask comes after everything but hires, planeMask and rpl
+#define STATE_MEMORY_MASK_OFFSET (STATE_BODY_SIZE - 2 - 2 - RPL_FLAG_COUNT)
+#define STATE_HIRES_OFFSET (STATE_MEMORY_MASK_OFFSET + 2)
+// stackPointer follows memory, PC, I, V and the stack
+#define STATE_STACK_POINTER_OFFSET (MEMORY_SIZE + 2 + 2 + V_REGISTER_COUNT + STACK_DEPTH * 2)
+
+static uint8_t *put16(uint8_t *out, uint16_t value)
+{
+    out[0] = value & 0xFF;
+    out[1] = value >> 8;
+    return out + 2;
+}
+
+static uint8_t *put64(uint8_t *out, uint64_t value)
+{
+    for (int i = 0; i < 8; i++) {
+        out[i] = (uint8_t)(value >> (i * 8));
+    }
+    return out + 8;
+}
+
+static const uint8_t *get16(const uint8_t *in, uint16_t *value)
+{
+    *value = (uint16_t)(in[0] | (in[1] << 8));
+    return in + 2;
+}
+
+static const uint8_t *get64(const uint8_t *in, uint64_t *value)
+{
+    *value = 0;
+    for (int i = 0; i < 8; i++) {
+        *value |= (uint64_t)in[i] << (i * 8);
+    }
+    return in + 8;
+}
+
+static void serializeBody(const ChipCPU *cpu, uint8_t *out)
+{
+    // Memory past memoryMask can't be reached, it is stored as zeroes
+    size_t addressable = (size_t)cpu->memoryMask + 1;
+    memcpy(out, cpuMemory(cpu), addressable);
+    memset(out + addressable, 0, MEMORY_SIZE - addressable);
+    out += MEMORY_SIZE;
+    out = put16(out, cpu->PC);
+    out = put16(out, cpu->I);
+    memcpy(out, cpu->V, V_REGISTER_COUNT);
+    out += V_REGISTER_COUNT;
+    for (int i = 0; i < STACK_DEPTH; i++) {
+        out = put16(out, cpu->stack[i]);
+    }
+    *out++ = cpu->stackPointer;
+    *out++ = cpu->soundTimer;
+    *out++ = cpu->delayTimer;
+    const uint64_t *display = &cpu->display.planes[0][0][0];
+    for (int i = 0; i < STATE_DISPLAY_WORDS; i++) {
+        out = put64(out, display[i]);
+    }
+    memcpy(out, cpu->keys, KEY_COUNT);
+    out += KEY_COUNT;
+    out = put64(out, cpu->rngState);
+    out = put16(out, cpu->memoryMask);
+    *out++ = cpu->hires;
+    *out++ = cpu->planeMask;
+    memcpy(out, cpu->rpl, RPL_FLAG_COUNT);
+}
+
+/**
+ * @return false if the state's memory size can't be set up, cpu is then unchanged
+ */
+static bool deserializeBody(ChipCPU *cpu, const uint8_t *in)
+{
+    uint16_t memoryMask;
+
+    get16(in + STATE_MEMORY_MASK_OFFSET, &memoryMask);
+    if (!cpuSetMemoryMask(cpu, memoryMask)) {
+        return false;
+    }
+    memcpy(cpuMemory(cpu), in, (size_t)memoryMask + 1);
+    in += MEMORY_SIZE;
+    in = get16(in, &cpu->PC);
+    in = get16(in, &cpu->I);
+    memcpy(cpu->V, in, V_REGISTER_COUNT);
+    in += V_REGISTER_COUNT;
+    for (int i = 0; i < STACK_DEPTH; i++) {
+        in = get16(in, &cpu->stack[i]);
+    }
+    cpu->stackPointer = *in++;
+    cpu->soundTimer = *in++;
+    cpu->delayTimer = *in++;
+    uint64_t *display = &cpu->display.planes[0][0][0];
+    for (int i = 0; i < STATE_DISPLAY_WORDS; i++) {
+        in = get64(in, &display[i]);
+    }
+    memcpy(cpu->keys, in, KEY_COUNT);
+    in += KEY_COUNT;
+    in = get64(in, &cpu->rngState);
+    in += 2;  // memoryMask, set up front
+    cpu->hires = *in++;
+    cpu->planeMask = *in++;
+    memcpy(cpu->rpl, in, RPL_FLAG_COUNT);
+
+    // Memory was replaced wholesale, nothing decoded from it is valid anymore
+    cpuInvalidateDecodeCache(cpu);
+    cpu->drawFlag = 1;
+    cpu->dirtyRows = DISPLAY_ALL_ROWS;
+    return true;
+}
+
+/**
+ * Write a complete save state into buffer, which must hold STATE_SIZE bytes
+ *
+ * @return Number of bytes written
+ */
+size_t stateSerialize(const ChipCPU *cpu, uint8_t *buffer)
+{
+    memcpy(buffer, STATE_MAGIC, 4);
+    put16(buffer + 4, STATE_VERSION);
+    put16(buffer + 6, 0);
+    serializeBody(cpu, buffer + STATE_HEADER_SIZE);
+    return STATE_SIZE;
+}
+
+/**
+ * Check the fields the core indexes with, a state from disk might have any bytes in them
+ */
+static bool bodyIsValid(const uint8_t *in)
+{
+    uint16_t memoryMask;
+
+    get16(in + STATE_MEMORY_MASK_OFFSET, &memoryMask);
+    return in[STATE_STACK_POINTER_OFFSET] <= STACK_DEPTH && in[STATE_HIRES_OFFSET] <= 1
+           && (memoryMask == CHIP8_MEMORY_SIZE - 1 || memoryMask == MEMORY_SIZE - 1);
+}
+
+/**
+ * Restore a save state produced by stateSerialize. The CPU is left untouched if the
+ * buffer is not a valid state of this version or memory runs out.
+ */
+bool stateDeserialize(ChipCPU *cpu, const uint8_t *buffer, size_t size)
+{
+    uint16_t version;
+
+    if (size != STATE_SIZE || memcmp(buffer, STATE_MAGIC, 4) != 0) {
+        return false;
+    }
+    get16(buffer + 4, &version);
+    if (version != STATE_VERSION || !bodyIsValid(buffer + STATE_HEADER_SIZE)) {
+        return false;
+    }
+    return deserializeBody(cpu, buffer + STATE_HEADER_SIZE);
+}
+
+bool stateSaveFile(const ChipCPU *cpu, const char *filename)
+{
+    uint8_t buffer[STATE_SIZE];
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        LOG_ERROR("Could not write save state: %s", filename);
+        return false;
+    }
+
+    size_t size = stateSerialize(cpu, buffer);
+    bool ok = fwrite(buffer, 1, size, file) == size;
+    fclose(file);
+    return ok;
+}
+
+bool stateLoadFile(ChipCPU *cpu, const char *filename)
+{
+    uint8_t buffer[STATE_SIZE + 1];
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        LOG_ERROR("Could not open save state: %s", filename);
+        return false;
+    }
+
+    size_t size = fread(buffer, 1, sizeof(buffer), file);
+    fclose(file);
+    if (!stateDeserialize(cpu, buffer, size)) {
+        LOG_ERROR("Not a compatible save state: %s", filename);
+        return false;
+    }
+    return true;
+}
+
+// ------- Rewind ring ------- //
+
+static uint8_t *putVarint(uint8_t *out, uint32_t value)
+{
+    while (value >= 0x80) {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+static const uint8_t *getVarint(const uint8_t *in, uint32_t *value)
+{
+    uint32_t result = 0;
+    int shift = 0;
+    while (*in & 0x80) {
+        result |= (uint32_t)(*in++ & 0x7F) << shift;
+        shift += 7;
+    }
+    *value = result | ((uint32_t)*in++ << shift);
+    return in;
+}
+
+/**
+ * Encode current XOR key as runs of (zero count, literal count, literal bytes).
+ * Zero runs shorter than 3 bytes are folded into the literals, which bounds the
+ * output to a little over the input size even for noisy frames.
+ */
+static uint32_t encodeDelta(const uint8_t *current, const uint8_t *key, uint8_t *out)
+{
+    uint8_t *start = out;
+    uint32_t pos = 0;
+
+    while (pos < STATE_BODY_SIZE) {
+        uint32_t zeros = 0;
+        while (pos + zeros < STATE_BODY_SIZE && current[pos + zeros] == key[pos + zeros]) {
+            zeros++;
+        }
+        pos += zeros;
+
+        uint32_t literals = 0;
+        while (pos + literals < STATE_BODY_SIZE) {
+            uint32_t run = 0;
+            while (run < 3 && pos + literals + run < STATE_BODY_SIZE
+                   && current[pos + literals + run] == key[pos + literals + run]) {
+                run++;
+            }
+            if (run == 3 || pos + literals + run == STATE_BODY_SIZE) {
+                break;
+            }
+            literals += run + 1;
+        }
+
+        out = putVarint(out, zeros);
+        out = putVarint(out, literals);
+        for (uint32_t i = 0; i < literals; i++) {
+            *out++ = current[pos + i] ^ key[pos + i];
+        }
+        pos += literals;
+    }
+    return (uint32_t)(out - start);
+}
+
+static void decodeDelta(const uint8_t *delta, uint32_t size, const uint8_t *key, uint8_t *out)
+{
+    const uint8_t *end = delta + size;
+    uint32_t pos = 0;
+
+    memcpy(out, key, STATE_BODY_SIZE);
+    while (delta < end) {
+        uint32_t zeros;
+        uint32_t literals;
+        delta = getVarint(delta, &zeros);
+        delta = getVarint(delta, &literals);
+        pos += zeros;
+        for (uint32_t i = 0; i < literals; i++) {
+            out[pos++] ^= *delta++;
+        }
+    }
+}
+
+static RewindSlot *slotAt(const RewindBuffer *rewind, uint64_t seq)
+{
+    return &rewind->slots[seq % rewind->capacity];
+}
+
+static bool storeSlot(RewindSlot *slot, const uint8_t *data, uint32_t size)
+{
+    if (slot->capacity < size) {
+        uint8_t *grown = realloc(slot->data, size);
+        if (!grown) {
+            return false;
+        }
+        slot->data = grown;
+        slot->capacity = size;
+    }
+    memcpy(slot->data, data, size);
+    slot->size = size;
+    return true;
+}
+
+bool rewindInit(RewindBuffer *rewind, uint32_t frames)
+{
+    memset(rewind, 0, sizeof(*rewind));
+    rewind->slots = calloc(frames, sizeof(RewindSlot));
+    if (!rewind->slots) {
+        return false;
+    }
+    rewind->capacity = frames;
+    return true;
+}
+
+void rewindFree(RewindBuffer *rewind)
+{
+    for (uint32_t i = 0; i < rewind->capacity; i++) {
+        free(rewind->slots[i].data);
+    }
+    free(rewind->slots);
+    rewind->slots = NULL;
+    rewind->capacity = 0;
+}
+
+/**
+ * Drop the oldest snapshot. Deltas can't outlive their keyframe, so evicting a
+ * keyframe also evicts the frames that depend on it.
+ */
+static void evictOldest(RewindBuffer *rewind)
+{
+    uint64_t key = rewind->tail;
+    rewind->tail++;
+    while (rewind->tail < rewind->head && !slotAt(rewind, rewind->tail)->isKey
+           && slotAt(rewind, rewind->tail)->keySeq == key) {
+        rewind->tail++;
+    }
+}
+
+/**
+ * Record the current frame
+ */
+void rewindPush(RewindBuffer *rewind, const ChipCPU *cpu)
+{
+    if (rewind->capacity == 0) {
+        return;
+    }
+    if (rewind->head - rewind->tail == rewind->capacity) {
+        evictOldest(rewind);
+    }
+
+    uint64_t seq = rewind->head;
+    RewindSlot *slot = slotAt(rewind, seq);
+    serializeBody(cpu, rewind->scratch);
+
+    uint64_t keySeq = 0;
+    bool haveKey = false;
+    if (seq > rewind->tail) {
+        RewindSlot *previous = slotAt(rewind, seq - 1);
+        keySeq = previous->isKey ? seq - 1 : previous->keySeq;
+        haveKey = keySeq >= rewind->tail && seq - keySeq < REWIND_KEYFRAME_INTERVAL;
+    }
+
+    bool stored;
+    if (haveKey) {
+        uint32_t size = encodeDelta(rewind->scratch, slotAt(rewind, keySeq)->data, rewind->encoded);
+        stored = storeSlot(slot, rewind->encoded, size);
+        slot->isKey = false;
+        slot->keySeq = keySeq;
+    } else {
+        stored = storeSlot(slot, rewind->scratch, STATE_BODY_SIZE);
+        slot->isKey = true;
+        slot->keySeq = seq;
+    }
+    if (stored) {
+        rewind->head++;
+    }
+}
+
+/**
+ * Restore the most recent snapshot into cpu and remove it from the ring
+ *
+ * @return false once there is nothing left to rewind to, or if out of memory
+ */
+bool rewindPop(RewindBuffer *rewind, ChipCPU *cpu)
+{
+    if (rewind->head == rewind->tail) {
+        return false;
+    }
+
+    rewind->head--;
+    RewindSlot *slot = slotAt(rewind, rewind->head);
+    if (slot->isKey) {
+        return deserializeBody(cpu, slot->data);
+    }
+    decodeDelta(slot->data, slot->size, slotAt(rewind, slot->keySeq)->data, rewind->scratch);
+    return deserializeBody(cpu, rewind->scratch);
+}
+
+size_t rewindMemoryUsage(const RewindBuffer *rewind)
+{
+    size_t total = sizeof(RewindSlot) * rewind->capacity;
+    for (uint64_t seq = rewind->tail; seq < rewind->head; seq++) {
+        total += slotAt(rewind, seq)->size;
+    }
+    return total;
+}
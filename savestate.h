@@ -0,0 +1,57 @@
+//
+// Versioned binary save states and an in-memory rewind ring for ChipCPU
+//
+
+#ifndef CHIP8_SAVESTATE_H
+#define CHIP8_SAVESTATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "ChipCPU.h"
+
+#define STATE_MAGIC "C8SS"
+#define STATE_VERSION 2
+#define STATE_HEADER_SIZE 8
+#define STATE_DISPLAY_WORDS (DISPLAY_PLANES * DISPLAY_HIRES_HEIGHT * DISPLAY_ROW_WORDS)
+// memory, PC, I, V, stack, stackPointer, soundTimer, delayTimer, display, keys, rngState,
+// memoryMask, hires, planeMask, rpl
+#define STATE_BODY_SIZE (MEMORY_SIZE + 2 + 2 + V_REGISTER_COUNT + STACK_DEPTH * 2 + 3 \
+                         + STATE_DISPLAY_WORDS * 8 + KEY_COUNT + 8 + 2 + 2 + RPL_FLAG_COUNT)
+#define STATE_SIZE (STATE_HEADER_SIZE + STATE_BODY_SIZE)
+
+#define REWIND_KEYFRAME_INTERVAL 60
+
+size_t stateSerialize(const ChipCPU *cpu, uint8_t *buffer);
+bool stateDeserialize(ChipCPU *cpu, const uint8_t *buffer, size_t size);
+bool stateSaveFile(const ChipCPU *cpu, const char *filename);
+bool stateLoadFile(ChipCPU *cpu, const char *filename);
+
+typedef struct RewindSlot {
+    uint8_t *data;       // Raw body for keyframes, XOR/RLE delta against the keyframe otherwise
+    uint32_t size;
+    uint32_t capacity;
+    uint64_t keySeq;     // Sequence number of the keyframe this slot is relative to
+    bool isKey;
+} RewindSlot;
+
+/**
+ * Ring of per-frame snapshots. Every REWIND_KEYFRAME_INTERVAL frames a full state
+ * is kept, the frames in between only store what changed since that keyframe.
+ */
+typedef struct RewindBuffer {
+    RewindSlot *slots;
+    uint32_t capacity;
+    uint64_t head;       // Sequence number of the next snapshot
+    uint64_t tail;       // Sequence number of the oldest snapshot still held
+    uint8_t scratch[STATE_BODY_SIZE];
+    uint8_t encoded[STATE_BODY_SIZE + STATE_BODY_SIZE / 2 + 16];  // Worst-case delta
+} RewindBuffer;
+
+bool rewindInit(RewindBuffer *rewind, uint32_t frames);
+void rewindFree(RewindBuffer *rewind);
+void rewindPush(RewindBuffer *rewind, const ChipCPU *cpu);
+bool rewindPop(RewindBuffer *rewind, ChipCPU *cpu);
+size_t rewindMemoryUsage(const RewindBuffer *rewind);
+
+#endif //CHIP8_SAVESTATE_H
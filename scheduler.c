@@ -0,0 +1,46 @@
+#include "scheduler.h"
+
+void schedInit(FrameScheduler *sched, uint64_t now, uint64_t frequency, uint32_t maxCatchUp)
+{
+    sched->frequency = frequency;
+    sched->frameTicks = frequency / FRAME_HZ;
+    sched->maxCatchUp = maxCatchUp;
+    schedResync(sched, now);
+}
+
+/**
+ * Forget any accumulated lag, the next frame is due one frame from now
+ */
+void schedResync(FrameScheduler *sched, uint64_t now)
+{
+    sched->nextFrame = now + sched->frameTicks;
+}
+
+/**
+ * Number of frames that should be emulated right now.
+ *
+ * Deadlines advance by exactly one frame each, so the long-run rate is 60Hz regardless
+ * of when the caller wakes up. After a host stall at most maxCatchUp frames are run
+ * back to back, anything beyond that is dropped rather than fast-forwarded.
+ */
+uint32_t schedFramesDue(FrameScheduler *sched, uint64_t now)
+{
+    if (now < sched->nextFrame) {
+        return 0;
+    }
+
+    uint64_t behind = (now - sched->nextFrame) / sched->frameTicks + 1;
+    if (behind > sched->maxCatchUp) {
+        // Too far behind, drop the excess and restart the cadence from now
+        schedResync(sched, now);
+        return sched->maxCatchUp;
+    }
+
+    sched->nextFrame += behind * sched->frameTicks;
+    return (uint32_t)behind;
+}
+
+uint64_t schedTicksUntilNextFrame(const FrameScheduler *sched, uint64_t now)
+{
+    return now < sched->nextFrame ? sched->nextFrame - now : 0;
+}
@@ -0,0 +1,25 @@
+//
+// Fixed 60Hz frame scheduler driven by a monotonic high-resolution counter
+//
+
+#ifndef CHIP8_SCHEDULER_H
+#define CHIP8_SCHEDULER_H
+
+#include <stdint.h>
+
+#define FRAME_HZ 60
+#define MAX_CATCH_UP_FRAMES 4
+
+typedef struct FrameScheduler {
+    uint64_t frequency;    // Counter ticks per second
+    uint64_t frameTicks;   // Counter ticks per 60Hz frame
+    uint64_t nextFrame;    // Counter value at which the next frame is due
+    uint32_t maxCatchUp;   // Frames run back to back after a stall before time is dropped
+} FrameScheduler;
+
+void schedInit(FrameScheduler *sched, uint64_t now, uint64_t frequency, uint32_t maxCatchUp);
+void schedResync(FrameScheduler *sched, uint64_t now);
+uint32_t schedFramesDue(FrameScheduler *sched, uint64_t now);
+uint64_t schedTicksUntilNextFrame(const FrameScheduler *sched, uint64_t now);
+
+#endif //CHIP8_SCHEDULER_H
@@ -0,0 +1,235 @@
+//
+// Engine equivalence: a ROM run on every engine, in lockstep and through fork /
+// restore has to pass through exactly the states the interpreter does. Registered
+// with CTest on breakout, see CMakeLists.txt.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ChipCPU.h"
+#include "fork.h"
+#include "lockstep.h"
+#include "log.h"
+#include "native.h"
+
+#define FRAMES 1200
+#define CYCLES_PER_FRAME 11
+#define CHECK_EVERY 60
+#define CHECKPOINTS (FRAMES / CHECK_EVERY)
+// Frames a CPU runs past a fork before it is restored
+#define FORK_DETOUR 25
+
+static uint8_t rom[MEMORY_SIZE];
+static size_t romSize;
+static ChipNative *native;
+static int failures;
+
+// Reference hashes from the interpreter, per quirks profile, lane and checkpoint
+static uint64_t expected[CHIP_QUIRKS_COUNT][LOCKSTEP_LANES][CHECKPOINTS];
+
+/**
+ * Held keys for a frame: left and right in turns with short releases in between,
+ * shifted per lane so lockstep lanes take different branches
+ */
+static uint16_t keysAt(uint32_t frame, uint32_t lane)
+{
+    uint32_t shifted = frame + lane * 3;
+    if (shifted % 40 < 4) {
+        return 0;
+    }
+    return (uint16_t)(((shifted / 40) % 2) ? 1u << 4 : 1u << 6);
+}
+
+static void start(ChipCPU *cpu, ChipQuirks quirks, uint32_t lane, ChipEngine engine)
+{
+    cpuFree(cpu);
+    cpuInit(cpu, lane);
+    if (!cpuLoadProgram(cpu, rom, romSize)) {
+        fprintf(stderr, "Error: Could not load the ROM\n");
+        exit(1);
+    }
+    if (engine == CHIP_ENGINE_NATIVE) {
+        cpuSetNative(cpu, native);
+    } else {
+        cpuSetEngine(cpu, engine);
+    }
+    cpuSetQuirks(cpu, quirks);
+}
+
+static void check(const char *what, ChipQuirks quirks, uint32_t lane, uint32_t checkpoint, uint64_t hash)
+{
+    if (hash != expected[quirks][lane][checkpoint]) {
+        fprintf(stderr, "FAIL: %s, %s quirks, lane %u, frame %u: %016llx, interpreter %016llx\n", what,
+                cpuQuirksName(quirks), lane, (checkpoint + 1) * CHECK_EVERY, (unsigned long long)hash,
+                (unsigned long long)expected[quirks][lane][checkpoint]);
+        failures++;
+    }
+}
+
+/**
+ * Run every lane on one scalar engine, either recording the reference hashes or
+ * checking against them
+ */
+static void runScalar(ChipCPU *cpu, ChipQuirks quirks, ChipEngine engine, const char *what)
+{
+    for (uint32_t lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        start(cpu, quirks, lane, engine);
+        for (uint32_t frame = 0; frame < FRAMES; frame++) {
+            cpuSetKeyMask(cpu, keysAt(frame, lane));
+            cpuRunFrame(cpu, CYCLES_PER_FRAME);
+            if ((frame + 1) % CHECK_EVERY == 0) {
+                uint32_t checkpoint = frame / CHECK_EVERY;
+                if (what) {
+                    check(what, quirks, lane, checkpoint, cpuStateHash(cpu));
+                } else {
+                    expected[quirks][lane][checkpoint] = cpuStateHash(cpu);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * All lanes in one lockstep group, stored back to their CPUs at every checkpoint
+ */
+static void runLockstep(ChipCPU *const *cpus, LockstepGroup *group, ChipQuirks quirks)
+{
+    for (uint32_t lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        start(cpus[lane], quirks, lane, CHIP_ENGINE_INTERPRETER);
+    }
+    lockstepLoad(group, cpus, LOCKSTEP_LANES);
+    for (uint32_t frame = 0; frame < FRAMES; frame++) {
+        for (uint32_t lane = 0; lane < LOCKSTEP_LANES; lane++) {
+            lockstepSetKeyMask(group, lane, keysAt(frame, lane));
+        }
+        lockstepRunFrame(group, CYCLES_PER_FRAME);
+        if ((frame + 1) % CHECK_EVERY == 0) {
+            lockstepStore(group);
+            for (uint32_t lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                check("lockstep", quirks, lane, frame / CHECK_EVERY, cpuStateHash(cpus[lane]));
+            }
+            lockstepLoad(group, cpus, LOCKSTEP_LANES);
+        }
+    }
+    lockstepStore(group);
+}
+
+/**
+ * Fork at every checkpoint next to a full cpuCopy, run a detour, then go back with
+ * cpuRestoreFork or cpuRewindFork in turns. The restored CPU has to match the copy
+ * and carry on exactly like the interpreter did.
+ */
+static void runForks(ChipCPU *cpu, ChipCPU *copy, ChipQuirks quirks, ChipEngine engine, const char *what)
+{
+    ChipFork *base = NULL;
+
+    start(cpu, quirks, 0, engine);
+    for (uint32_t frame = 0; frame < FRAMES; frame++) {
+        cpuSetKeyMask(cpu, keysAt(frame, 0));
+        cpuRunFrame(cpu, CYCLES_PER_FRAME);
+        if ((frame + 1) % CHECK_EVERY != 0) {
+            continue;
+        }
+        uint32_t checkpoint = frame / CHECK_EVERY;
+        ChipFork *fork = cpuFork(cpu, base);
+        if (!fork || !cpuCopy(copy, cpu)) {
+            fprintf(stderr, "Error: Out of memory\n");
+            exit(1);
+        }
+        forkRelease(base);
+        base = fork;
+
+        for (uint32_t detour = 0; detour < FORK_DETOUR; detour++) {
+            cpuSetKeyMask(cpu, keysAt(frame + detour, 7));
+            cpuRunFrame(cpu, CYCLES_PER_FRAME);
+        }
+        if (checkpoint % 2) {
+            cpuRewindFork(cpu, fork);
+        } else if (!cpuRestoreFork(cpu, fork)) {
+            fprintf(stderr, "Error: Out of memory\n");
+            exit(1);
+        }
+        if (cpuStateHash(cpu) != cpuStateHash(copy)) {
+            fprintf(stderr, "FAIL: %s, %s quirks, frame %u: restored fork differs from the copy\n", what,
+                    cpuQuirksName(quirks), frame + 1);
+            failures++;
+        }
+        check(what, quirks, 0, checkpoint, cpuStateHash(cpu));
+    }
+    forkRelease(base);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *nativePath = NULL;
+
+    if (argc < 2) {
+        printf("Usage: chip8_equivalence <rom> [--native=FILE.so]\n");
+        return 1;
+    }
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "--native=", 9) == 0) {
+            nativePath = argv[i] + 9;
+        } else {
+            printf("Error: Unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    logSetLevel(LOG_LEVEL_WARN);
+
+    FILE *file = fopen(argv[1], "rb");
+    if (!file) {
+        fprintf(stderr, "Error: Could not open ROM: %s\n", argv[1]);
+        return 1;
+    }
+    romSize = fread(rom, 1, sizeof(rom) - PROGRAM_OFFSET, file);
+    fclose(file);
+
+    if (nativePath) {
+        native = nativeLoad(nativePath);
+        if (!native) {
+            return 1;
+        }
+    }
+
+    ChipCPU *cpus[LOCKSTEP_LANES];
+    ChipCPU *copy = calloc(1, sizeof(ChipCPU));
+    LockstepGroup *group = lockstepCreate();
+    bool ready = copy && group;
+    for (uint32_t lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        cpus[lane] = calloc(1, sizeof(ChipCPU));
+        ready = ready && cpus[lane];
+    }
+    if (!ready) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 1;
+    }
+
+    for (int quirks = 0; quirks < CHIP_QUIRKS_COUNT; quirks++) {
+        runScalar(cpus[0], (ChipQuirks)quirks, CHIP_ENGINE_INTERPRETER, NULL);
+        runScalar(cpus[0], (ChipQuirks)quirks, CHIP_ENGINE_BLOCK, "block");
+        // Blocks only attach on the profile the module was compiled for
+        if (native) {
+            runScalar(cpus[0], (ChipQuirks)quirks, CHIP_ENGINE_NATIVE, "native");
+        }
+        runLockstep(cpus, group, (ChipQuirks)quirks);
+        runForks(cpus[0], copy, (ChipQuirks)quirks, CHIP_ENGINE_INTERPRETER, "fork");
+        runForks(cpus[0], copy, (ChipQuirks)quirks, CHIP_ENGINE_BLOCK, "fork on blocks");
+    }
+
+    for (uint32_t lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        cpuFree(cpus[lane]);
+        free(cpus[lane]);
+    }
+    cpuFree(copy);
+    free(copy);
+    lockstepDestroy(group);
+    nativeFree(native);
+
+    if (failures) {
+        fprintf(stderr, "%d mismatches\n", failures);
+        return 1;
+    }
+    printf("All engines match the interpreter%s\n", native ? ", including native" : "");
+    return 0;
+}